@@ -7,7 +7,19 @@
  */
 
 #ifdef ZT_CHUNKSIZE
-static inline void ACSS(short *dst, short *src)
+
+/*
+ * Which ACSS/SCSS and CONVOLVE2_BLOCK implementation to use.  Picked once
+ * by zt_arith_init() at module load; may be forced from /etc/system (set
+ * zaptel:zt_arith=N) to fall back to the plain C loops.
+ */
+#define ZT_ARITH_C	0	/* Reference scalar loops */
+#define ZT_ARITH_SWAR	1	/* 4 x 16-bit lanes in a 64-bit register */
+#define ZT_ARITH_SSE2	2	/* paddsw/psubsw on %xmm, CONFIG_ZAPTEL_SSE2 */
+
+extern int zt_arith;
+
+static inline void __ACSS_C(short *dst, short *src)
 {
 	int x,sum;
 	/* Add src to dst with saturation, storing in dst */
@@ -21,10 +33,10 @@ static inline void ACSS(short *dst, short *src)
 	}
 }
 
-static inline void SCSS(short *dst, short *src)
+static inline void __SCSS_C(short *dst, short *src)
 {
 	int x,sum;
-	/* Add src to dst with saturation, storing in dst */
+	/* Subtract src from dst with saturation, storing in dst */
 	for (x=0;x<ZT_CHUNKSIZE;x++) {
 		sum = dst[x]-src[x];
 		if (sum > 32767)
@@ -35,6 +47,117 @@ static inline void SCSS(short *dst, short *src)
 	}
 }
 
+/*
+ * Packed saturating 16-bit add/subtract done in ordinary 64-bit integer
+ * registers.  There is no saturating form of VIS fpadd16/fpsub16, and
+ * the FPU state is not ours to touch in the kernel anyway, so this is the
+ * vector path on SPARC as well as the safe default on x86.  Lanes are
+ * independent so the result does not depend on byte order.
+ */
+typedef uint64_t __attribute__((__may_alias__)) zt_lanes_t;
+
+#define ZT_LANE_SIGN	0x8000800080008000ULL
+#define ZT_LANE_MAX	0x7fff7fff7fff7fffULL
+
+static inline uint64_t __zt_sat_lanes(uint64_t a, uint64_t r, uint64_t ovf)
+{
+	/* Overflowed lanes become 0x7fff or 0x8000 following the sign of a */
+	uint64_t mask = (ovf - (ovf >> 15)) | ovf;
+	return (r & ~mask) | ((((a & ZT_LANE_SIGN) >> 15) + ZT_LANE_MAX) & mask);
+}
+
+static inline uint64_t __zt_adds_lanes(uint64_t a, uint64_t b)
+{
+	uint64_t r;
+	r = ((a & ~ZT_LANE_SIGN) + (b & ~ZT_LANE_SIGN)) ^ ((a ^ b) & ZT_LANE_SIGN);
+	return __zt_sat_lanes(a, r, (a ^ r) & (b ^ r) & ZT_LANE_SIGN);
+}
+
+static inline uint64_t __zt_subs_lanes(uint64_t a, uint64_t b)
+{
+	uint64_t r;
+	r = ((a | ZT_LANE_SIGN) - (b & ~ZT_LANE_SIGN)) ^ ((a ^ ~b) & ZT_LANE_SIGN);
+	return __zt_sat_lanes(a, r, (a ^ b) & (a ^ r) & ZT_LANE_SIGN);
+}
+
+static inline void __ACSS_SWAR(short *dst, short *src)
+{
+	zt_lanes_t *d = (zt_lanes_t *)dst;
+	zt_lanes_t *s = (zt_lanes_t *)src;
+	int x;
+	for (x=0;x<ZT_CHUNKSIZE/4;x++)
+		d[x] = __zt_adds_lanes(d[x], s[x]);
+}
+
+static inline void __SCSS_SWAR(short *dst, short *src)
+{
+	zt_lanes_t *d = (zt_lanes_t *)dst;
+	zt_lanes_t *s = (zt_lanes_t *)src;
+	int x;
+	for (x=0;x<ZT_CHUNKSIZE/4;x++)
+		d[x] = __zt_subs_lanes(d[x], s[x]);
+}
+
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+static inline void __ACSS_SSE2(short *dst, short *src)
+{
+	int x;
+	for (x=0;x<ZT_CHUNKSIZE;x+=8)
+		__asm__ __volatile__ (
+			"movdqu (%0), %%xmm0\n\t"
+			"movdqu (%1), %%xmm1\n\t"
+			"paddsw %%xmm1, %%xmm0\n\t"
+			"movdqu %%xmm0, (%0)\n\t"
+			: : "r" (dst + x), "r" (src + x)
+			: "memory", "xmm0", "xmm1");
+}
+
+static inline void __SCSS_SSE2(short *dst, short *src)
+{
+	int x;
+	for (x=0;x<ZT_CHUNKSIZE;x+=8)
+		__asm__ __volatile__ (
+			"movdqu (%0), %%xmm0\n\t"
+			"movdqu (%1), %%xmm1\n\t"
+			"psubsw %%xmm1, %%xmm0\n\t"
+			"movdqu %%xmm0, (%0)\n\t"
+			: : "r" (dst + x), "r" (src + x)
+			: "memory", "xmm0", "xmm1");
+}
+#endif
+
+/* SPARC traps on misaligned 64-bit loads; chunk buffers normally are */
+#define ZT_LANES_OK(a,b) \
+	(!(ZT_CHUNKSIZE & 3) && !((((uintptr_t)(a)) | ((uintptr_t)(b))) & 7))
+
+static inline void ACSS(short *dst, short *src)
+{
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+	if ((zt_arith == ZT_ARITH_SSE2) && !(ZT_CHUNKSIZE & 7)) {
+		__ACSS_SSE2(dst, src);
+		return;
+	}
+#endif
+	if ((zt_arith == ZT_ARITH_SWAR) && ZT_LANES_OK(dst, src))
+		__ACSS_SWAR(dst, src);
+	else
+		__ACSS_C(dst, src);
+}
+
+static inline void SCSS(short *dst, short *src)
+{
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+	if ((zt_arith == ZT_ARITH_SSE2) && !(ZT_CHUNKSIZE & 7)) {
+		__SCSS_SSE2(dst, src);
+		return;
+	}
+#endif
+	if ((zt_arith == ZT_ARITH_SWAR) && ZT_LANES_OK(dst, src))
+		__SCSS_SWAR(dst, src);
+	else
+		__SCSS_C(dst, src);
+}
+
 #endif	/* ZT_CHUNKSIZE */
 
 static inline int CONVOLVE(const int *coeffs, const short *hist, int len)
@@ -55,6 +178,115 @@ static inline int CONVOLVE2(const short *coeffs, const short *hist, int len)
 	return sum;
 }
 
+#ifdef ZT_CHUNKSIZE
+/*
+ * n outputs of CONVOLVE2() over a sliding window:
+ * sums[j] = CONVOLVE2(coeffs, hist + j, len).  The sums wrap the same way
+ * whichever way they are added up, so every version gives the same result.
+ */
+static inline void __CONVOLVE2_BLOCK_C(const short *coeffs, const short *hist, int len, int *sums, int n)
+{
+	int j, x, c;
+	int s0, s1, s2, s3;
+
+	/* Four outputs per pass over the coefficients */
+	for (j=0;j+4<=n;j+=4) {
+		s0 = s1 = s2 = s3 = 0;
+		for (x=0;x<len;x++) {
+			c = coeffs[x];
+			s0 += c * hist[j + x];
+			s1 += c * hist[j + x + 1];
+			s2 += c * hist[j + x + 2];
+			s3 += c * hist[j + x + 3];
+		}
+		sums[j] = s0;
+		sums[j + 1] = s1;
+		sums[j + 2] = s2;
+		sums[j + 3] = s3;
+	}
+	for (;j<n;j++)
+		sums[j] = CONVOLVE2(coeffs, hist + j, len);
+}
+
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+/* pmaddwd, eight products a step; len must be a multiple of 8 */
+static inline int __CONVOLVE2_SSE2(const short *coeffs, const short *hist, int len)
+{
+	int sum;
+	__asm__ __volatile__ (
+		"pxor %%xmm0, %%xmm0\n\t"
+		"1:\n\t"
+		"movdqu (%1), %%xmm1\n\t"
+		"movdqu (%2), %%xmm2\n\t"
+		"pmaddwd %%xmm2, %%xmm1\n\t"
+		"paddd %%xmm1, %%xmm0\n\t"
+		"add $16, %1\n\t"
+		"add $16, %2\n\t"
+		"sub $8, %3\n\t"
+		"jnz 1b\n\t"
+		"pshufd $0x4e, %%xmm0, %%xmm1\n\t"
+		"paddd %%xmm1, %%xmm0\n\t"
+		"pshufd $0xb1, %%xmm0, %%xmm1\n\t"
+		"paddd %%xmm1, %%xmm0\n\t"
+		"movd %%xmm0, %0\n\t"
+		: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (len)
+		: : "memory", "cc", "xmm0", "xmm1", "xmm2");
+	return sum;
+}
+#endif
+
+static inline void CONVOLVE2_BLOCK(const short *coeffs, const short *hist, int len, int *sums, int n)
+{
+	int j;
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+	if ((zt_arith == ZT_ARITH_SSE2) && len && !(len & 7)) {
+		for (j=0;j<n;j++)
+			sums[j] = __CONVOLVE2_SSE2(coeffs, hist + j, len);
+		return;
+	}
+#endif
+	if (zt_arith == ZT_ARITH_C) {
+		for (j=0;j<n;j++)
+			sums[j] = CONVOLVE2(coeffs, hist + j, len);
+	} else
+		__CONVOLVE2_BLOCK_C(coeffs, hist, len, sums, n);
+}
+#endif	/* ZT_CHUNKSIZE */
+
+/*
+ * Division by the same divisor many times over, with a multiply and two
+ * shifts instead.  Rounds toward zero like C's / for any int dividend;
+ * the divisor must be from 1 to INT_MAX.
+ */
+struct zt_divisor {
+	int d;
+	int shift;
+	uint32_t m;
+};
+
+static inline void zt_div_prep(struct zt_divisor *dv, int d)
+{
+	int l = 0;
+
+	while ((1U << l) < (unsigned int)d)
+		l++;
+	dv->d = d;
+	dv->shift = l - 1;
+	dv->m = (uint32_t)((((uint64_t)1 << 32) * ((1ULL << l) - d)) / d) + 1;
+}
+
+static inline int zt_div(const struct zt_divisor *dv, int n)
+{
+	uint32_t u, t;
+
+	if (dv->d == 1)
+		return n;
+	u = (n < 0) ? -(uint32_t)n : (uint32_t)n;
+	t = (uint32_t)(((uint64_t)u * dv->m) >> 32);
+	u = (t + ((u - t) >> 1)) >> dv->shift;
+	return (n < 0) ? -(int)u : (int)u;
+}
+
 static inline void UPDATE(int *taps, const short *history, const int nsuppr, const int ntaps)
 {
 	int i;
@@ -0,0 +1,173 @@
+/*
+ * Conference arithmetic check: the SWAR and SSE2 ACSS()/SCSS() in arith.h
+ * against the plain C loops.
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * Runs every zt_arith mode built in over the same chunks and stops at the
+ * first sample that differs from __ACSS_C()/__SCSS_C().  The chunks are
+ * random, and every fourth one is made of full scale and near full
+ * scale values so that lanes overflow in both directions.  Misaligned
+ * buffers are run too, which must drop to the C loops rather than
+ * fault.  At the end it prints the time per chunk of each mode.
+ *
+ *   arithtest [-n chunks] [-s seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define ZT_CHUNKSIZE 8
+
+/* User space may use %xmm freely */
+#if (defined(__i386) || defined(__amd64)) && !defined(CONFIG_ZAPTEL_SSE2)
+#define CONFIG_ZAPTEL_SSE2
+#endif
+
+int zt_arith = 0;
+
+#include "arith.h"
+
+static const char *names[] = { "C", "SWAR", "SSE2" };
+
+#ifdef CONFIG_ZAPTEL_SSE2
+#define MODES	3
+#else
+#define MODES	2
+#endif
+
+/* Values that sit on or next to the saturation points */
+static const short edges[] = {
+	-32768, -32767, -32766, -16385, -16384, -1, 0, 1,
+	16383, 16384, 32766, 32767,
+};
+
+#define NEDGES	(sizeof(edges) / sizeof(edges[0]))
+
+static unsigned int seed = 1;
+
+static short rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (short)(seed >> 8);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void fill(short *s, int edge)
+{
+	int x;
+
+	for (x=0;x<ZT_CHUNKSIZE;x++)
+		s[x] = edge ? edges[(rnd() & 0xffff) % NEDGES] : rnd();
+}
+
+static void dump(const char *what, const short *s)
+{
+	int x;
+
+	printf("  %-6s", what);
+	for (x=0;x<ZT_CHUNKSIZE;x++)
+		printf(" %6d", s[x]);
+	printf("\n");
+}
+
+/* Run one chunk through a mode and the C loops.  Returns nonzero on a mismatch */
+static int check(int mode, int sub, short *dst, short *src)
+{
+	short ref[ZT_CHUNKSIZE], in[ZT_CHUNKSIZE];
+
+	memcpy(in, dst, sizeof(in));
+	memcpy(ref, dst, sizeof(ref));
+	zt_arith = mode;
+	if (sub) {
+		SCSS(dst, src);
+		__SCSS_C(ref, src);
+	} else {
+		ACSS(dst, src);
+		__ACSS_C(ref, src);
+	}
+	if (!memcmp(dst, ref, sizeof(ref)))
+		return 0;
+	printf("%s %s differs from C:\n", names[mode], sub ? "SCSS" : "ACSS");
+	dump("dst", in);
+	dump("src", src);
+	dump("C", ref);
+	dump(names[mode], dst);
+	return 1;
+}
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-n chunks] [-s seed]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	/* One spare short each so that dbuf + 1 and sbuf + 1 are misaligned */
+	short dbuf[ZT_CHUNKSIZE + 1] __attribute__((aligned(16)));
+	short sbuf[ZT_CHUNKSIZE + 1] __attribute__((aligned(16)));
+	short *dst, *src;
+	long chunks = 20000000;
+	long n;
+	int c, mode, sub, off;
+	double t;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch(c) {
+		case 'n':
+			chunks = atol(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (chunks < 1)
+		usage(argv[0]);
+
+	for (n=0;n<chunks;n++) {
+		/* Every fourth chunk from the edge values, every 64th misaligned */
+		off = !(n & 63);
+		dst = dbuf + off;
+		src = sbuf + off;
+		for (mode=1;mode<MODES;mode++) {
+			for (sub=0;sub<2;sub++) {
+				fill(dst, !(n & 3));
+				fill(src, !(n & 3));
+				if (check(mode, sub, dst, src))
+					exit(1);
+			}
+		}
+	}
+	printf("%ld chunks bit exact in", chunks);
+	for (mode=1;mode<MODES;mode++)
+		printf(" %s", names[mode]);
+	printf("\n");
+
+	/* Accumulate into one sum, like the conference mixer */
+	for (mode=0;mode<MODES;mode++) {
+		zt_arith = mode;
+		fill(dbuf, 0);
+		fill(sbuf, 0);
+		t = now();
+		for (n=0;n<chunks;n++) {
+			ACSS(dbuf, sbuf);
+			SCSS(dbuf, sbuf);
+		}
+		t = now() - t;
+		printf("%-5s %6.2f ns per ACSS+SCSS chunk\n", names[mode], t * 1e9 / chunks);
+	}
+	return 0;
+}
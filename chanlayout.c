@@ -0,0 +1,125 @@
+/*
+ * struct zt_chan layout dump: which cache lines the fields the tick uses
+ * for a plain voice channel fall on.
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * The channel is an open, unconferenced channel on the plain mu-law
+ * pipeline, read and written with read()/write().  For each field it
+ * prints the offset, size and lines, then how many lines the whole set
+ * takes with the channel starting on a line boundary and at each other
+ * 8 byte offset, since kmem_alloc() and drivers' arrays only promise
+ * that much.  zaptel.c checks the hot head at compile time; this shows
+ * what the rest of the tick adds.
+ *
+ *   chanlayout [-v]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/ksynch.h>
+#include <sys/poll.h>
+
+/* struct zt_chan is only visible to the driver */
+#define _KERNEL
+#include "zaptel.h"
+#undef _KERNEL
+
+#define F(f)	{ #f, offsetof(struct zt_chan, f), sizeof(((struct zt_chan *)0)->f) }
+
+static struct field {
+	const char *name;
+	size_t off;
+	size_t size;
+} fields[] = {
+	/* Both directions */
+	F(lock), F(flags), F(master), F(nextslave), F(confmode), F(pipeline),
+	F(timerfired), F(ring), F(numbufs), F(iomask),
+	/* Receive, __zt_pipe_putaudio() and __zt_putbuf_chunk() */
+	F(readchunk), F(dialing), F(afterdialingtimer), F(putlin), F(putraw),
+	F(rxhead), F(rxtail), F(rxdisable), F(blocksize), F(readbuf),
+	F(readidx), F(readn), F(rxbufpolicy),
+	/* Transmit, __zt_getbuf_chunk() and __zt_pipe_getaudio() */
+	F(writechunk), F(curtone), F(ec), F(confmute), F(echostate),
+	F(getlin), F(getlin_lastchunk), F(getraw), F(txhead), F(txtail),
+	F(txdisable), F(writebuf), F(writen), F(writeidx), F(txbufpolicy),
+};
+
+#define NFIELDS	(sizeof(fields) / sizeof(fields[0]))
+
+/* Arrays are only touched at the current buffer, count the first entry */
+static size_t touched(struct field *f)
+{
+	if (!strcmp(f->name, "readbuf") || !strcmp(f->name, "writebuf"))
+		return sizeof(u_char *);
+	if (!strcmp(f->name, "readidx") || !strcmp(f->name, "readn") ||
+	    !strcmp(f->name, "writeidx") || !strcmp(f->name, "writen"))
+		return sizeof(int);
+	return f->size;
+}
+
+/* Lines the fields take with the channel at start within a line */
+static int lines(size_t start)
+{
+	static unsigned char seen[sizeof(struct zt_chan) / ZT_CACHE_LINE + 2];
+	size_t x, l;
+	int n = 0;
+
+	memset(seen, 0, sizeof(seen));
+	for (x=0;x<NFIELDS;x++) {
+		for (l=(start + fields[x].off) / ZT_CACHE_LINE;
+		     l<=(start + fields[x].off + touched(&fields[x]) - 1) / ZT_CACHE_LINE;l++) {
+			if (!seen[l]) {
+				seen[l] = 1;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-v]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t x, start;
+	int c, n, min = 0, max = 0, verbose = 0;
+
+	while ((c = getopt(argc, argv, "v")) != -1) {
+		switch(c) {
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	printf("struct zt_chan: %lu bytes, %lu lines\n", (unsigned long)sizeof(struct zt_chan),
+		(unsigned long)((sizeof(struct zt_chan) + ZT_CACHE_LINE - 1) / ZT_CACHE_LINE));
+	printf("hot head (up to getlin): %lu bytes\n", (unsigned long)offsetof(struct zt_chan, getlin));
+	if (verbose) {
+		for (x=0;x<NFIELDS;x++)
+			printf("  %-18s %5lu %4lu  line %lu\n", fields[x].name,
+				(unsigned long)fields[x].off, (unsigned long)fields[x].size,
+				(unsigned long)(fields[x].off / ZT_CACHE_LINE));
+	}
+	for (start=0;start<ZT_CACHE_LINE;start+=8) {
+		n = lines(start);
+		if (!start || (n < min))
+			min = n;
+		if (n > max)
+			max = n;
+		if (verbose)
+			printf("  start %2lu: %d lines\n", (unsigned long)start, n);
+	}
+	printf("voice tick: %d lines aligned, %d to %d at other starts\n", lines(0), min, max);
+	return 0;
+}
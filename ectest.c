@@ -0,0 +1,218 @@
+/*
+ * Echo canceller comparison: MARK2 against the partitioned block
+ * frequency domain canceller (pbfd.h) and the short tail NLMS one
+ * (nlms.h), on a synthetic echo path.
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * All the cancellers are built into this one program, straight from
+ * their kernel headers, and fed the same far-end signal and echo.  For
+ * each second it prints the echo return loss enhancement of each, and at
+ * the end the CPU it took to run one channel.  NLMS only goes up to
+ * NLMS_MAX_TAPS; past that its column is left out.  The residual suppressor is
+ * compiled out so that only the adaptive filters are measured.
+ *
+ *   ectest [-t taps] [-d delay ms] [-p path ms] [-s seconds] [-l level]
+ *
+ * The echo path is a flat delay, then a decaying response -p ms long
+ * (by default, to the end of the tail).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define ZT_CHUNKSIZE 8
+#define NO_ECHO_SUPPRESSOR
+
+int zt_arith = 0;
+
+/* MARK2 and NLMS under their own names, so they can be linked side by side */
+#define echo_can_state_t	mark2_state_t
+#define echo_can_create		mark2_create
+#define echo_can_free		mark2_free
+#define echo_can_update		mark2_update
+#define echo_can_update_chunk	mark2_update_chunk
+#define echo_can_traintap	mark2_traintap
+#include "mec2.h"
+#undef echo_can_state_t
+#undef echo_can_create
+#undef echo_can_free
+#undef echo_can_update
+#undef echo_can_update_chunk
+#undef echo_can_traintap
+
+#define echo_can_state_t	nlms_state_t
+#define echo_can_create		nlms_create
+#define echo_can_free		nlms_free
+#define echo_can_update		nlms_update
+#define echo_can_update_chunk	nlms_update_chunk
+#define echo_can_traintap	nlms_traintap
+#include "nlms.h"
+#undef echo_can_state_t
+#undef echo_can_create
+#undef echo_can_free
+#undef echo_can_update
+#undef echo_can_update_chunk
+#undef echo_can_traintap
+
+#include "pbfd.h"
+
+static unsigned int seed = 1;
+
+static int rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int)((seed >> 16) & 0x7fff) - 16384;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double erle(double echo, double res)
+{
+	if (res < 1.0)
+		res = 1.0;
+	return 10.0 * log10((echo + 1.0) / res);
+}
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-t taps] [-d delay ms] [-p path ms] [-s seconds] [-l level]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int taps = 512;
+	int delay = 20;
+	int secs = 20;
+	int level = 2000;
+	int plen = 0;
+	int c, n, k, len, d, total;
+	short *ref, *sig;
+	short *out[3];
+	double *path;
+	double y, g, pw;
+	double t[3] = { 0, 0, 0 };
+	double echo, res[3];
+	mark2_state_t *m2;
+	echo_can_state_t *fd;
+	nlms_state_t *nl = NULL;
+
+	while ((c = getopt(argc, argv, "t:d:p:s:l:")) != -1) {
+		switch(c) {
+		case 't':
+			taps = atoi(optarg);
+			break;
+		case 'd':
+			delay = atoi(optarg);
+			break;
+		case 'p':
+			plen = atoi(optarg);
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		case 'l':
+			level = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	d = delay * 8;
+	if ((taps < 32) || (secs < 1) || (d >= taps))
+		usage(argv[0]);
+	total = secs * 8000;
+
+	/* A flat delay, then a decaying random response that ends inside the tail */
+	len = taps - d;
+	if (plen && (plen * 8 < len))
+		len = plen * 8;
+	path = calloc(taps, sizeof(double));
+	for (k=0;k<len;k++)
+		path[d + k] = rnd() / 16384.0 * 0.5 * exp(-6.0 * k / len);
+	/* 9 dB of echo return loss */
+	for (pw=0,k=0;k<taps;k++)
+		pw += path[k] * path[k];
+	for (k=0;k<taps;k++)
+		path[k] *= 0.355 / sqrt(pw);
+
+	/* Coloured noise in talk spurts for the far end, and a little line noise */
+	ref = calloc(total, sizeof(short));
+	sig = calloc(total, sizeof(short));
+	out[0] = calloc(total, sizeof(short));
+	out[1] = calloc(total, sizeof(short));
+	out[2] = calloc(total, sizeof(short));
+	for (y=0,n=0;n<total;n++) {
+		y = 0.8 * y + rnd() / 16384.0;
+		g = ((n / 4000) % 4 == 3) ? 0.1 : 1.0;
+		ref[n] = (short)(y * level * g);
+	}
+	for (n=0;n<total;n++) {
+		for (y=0,k=0;(k<taps) && (k<=n);k++)
+			y += path[k] * ref[n - k];
+		sig[n] = (short)(y + rnd() / 4096);
+	}
+
+	m2 = mark2_create(taps, 0);
+	fd = echo_can_create(taps, 0);
+	if (!m2 || !fd) {
+		fprintf(stderr, "Unable to create %d tap cancellers\n", taps);
+		exit(1);
+	}
+	if (taps <= NLMS_MAX_TAPS)
+		nl = nlms_create(taps, 0);
+
+	t[0] = now();
+	for (n=0;n<total;n++)
+		out[0][n] = mark2_update(m2, ref[n], sig[n]);
+	t[0] = now() - t[0];
+	t[1] = now();
+	for (n=0;n<total;n++)
+		out[1][n] = echo_can_update(fd, ref[n], sig[n]);
+	t[1] = now() - t[1];
+	if (nl) {
+		t[2] = now();
+		for (n=0;n<total;n++)
+			out[2][n] = nlms_update(nl, ref[n], sig[n]);
+		t[2] = now() - t[2];
+	}
+
+	printf("%d taps, %d ms flat delay, %d ms path, far end level %d\n\n", taps, delay, len / 8, level);
+	printf(" sec   MARK2 ERLE   PBFD ERLE%s\n", nl ? "   NLMS ERLE" : "");
+	for (c=0;c<secs;c++) {
+		echo = res[0] = res[1] = res[2] = 0;
+		for (n=c*8000;n<(c+1)*8000;n++) {
+			echo += (double)sig[n] * sig[n];
+			res[0] += (double)out[0][n] * out[0][n];
+			res[1] += (double)out[1][n] * out[1][n];
+			res[2] += (double)out[2][n] * out[2][n];
+		}
+		printf("%4d   %7.1f dB   %7.1f dB", c + 1, erle(echo, res[0]), erle(echo, res[1]));
+		if (nl)
+			printf("   %7.1f dB", erle(echo, res[2]));
+		printf("\n");
+	}
+	printf("\nMARK2 active window: taps %d to %d\n", m2->win_lo, m2->win_hi - 1);
+	printf("CPU per channel: MARK2 %.2f%%, PBFD %.2f%% (%.0f and %.0f channels per CPU)\n",
+		100.0 * t[0] / secs, 100.0 * t[1] / secs,
+		secs / t[0], secs / t[1]);
+	if (nl)
+		printf("                 NLMS %.2f%% (%.0f channels per CPU)\n",
+			100.0 * t[2] / secs, secs / t[2]);
+
+	mark2_free(m2);
+	echo_can_free(fd);
+	if (nl)
+		nlms_free(nl);
+	exit(0);
+}
@@ -0,0 +1,204 @@
+/*
+ * Law encoder check: the table-free __zt_calc_lin2mu()/__zt_calc_lin2a()
+ * in xlaw.h against the __zt_lin2mu[]/__zt_lin2a[] tables.
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * Builds the tables the way zt_conv_init() does and runs every 16 bit
+ * sample through both encoders.  They must agree, except from -32768 to
+ * -32765 where the tables hold the sign overflow of the reference
+ * routines; there the computed ones must give negative full scale.
+ * Then it times the two, once in a hot loop and once the way zt_receive()
+ * runs them: for each of the channels, touch that channel's state and
+ * encode two chunks, so that the tables have to compete for the cache.
+ *
+ *   lawtest [-c channels] [-k state bytes] [-t ticks] [-n samples]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define ZT_CHUNKSIZE 8
+
+#include "xlaw.h"
+
+static u_char __zt_lin2mu[16384];
+static u_char __zt_lin2a[16384];
+
+#define TAB_LIN2MU(a) (__zt_lin2mu[((unsigned short)(a)) >> 2])
+#define TAB_LIN2A(a) (__zt_lin2a[((unsigned short)(a)) >> 2])
+
+static const char *names[] = { "table", "computed" };
+
+static unsigned int seed = 1;
+
+static short rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (short)(seed >> 8);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Encode n samples one way.  alaw picks the law, like chan->xlaw */
+static void encode(int calc, int alaw, const short *lin, u_char *xbuf, int n)
+{
+	int x;
+
+	if (calc) {
+		if (alaw) {
+			for (x=0;x<n;x++)
+				xbuf[x] = __zt_calc_lin2a(lin[x]);
+		} else {
+			for (x=0;x<n;x++)
+				xbuf[x] = __zt_calc_lin2mu(lin[x]);
+		}
+	} else {
+		if (alaw) {
+			for (x=0;x<n;x++)
+				xbuf[x] = TAB_LIN2A(lin[x]);
+		} else {
+			for (x=0;x<n;x++)
+				xbuf[x] = TAB_LIN2MU(lin[x]);
+		}
+	}
+}
+
+static int check(void)
+{
+	int i, bad = 0;
+	u_char t, c;
+
+	for (i=-32768;i<32768;i++) {
+		/* Below -32764 expect what -32764 gives, negative full scale */
+		t = TAB_LIN2MU(i < -32764 ? -32764 : i);
+		c = __zt_calc_lin2mu(i);
+		if (t != c) {
+			printf("mu-law %d: expected %02x computed %02x\n", i, t, c);
+			bad++;
+		}
+		t = TAB_LIN2A(i < -32764 ? -32764 : i);
+		c = __zt_calc_lin2a(i);
+		if (t != c) {
+			printf("A-law %d: expected %02x computed %02x\n", i, t, c);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+struct chan {
+	short lin[2 * ZT_CHUNKSIZE];
+	u_char xbuf[2 * ZT_CHUNKSIZE];
+	int alaw;
+	unsigned char *state;
+};
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-c channels] [-k state bytes] [-t ticks] [-n samples]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct chan *chans;
+	short *lin;
+	u_char *xbuf;
+	int nchans = 1000;
+	int statesize = 3584;
+	int ticks = 2000;
+	int samples = 10000000;
+	int c, i, x, calc, tick;
+	unsigned int sum = 0;
+	double t;
+
+	while ((c = getopt(argc, argv, "c:k:t:n:")) != -1) {
+		switch(c) {
+		case 'c':
+			nchans = atoi(optarg);
+			break;
+		case 'k':
+			statesize = atoi(optarg);
+			break;
+		case 't':
+			ticks = atoi(optarg);
+			break;
+		case 'n':
+			samples = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((nchans < 1) || (statesize < 0) || (ticks < 1) || (samples < 1))
+		usage(argv[0]);
+
+	for (i=-32768;i<32768;i+=4) {
+		__zt_lin2mu[((unsigned short)(short)i) >> 2] = __zt_lineartoulaw(i);
+		__zt_lin2a[((unsigned short)(short)i) >> 2] = __zt_lineartoalaw(i);
+	}
+	if (check())
+		exit(1);
+	printf("65536 samples match in mu-law and A-law\n");
+
+	lin = malloc(samples * sizeof(short));
+	xbuf = malloc(samples);
+	chans = calloc(nchans, sizeof(struct chan));
+	if (!lin || !xbuf || !chans) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (x=0;x<samples;x++)
+		lin[x] = rnd();
+	for (i=0;i<nchans;i++) {
+		chans[i].state = calloc(1, statesize ? statesize : 1);
+		if (!chans[i].state) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		chans[i].alaw = i & 1;
+		for (x=0;x<2 * ZT_CHUNKSIZE;x++)
+			chans[i].lin[x] = rnd();
+	}
+
+	for (calc=0;calc<2;calc++) {
+		t = now();
+		encode(calc, 0, lin, xbuf, samples);
+		encode(calc, 1, lin, xbuf, samples);
+		t = now() - t;
+		sum += xbuf[samples - 1];
+		printf("%-8s hot:   %6.2f ns per chunk\n", names[calc],
+			t * 1e9 / (2.0 * samples / ZT_CHUNKSIZE));
+	}
+
+	/* Every tick, each channel reads and dirties its state, then
+	   encodes two chunks, as the echo canceller and the conferences
+	   do between conversions in zt_receive() */
+	for (calc=0;calc<2;calc++) {
+		t = now();
+		for (tick=0;tick<ticks;tick++) {
+			for (i=0;i<nchans;i++) {
+				for (x=0;x<statesize;x+=64)
+					sum += chans[i].state[x]++;
+				encode(calc, chans[i].alaw, chans[i].lin, chans[i].xbuf, 2 * ZT_CHUNKSIZE);
+				sum += chans[i].xbuf[0];
+			}
+		}
+		t = now() - t;
+		printf("%-8s %d channels, %d byte state: %6.2f ns per channel\n", names[calc],
+			nchans, statesize, t * 1e9 / ((double)ticks * nchans));
+	}
+	/* Keep the loops from being optimized away */
+	if (sum == 0xdeadbeef)
+		printf("\n");
+	return 0;
+}
@@ -13,8 +13,10 @@
 #define _MARK2_ECHO_H
 
 #ifdef _KERNEL
+#ifndef MALLOC
 #define MALLOC(a) kmem_alloc((a), KM_NOSLEEP)
 #define FREE(a) kmem_free(a, a->allocsize)
+#endif
 #else
 #include <stdlib.h>
 #include <unistd.h>
@@ -86,6 +88,14 @@ typedef struct  {
   short max_y_tilde;
   int max_y_tilde_pos;
 
+  // active window: only taps win_lo to win_hi - 1 are run and adapted
+  //
+  int win_lo;
+  int win_hi;
+  int win_timer;
+  int win_ratio;	/* Ly_i / Lu_i when the window was found */
+  int win_bad;
+
   size_t allocsize;
 } echo_can_state_t;
 
@@ -166,10 +176,100 @@ static inline void init_cc(echo_can_state_t *ec, int N, int maxy, int maxu) {
   ec->s_tilde_i = 0;
   ec->HCNTR_d = (int)0;
 
+  // start out over the whole tail
+  //
+  ec->win_lo = 0;
+  ec->win_hi = N;
+  ec->win_timer = DEFAULT_WIN_CHECK;
+
   // exit gracefully
   //
 }
 
+/*
+ * Narrow the active window to where the echo is.  The taps are taken
+ * DEFAULT_M at a time; the window runs from the first group to the last
+ * whose energy is within 2^-DEFAULT_WIN_ENERGY of the strongest, which
+ * keeps the adaptation noise in the unused taps out, plus
+ * DEFAULT_WIN_MARGIN either side.  Taps outside are zeroed.  The bulk
+ * delay of the echo path is win_lo.
+ */
+static inline void echo_can_find_window(echo_can_state_t *ec)
+{
+  int64_t g, max, cut;
+  int k, t, lo, hi;
+
+  for (max=0,k=0;k<ec->N_d;k+=DEFAULT_M) {
+    for (g=0,t=k;(t<k+DEFAULT_M) && (t<ec->N_d);t++)
+      g += ec->a_s[t] * ec->a_s[t];
+    if (g > max)
+      max = g;
+  }
+  if (!max)
+    return;
+  cut = max >> DEFAULT_WIN_ENERGY;
+  lo = ec->N_d;
+  hi = 0;
+  for (k=0;k<ec->N_d;k+=DEFAULT_M) {
+    for (g=0,t=k;(t<k+DEFAULT_M) && (t<ec->N_d);t++)
+      g += ec->a_s[t] * ec->a_s[t];
+    if (g > cut) {
+      if (k < lo)
+        lo = k;
+      hi = t;
+    }
+  }
+  /* Keep the edges on DEFAULT_M taps for CONVOLVE2_BLOCK() */
+  lo = (lo - DEFAULT_WIN_MARGIN) & ~(DEFAULT_M - 1);
+  hi = (hi + DEFAULT_WIN_MARGIN + DEFAULT_M - 1) & ~(DEFAULT_M - 1);
+  if (lo < 0)
+    lo = 0;
+  if (hi > ec->N_d)
+    hi = ec->N_d;
+  for (k=0;k<ec->N_d;k++) {
+    if ((k < lo) || (k >= hi)) {
+      ec->a_i[k] = 0;
+      ec->a_s[k] = 0;
+    }
+  }
+  ec->win_lo = lo;
+  ec->win_hi = hi;
+}
+
+/*
+ * Runs on every DEFAULT_M'th sample, after any coefficient update.  Once
+ * a second, if the echo is well cancelled, the window is narrowed to the
+ * taps in use.  If the cancellation then gets much worse with no near-end
+ * speech to blame, the echo has moved, so go back to the whole tail.
+ */
+static inline void echo_can_track_window(echo_can_state_t *ec, int hcntr, int ly)
+{
+  int ratio;
+
+  if (hcntr)
+    return;
+  ratio = ly / (ec->Lu_i + 1);
+  if ((ec->win_hi - ec->win_lo < ec->N_d) && (ly > MIN_UPDATE_THRESH_I) &&
+      (ratio < DEFAULT_SUPPR_I) && (ratio < (ec->win_ratio >> 2))) {
+    ec->win_bad += DEFAULT_M;
+    if (ec->win_bad >= DEFAULT_WIN_BAD) {
+      ec->win_lo = 0;
+      ec->win_hi = ec->N_d;
+      ec->win_bad = 0;
+      ec->win_timer = DEFAULT_WIN_CHECK;
+    }
+  } else
+    ec->win_bad = 0;
+  ec->win_timer -= DEFAULT_M;
+  if (ec->win_timer <= 0) {
+    ec->win_timer = DEFAULT_WIN_CHECK;
+    if (ratio > DEFAULT_SUPPR_I) {
+      echo_can_find_window(ec);
+      ec->win_ratio = ratio;
+    }
+  }
+}
+
 static inline void echo_can_free(echo_can_state_t *ec)
 {
 	FREE(ec);
@@ -208,7 +308,8 @@ static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig
   add_cc_s(&ec->y_s, iref);
  
   /* eq. (2): compute r in fixed-point */
-  rs = CONVOLVE2(ec->a_s, ec->y_s.buf_d + ec->y_s.idx_d, ec->N_d);
+  rs = CONVOLVE2(ec->a_s + ec->win_lo, ec->y_s.buf_d + ec->y_s.idx_d + ec->win_lo,
+		 ec->win_hi - ec->win_lo);
   rs >>= 15;
 
   /* eq. (3): compute the output value (see figure 3) and the error
@@ -272,6 +373,9 @@ static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig
   two_beta_i = (ec->beta2_i * Py_i) >> 15;	/* Fixed point version, inverted */
   if (!two_beta_i)
   	two_beta_i++;
+  /* The step is tuned for up to DEFAULT_WIN_STEP taps; slow down past that */
+  if (ec->win_hi - ec->win_lo > DEFAULT_WIN_STEP)
+  	two_beta_i *= (ec->win_hi - ec->win_lo + DEFAULT_WIN_STEP - 1) / DEFAULT_WIN_STEP;
 
   /* Update Lu_i (Suppressed power estimate) */
   ec->Lu_i -= abs(get_cc_s(&ec->u_s, (1 << DEFAULT_SIGMA_LU_I) - 1 )) ;
@@ -314,7 +418,7 @@ static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig
       (ec->Lu_i > MIN_UPDATE_THRESH_I)) {
 	    // loop over all filter coefficients
 	    //
-	    for (k=0; k<ec->N_d; k++) {
+	    for (k=ec->win_lo; k<ec->win_hi; k++) {
 	      
 	      // eq. (7): compute an expectation over M_d samples 
 	      //
@@ -328,6 +432,9 @@ static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig
 	    }
   }
 
+  if (!(ec->i_d % DEFAULT_M))
+    echo_can_track_window(ec, ec->HCNTR_d, ec->Ly_i);
+
   /* paragraph below eq. (15): if no near-end speech,
   // check for residual error suppression
   */
@@ -358,6 +465,132 @@ static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig
   return u_s;
 }
 
+#ifdef ZT_CHUNKSIZE
+#define ECHO_CAN_CHUNK
+
+/* Taps correlated per CONVOLVE2_BLOCK() call in a coefficient update */
+#define ECHO_CAN_GRAD_BATCH 32
+
+/*
+ * echo_can_update() for a whole chunk: isig[] is replaced by the
+ * cancelled signal.  Gives the same output, and leaves the same state, as
+ * calling echo_can_update() on each sample in turn; that stays the
+ * reference.  The coefficients can only change on every DEFAULT_M'th
+ * sample, so the chunk is cut into runs that end on such a sample.  For
+ * each run, everything that only depends on the inputs (the power
+ * estimates and the near-end detector) is worked out first, then the
+ * filter is run for all of its samples in one CONVOLVE2_BLOCK() pass.
+ * A coefficient update correlates all the taps the same way and divides
+ * by the step size with zt_div().
+ */
+static inline void echo_can_update_chunk(echo_can_state_t *ec, const short *iref, short *isig)
+{
+  int rs[ZT_CHUNKSIZE];
+  int two_beta[ZT_CHUNKSIZE];
+  int hcntr[ZT_CHUNKSIZE];
+  int ly[ZT_CHUNKSIZE];
+  int grad[ECHO_CAN_GRAD_BATCH];
+  struct zt_divisor dv;
+  int j, s, e, k, n, t, Py_i;
+  short u_s;
+
+  for (s=0;s<ZT_CHUNKSIZE;s=e+1) {
+    /* Last sample of the run */
+    e = s + (DEFAULT_M - ec->i_d % DEFAULT_M) % DEFAULT_M;
+    if (e >= ZT_CHUNKSIZE)
+      e = ZT_CHUNKSIZE - 1;
+
+    for (j=s;j<=e;j++) {
+      ec->y_tilde_i -= abs(get_cc_s(&ec->y_s, (1 << DEFAULT_ALPHA_YT_I) - 1 )) >> DEFAULT_ALPHA_YT_I;
+      add_cc_s(&ec->y_s, iref[j]);
+
+      ec->s_tilde_i -= abs(get_cc_s(&ec->s_s, (1 << DEFAULT_ALPHA_ST_I) - 1 ));
+      add_cc_s(&ec->s_s, isig[j]);
+      ec->s_tilde_i += abs(isig[j]);
+      ec->y_tilde_i += abs(iref[j]) >> DEFAULT_ALPHA_YT_I;
+      add_cc_s(&ec->y_tilde_s, ec->y_tilde_i);
+
+      Py_i = (ec->Ly_i >> DEFAULT_SIGMA_LY_I) * (ec->Ly_i >> DEFAULT_SIGMA_LY_I);
+      Py_i >>= 15;
+      if (ec->HCNTR_d > 0)
+        Py_i = (1 << 15);
+      ec->beta2_i = DEFAULT_BETA1_I;
+      two_beta[j] = (ec->beta2_i * Py_i) >> 15;
+      if (!two_beta[j])
+        two_beta[j]++;
+      if (ec->win_hi - ec->win_lo > DEFAULT_WIN_STEP)
+        two_beta[j] *= (ec->win_hi - ec->win_lo + DEFAULT_WIN_STEP - 1) / DEFAULT_WIN_STEP;
+
+      ec->Ly_i -= abs(get_cc_s(&ec->y_s, (1 << DEFAULT_SIGMA_LY_I) - 1)) ;
+      ec->Ly_i += abs(iref[j]);
+      if (ec->Ly_i < DEFAULT_CUTOFF_I)
+        ec->Ly_i = DEFAULT_CUTOFF_I;
+      ly[j] = ec->Ly_i;
+
+      if (ec->y_tilde_i > ec->max_y_tilde) {
+        ec->max_y_tilde = ec->y_tilde_i;
+        ec->max_y_tilde_pos = ec->N_d - 1;
+      } else if (--ec->max_y_tilde_pos < 0) {
+        ec->max_y_tilde = MAX16(ec->y_tilde_s.buf_d + ec->y_tilde_s.idx_d, ec->N_d, &ec->max_y_tilde_pos);
+      }
+
+      if ((ec->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)) > ec->max_y_tilde)
+        ec->HCNTR_d = DEFAULT_HANGT;
+      else if (ec->HCNTR_d > (int)0)
+        ec->HCNTR_d--;
+      hcntr[j] = ec->HCNTR_d;
+    }
+
+    /* eq. (2) for the whole run; sample e is the newest */
+    CONVOLVE2_BLOCK(ec->a_s + ec->win_lo, ec->y_s.buf_d + ec->y_s.idx_d + ec->win_lo,
+                    ec->win_hi - ec->win_lo, rs, e - s + 1);
+
+    for (j=s;j<=e;j++) {
+      u_s = isig[j] - (rs[e - j] >> 15);
+      add_cc_s(&ec->u_s, u_s);
+      ec->Lu_i -= abs(get_cc_s(&ec->u_s, (1 << DEFAULT_SIGMA_LU_I) - 1 )) ;
+      ec->Lu_i += abs(u_s);
+
+      /* Only ever true for j == e */
+      if (!hcntr[j] && !(ec->i_d % DEFAULT_M) &&
+          (ec->Lu_i > MIN_UPDATE_THRESH_I)) {
+        zt_div_prep(&dv, two_beta[j]);
+        for (k=ec->win_lo;k<ec->win_hi;k+=n) {
+          n = ec->win_hi - k;
+          if (n > ECHO_CAN_GRAD_BATCH)
+            n = ECHO_CAN_GRAD_BATCH;
+          /* eq. (7) for taps k to k + n - 1 */
+          CONVOLVE2_BLOCK(ec->u_s.buf_d + ec->u_s.idx_d,
+                          ec->y_s.buf_d + ec->y_s.idx_d + k, DEFAULT_M, grad, n);
+          for (t=0;t<n;t++) {
+            ec->a_i[k + t] += zt_div(&dv, grad[t]);
+            ec->a_s[k + t] = ec->a_i[k + t] >> 16;
+          }
+        }
+      }
+      /* Also only on sample e, so the window holds for the whole run */
+      if (!(ec->i_d % DEFAULT_M))
+        echo_can_track_window(ec, hcntr[j], ly[j]);
+
+#ifndef NO_ECHO_SUPPRESSOR
+#ifdef AGGRESSIVE_SUPPRESSOR
+      if ((hcntr[j] < AGGRESSIVE_HCNTR) && (ly[j] > (ec->Lu_i << 1))) {
+        u_s = u_s * (ec->Lu_i >> DEFAULT_SIGMA_LU_I) / ((ly[j] >> (DEFAULT_SIGMA_LY_I)) + 1);
+        u_s = u_s * (ec->Lu_i >> DEFAULT_SIGMA_LU_I) / ((ly[j] >> (DEFAULT_SIGMA_LY_I)) + 1);
+      }
+#else
+      if ((hcntr[j] == 0) && ((ly[j]/(ec->Lu_i + 1)) > DEFAULT_SUPPR_I)) {
+        u_s = u_s * (ec->Lu_i >> DEFAULT_SIGMA_LU_I) / ((ly[j] >> (DEFAULT_SIGMA_LY_I + 2)) + 1);
+      }
+#endif
+#endif
+      ec->i_d++;
+      isig[j] = u_s;
+    }
+  }
+}
+#endif	/* ZT_CHUNKSIZE */
+
 static inline echo_can_state_t *echo_can_create(int len, int adaption_mode)
 {
 	echo_can_state_t *ec;
@@ -400,8 +633,12 @@ static inline int echo_can_traintap(echo_can_state_t *ec, int pos, short val)
 		return 1;
 	ec->a_i[pos] = val << 17;
 	ec->a_s[pos] = val << 1;
-	if (++pos >= ec->N_d)
+	if (++pos >= ec->N_d) {
+		/* The pulse response shows where the echo is */
+		echo_can_find_window(ec);
+		ec->win_ratio = DEFAULT_SUPPR_I << 2;
 		return 1;
+	}
 	return 0;
 }
 
@@ -21,5 +21,12 @@
 #define RES_SUPR_FACTOR -20
 #define AGGRESSIVE_HCNTR 160	/* 20ms */
 
+/* Active window: the taps the echo is actually found in */
+#define DEFAULT_WIN_CHECK 8000	/* 1s between looks at the taps */
+#define DEFAULT_WIN_ENERGY 10	/* Tap groups 30dB under the peak are unused */
+#define DEFAULT_WIN_MARGIN 32	/* 4ms kept either side */
+#define DEFAULT_WIN_BAD 2000	/* 250ms of lost ERLE before widening */
+#define DEFAULT_WIN_STEP 256	/* Longest window at the full step size */
+
 #endif /* _MEC2_CONST_H */
 
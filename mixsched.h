@@ -0,0 +1,59 @@
+#ifndef _ZAPTEL_MIXSCHED_H
+#define _ZAPTEL_MIXSCHED_H
+/*
+ * When and where the master tick's conference mix runs.  Shared with
+ * mixtest, which drives it with stub mixes and a taskq that can be made
+ * to fall behind.  The includer provides zt_mix_busy, rotate_sums(),
+ * atomic_inc_32(), atomic_swap_32(), membar_producer(), membar_exit() and:
+ *
+ *   zt_mix_split(snap)	partition snap for the taskq, 0 to mix in the tick
+ *   zt_mix_dispatch()	start zt_mix_tick() on the taskq, nonzero on failure
+ *   zt_mix_phases()	one tick's mix from the partitions
+ *   __zt_mix_local(snap)	one tick's mix in the tick, snap may be NULL
+ *
+ * A tick that finds the last mix still running leaves itself in
+ * zt_mix_pending, like ztdynamic's ztd_pending, and the next mix runs it
+ * too.  Every tick so rotates the sums exactly once, only some late.
+ */
+
+static volatile uint32_t zt_mix_pending = 0;	/* Ticks skipped while busy */
+static volatile uint32_t zt_mix_overruns = 0;
+static uint32_t zt_mix_ticks = 0;		/* Ticks the running mix covers */
+
+/* The conference mix of zt_mix_ticks ticks, on the taskq */
+static void zt_mix_tick(void *arg)
+{
+	uint32_t n;
+
+	for (n=zt_mix_ticks;n;n--)
+		zt_mix_phases();
+	membar_exit();
+	zt_mix_busy = 0;
+}
+
+/* The conference part of the master tick.  zt_ticklock held. */
+static void __zt_mix_conf(struct zt_confsnap *snap)
+{
+	uint32_t ticks;
+
+	if (zt_mix_busy) {
+		/* The last tick's mix is still running on the taskq */
+		atomic_inc_32(&zt_mix_pending);
+		zt_mix_overruns++;
+		return;
+	}
+	/* This tick and any left behind while the taskq was busy */
+	ticks = 1 + atomic_swap_32(&zt_mix_pending, 0);
+	if (snap && zt_mix_split(snap)) {
+		zt_mix_ticks = ticks;
+		zt_mix_busy = 1;
+		membar_producer();
+		if (!zt_mix_dispatch())
+			return;
+		zt_mix_busy = 0;
+	}
+	while (ticks--)
+		__zt_mix_local(snap);
+}
+
+#endif /* _ZAPTEL_MIXSCHED_H */
@@ -0,0 +1,184 @@
+/*
+ * Conference mix scheduling check: mixsched.h against stub mixes.
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * The mix runs on a thread of its own, as on the taskq, and the ticks
+ * come from main().  First one mix is held back for several ticks, which
+ * must all be counted as overruns and then made up by the next mix.  Then
+ * the mixes are held for random stretches, and some dispatches fail so
+ * that the tick mixes itself.  Every tick has to rotate the sums exactly
+ * once: never ahead of the ticks, and all of them once the mixes drain.
+ *
+ *   mixtest [-n ticks] [-s seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define atomic_inc_32(p)	__sync_fetch_and_add((p), 1)
+#define atomic_swap_32(p, v)	__sync_lock_test_and_set((p), (v))
+#define membar_producer()	__sync_synchronize()
+#define membar_exit()		__sync_synchronize()
+
+struct zt_confsnap {
+	int split;			/* Mix on the "taskq" */
+};
+
+static volatile int zt_mix_busy = 0;
+
+static volatile uint32_t ticks = 0;	/* Ticks issued */
+static volatile uint32_t rotations = 0;
+static int failed = 0;
+static int fail_dispatch = 0;		/* Make zt_mix_dispatch() fail */
+
+/* Held mixes wait for hold to drop to 0 */
+static pthread_mutex_t hold_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hold_cv = PTHREAD_COND_INITIALIZER;
+static int hold = 0;
+
+static void rotate_sums(void)
+{
+	if (__sync_add_and_fetch(&rotations, 1) > ticks) {
+		printf("rotation %u ahead of tick %u\n", rotations, ticks);
+		failed = 1;
+	}
+}
+
+static int zt_mix_split(struct zt_confsnap *snap)
+{
+	return snap->split;
+}
+
+static void zt_mix_phases(void)
+{
+	pthread_mutex_lock(&hold_lock);
+	while (hold)
+		pthread_cond_wait(&hold_cv, &hold_lock);
+	pthread_mutex_unlock(&hold_lock);
+	rotate_sums();
+}
+
+static void __zt_mix_local(struct zt_confsnap *snap)
+{
+	rotate_sums();
+}
+
+static void zt_mix_tick(void *arg);
+
+static void *mix_thread(void *arg)
+{
+	zt_mix_tick(arg);
+	return NULL;
+}
+
+static int zt_mix_dispatch(void)
+{
+	pthread_t t;
+
+	if (fail_dispatch)
+		return 1;
+	if (pthread_create(&t, NULL, mix_thread, NULL))
+		return 1;
+	pthread_detach(t);
+	return 0;
+}
+
+#include "mixsched.h"
+
+static void set_hold(int h)
+{
+	pthread_mutex_lock(&hold_lock);
+	hold = h;
+	pthread_cond_broadcast(&hold_cv);
+	pthread_mutex_unlock(&hold_lock);
+}
+
+static void tick(struct zt_confsnap *snap)
+{
+	ticks++;
+	__sync_synchronize();
+	__zt_mix_conf(snap);
+}
+
+static void drain(void)
+{
+	while (zt_mix_busy)
+		usleep(100);
+}
+
+static void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-n ticks] [-s seed]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct zt_confsnap snap = { 1 };
+	long n = 20000;
+	long x;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch(c) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 's':
+			srandom(strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (n < 1)
+		usage(argv[0]);
+
+	/* One mix held over four more ticks */
+	set_hold(1);
+	tick(&snap);
+	for (x=0;x<4;x++)
+		tick(&snap);
+	if ((zt_mix_overruns != 4) || (zt_mix_pending != 4) || rotations) {
+		printf("held mix: %u overruns, %u pending, %u rotations\n",
+			zt_mix_overruns, zt_mix_pending, rotations);
+		exit(1);
+	}
+	set_hold(0);
+	drain();
+	tick(&snap);
+	drain();
+	if ((rotations != 6) || zt_mix_pending) {
+		printf("after held mix: %u rotations of 6, %u pending\n", rotations, zt_mix_pending);
+		exit(1);
+	}
+	printf("held mix: 4 overruns, made up by the next mix\n");
+
+	/* Random holds, failed dispatches and ticks mixed in the tick */
+	for (x=0;x<n && !failed;x++) {
+		if (!(random() % 64))
+			set_hold(1);
+		else if (hold && !(random() % 4))
+			set_hold(0);
+		fail_dispatch = !(random() % 16);
+		snap.split = random() % 8;
+		tick(&snap);
+		if (!(random() % 4))
+			usleep(random() % 50);
+	}
+	set_hold(0);
+	drain();
+	/* The last overruns wait for one more mix */
+	if (zt_mix_pending)
+		tick(&snap);
+	drain();
+	if (failed || (rotations != ticks)) {
+		printf("%u rotations for %u ticks\n", rotations, ticks);
+		exit(1);
+	}
+	printf("%u ticks, %u overruns, every tick rotated once\n", ticks, zt_mix_overruns);
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Short tail NLMS echo canceller
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * This program is free software and may be used and
+ * distributed according to the terms of the GNU
+ * General Public License, incorporated herein by
+ * reference.
+ *
+ * A plain normalized LMS filter, for digital trunks where the tail is
+ * short and the echo is mostly linear.  It does about half the work of
+ * MARK2 per sample: the filter runs on every sample, but the taps are
+ * only adapted on every NLMS_M'th one, from that sample's error, with
+ * a step of 2^-NLMS_MU_SHIFT normalized by the reference power over the
+ * tail.  Near-end speech is caught with a Geigel detector against the
+ * loudest block of reference in the tail.  There is no residual
+ * suppressor.
+ *
+ * Fixed point formats:
+ *   taps a_i			Q31
+ *   taps a_s (filter copy)	Q15, a_i >> 16
+ */
+#ifndef _NLMS_ECHO_H
+#define _NLMS_ECHO_H
+
+#ifdef _KERNEL
+#ifndef MALLOC
+#define MALLOC(a) kmem_alloc((a), KM_NOSLEEP)
+#define FREE(a) kmem_free(a, a->allocsize)
+#endif
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#define MALLOC(a) malloc(a)
+#define FREE(a) free(a)
+#endif
+
+#include "compat.h"
+
+/* Get optimized routines for math */
+#include "arith.h"
+
+/* Longest tail; past this use MARK2 or PBFD */
+#define NLMS_MAX_TAPS		256
+/* Adapt on every NLMS_M'th sample */
+#define NLMS_M			8
+/* Step size is 2^-NLMS_MU_SHIFT */
+#define NLMS_MU_SHIFT		0
+/* Regularization added to the reference power */
+#define NLMS_DELTA		(1 << 16)
+/* Largest step factor, so that it times a sample still fits an int */
+#define NLMS_GMAX		65535
+/* Don't adapt on reference quieter than this */
+#define NLMS_MIN_REF		64
+/* Samples to hold adaptation after near-end speech */
+#define NLMS_HANGT		600
+
+typedef struct {
+	int N;			/* Taps */
+	int i;			/* Samples seen */
+	int hcntr;		/* Near-end speech hangover */
+	int64_t P;		/* Reference power over the tail */
+
+	int *a_i;
+	short *a_s;
+	short *x;		/* Reference, newest first, twice xsize */
+	int xsize;		/* N + NLMS_M */
+	int xidx;
+
+	short *bmax;		/* Loudest reference of each block in the tail */
+	int nb;
+	int bidx;
+	int xmax;		/* Loudest of bmax[] */
+	int cur;		/* Loudest reference of this block */
+
+	size_t allocsize;
+} echo_can_state_t;
+
+static inline void nlms_add(echo_can_state_t *ec, short iref)
+{
+	int old, a;
+
+	if (--ec->xidx < 0)
+		ec->xidx += ec->xsize;
+	ec->x[ec->xidx] = iref;
+	ec->x[ec->xidx + ec->xsize] = iref;
+	old = ec->x[ec->xidx + ec->N];
+	ec->P += iref * iref - old * old;
+	a = abs(iref);
+	if (a > ec->cur)
+		ec->cur = a;
+}
+
+/* Geigel: near-end speech if the signal is over half the loudest
+   reference that can still be echoing */
+static inline int nlms_near(echo_can_state_t *ec, short isig)
+{
+	int a = abs(isig);
+
+	if ((a > (ec->xmax >> 1)) && (a > (ec->cur >> 1)))
+		ec->hcntr = NLMS_HANGT;
+	else if (ec->hcntr > 0)
+		ec->hcntr--;
+	return ec->hcntr;
+}
+
+/* Taps += mu e x / (P + delta), on the last sample of a block */
+static inline void nlms_adapt(echo_can_state_t *ec, int hcntr, short u_s)
+{
+	int64_t p;
+	int g, sh, k;
+
+	if (!hcntr && ((ec->xmax >= NLMS_MIN_REF) || (ec->cur >= NLMS_MIN_REF))) {
+		/* Scale the power into 15 bits to divide in 32 */
+		p = ec->P + NLMS_DELTA;
+		for (sh=0;p >= (1 << 15);sh++)
+			p >>= 1;
+		g = (u_s << 16) / (int)p;
+		sh += NLMS_MU_SHIFT - 15;
+		if (sh >= 0)
+			g >>= sh;
+		else if (g > (NLMS_GMAX >> -sh))
+			g = NLMS_GMAX;
+		else if (g < -(NLMS_GMAX >> -sh))
+			g = -NLMS_GMAX;
+		else
+			g <<= -sh;
+		if (g > NLMS_GMAX)
+			g = NLMS_GMAX;
+		else if (g < -NLMS_GMAX)
+			g = -NLMS_GMAX;
+		UPDATE2(ec->a_i, ec->a_s, ec->x + ec->xidx, g, ec->N);
+	}
+
+	/* Roll the block maximum */
+	ec->bmax[ec->bidx] = ec->cur;
+	if (++ec->bidx >= ec->nb)
+		ec->bidx = 0;
+	ec->cur = 0;
+	ec->xmax = 0;
+	for (k=0;k<ec->nb;k++) {
+		if (ec->bmax[k] > ec->xmax)
+			ec->xmax = ec->bmax[k];
+	}
+}
+
+static inline void echo_can_free(echo_can_state_t *ec)
+{
+	FREE(ec);
+}
+
+static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig)
+{
+	int u, hcntr;
+	short u_s;
+
+	nlms_add(ec, iref);
+	hcntr = nlms_near(ec, isig);
+
+	u = isig - (CONVOLVE2(ec->a_s, ec->x + ec->xidx, ec->N) >> 15);
+	if (u > 32767)
+		u = 32767;
+	else if (u < -32768)
+		u = -32768;
+	u_s = u;
+
+	if ((ec->i++ % NLMS_M) == NLMS_M - 1)
+		nlms_adapt(ec, hcntr, u_s);
+	return u_s;
+}
+
+#ifdef ZT_CHUNKSIZE
+#define ECHO_CAN_CHUNK
+
+/*
+ * echo_can_update() for a whole chunk, with the same output and state.
+ * The taps only change on the last sample of a block, so the chunk is
+ * cut into runs ending on such a sample and each run is filtered in one
+ * CONVOLVE2_BLOCK() pass.
+ */
+static inline void echo_can_update_chunk(echo_can_state_t *ec, const short *iref, short *isig)
+{
+	int rs[ZT_CHUNKSIZE];
+	int hcntr[ZT_CHUNKSIZE];
+	int s, e, j, u;
+
+	for (s=0;s<ZT_CHUNKSIZE;s=e+1) {
+		/* Last sample of the run */
+		e = s + NLMS_M - 1 - ec->i % NLMS_M;
+		if (e >= ZT_CHUNKSIZE)
+			e = ZT_CHUNKSIZE - 1;
+
+		for (j=s;j<=e;j++) {
+			nlms_add(ec, iref[j]);
+			hcntr[j] = nlms_near(ec, isig[j]);
+		}
+
+		/* Sample e is the newest */
+		CONVOLVE2_BLOCK(ec->a_s, ec->x + ec->xidx, ec->N, rs, e - s + 1);
+
+		for (j=s;j<=e;j++) {
+			u = isig[j] - (rs[e - j] >> 15);
+			if (u > 32767)
+				u = 32767;
+			else if (u < -32768)
+				u = -32768;
+			isig[j] = u;
+			/* Only ever true for j == e */
+			if ((ec->i++ % NLMS_M) == NLMS_M - 1)
+				nlms_adapt(ec, hcntr[j], isig[j]);
+		}
+	}
+}
+#endif	/* ZT_CHUNKSIZE */
+
+static inline echo_can_state_t *echo_can_create(int len, int adaption_mode)
+{
+	echo_can_state_t *ec;
+	int xsize, nb;
+	size_t size;
+	char *ptr;
+
+	if ((len < 1) || (len > NLMS_MAX_TAPS))
+		return NULL;
+	xsize = len + NLMS_M;
+	nb = len / NLMS_M + 1;
+	size = sizeof(echo_can_state_t) +
+					8 +				/* align */
+					sizeof(int) * len +		/* a_i */
+					sizeof(short) * len +		/* a_s */
+					2 * sizeof(short) * xsize +	/* x */
+					sizeof(short) * nb;		/* bmax */
+
+	ec = (echo_can_state_t *)MALLOC(size);
+	if (!ec)
+		return NULL;
+	bzero(ec, size);
+	ec->allocsize = size;
+	ec->N = len;
+	ec->xsize = xsize;
+	ec->nb = nb;
+
+	/* double-word align past end of state */
+	ptr = (char *)(((unsigned long)(ec + 1) + 7) & ~7UL);
+	ec->a_i = (int *)ptr;		ptr += sizeof(int) * len;
+	ec->a_s = (short *)ptr;		ptr += sizeof(short) * len;
+	ec->x = (short *)ptr;		ptr += 2 * sizeof(short) * xsize;
+	ec->bmax = (short *)ptr;
+	return ec;
+}
+
+static inline int echo_can_traintap(echo_can_state_t *ec, int pos, short val)
+{
+	/* Reset hang counter to avoid adjustments after
+	   initial forced training */
+	ec->hcntr = ec->N << 1;
+	if (pos >= ec->N)
+		return 1;
+	ec->a_i[pos] = val << 17;
+	ec->a_s[pos] = val << 1;
+	return (++pos >= ec->N);
+}
+
+#endif
@@ -0,0 +1,510 @@
+/*
+ * Partitioned block frequency domain echo canceller
+ *
+ * (C) 2006 Thralling Penguin LLC. All rights reserved.
+ *
+ * This program is free software and may be used and
+ * distributed according to the terms of the GNU
+ * General Public License, incorporated herein by
+ * reference.
+ *
+ * A multidelay block frequency domain (MDF) adaptive filter in fixed
+ * point, for tails the time domain cancellers can't afford.  The tail of
+ * N taps is cut into P partitions of L samples.  Every L samples the last
+ * 2L reference samples go through one FFT of M = 2L points, and each
+ * partition is filtered and adapted with a single complex multiply per
+ * frequency bin, against the spectrum of the block it lines up with.
+ *
+ * Block processing normally costs L samples of delay.  To keep the
+ * canceller in line with the others, the first partition is run as an
+ * ordinary FIR on each sample (its taps are transformed back every
+ * block), and the frequency domain only produces the echo of partitions
+ * 1 .. P-1, which is known a whole block ahead of time.
+ *
+ * Fixed point formats:
+ *   samples in FFT buffers	Q8
+ *   filter spectra V		Q29, scaled by 1/M (V = DFT(w) / M)
+ *   head taps w0		Q15
+ * Both transforms halve on every stage, so neither can overflow, and
+ * the 1/M of the forward one is what the formats above expect.
+ *
+ * The near-end detector and the residual suppressor are MARK2's, with
+ * the same settings.
+ */
+#ifndef _PBFD_ECHO_H
+#define _PBFD_ECHO_H
+
+#ifdef _KERNEL
+#ifndef MALLOC
+#define MALLOC(a) kmem_alloc((a), KM_NOSLEEP)
+#define FREE(a) kmem_free(a, a->allocsize)
+#endif
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#define MALLOC(a) malloc(a)
+#define FREE(a) free(a)
+#endif
+
+#include "compat.h"
+
+/* Get optimized routines for math */
+#include "arith.h"
+
+#include "mec2_const.h"
+
+/* Largest partition; the FFT is twice this */
+#define PBFD_BLOCK_MAX		64
+#define PBFD_LOG_FFT_MAX	7
+#define PBFD_FFT_MAX		(1 << PBFD_LOG_FFT_MAX)
+
+/* Step size is 2^-PBFD_MU_SHIFT */
+#define PBFD_MU_SHIFT		1
+/* Regularization added to the per bin reference power (Q16) */
+#define PBFD_DELTA		(1 << 20)
+
+/* cos(2 pi k / PBFD_FFT_MAX), k = 0 .. PBFD_FFT_MAX / 4, Q30 */
+static const int pbfd_cos[PBFD_FFT_MAX / 4 + 1] = {
+	1073741824, 1072448455, 1068571464, 1062120190,
+	1053110176, 1041563127, 1027506862, 1010975242,
+	992008094, 970651112, 946955747, 920979082,
+	892783698, 862437520, 830013654, 795590213,
+	759250125, 721080937, 681174602, 639627258,
+	596538995, 552013618, 506158392, 459083786,
+	410903207, 361732726, 311690799, 260897982,
+	209476638, 157550647, 105245103, 52686014,
+	0
+};
+
+typedef struct {
+	int N;			/* Taps */
+	int L;			/* Partition (block) length */
+	int M;			/* FFT size, 2 L */
+	int logM;
+	int P;			/* Partitions */
+	int bins;		/* M / 2 + 1, the rest follow by symmetry */
+	int step;		/* Stride through pbfd_cos for this M */
+
+	int pos;		/* Sample within the current block */
+	int xcur;		/* Newest spectrum in X */
+	int rot;		/* Next tail partition to constrain */
+	int hold;		/* Near-end speech seen in this block */
+
+	/* MARK2's power estimates and near-end detector */
+	int Ly_i;
+	int Lu_i;
+	int s_tilde_i;
+	int y_tilde_i;
+	int HCNTR_d;
+	int bmax;		/* Largest y_tilde in the current block */
+
+	int64_t *S;		/* Reference power per bin over the tail, Q16 */
+	int *Vr, *Vi;		/* P * bins filter spectra */
+	int *Xr, *Xi;		/* P * bins reference spectra, a ring */
+	int *Er, *Ei;		/* Normalized error spectrum */
+	int *sh;		/* ... and its shift per bin */
+	int *re, *im;		/* FFT work area, M each */
+	int *tail;		/* Echo of partitions 1 .. P-1, this block, Q8 */
+	int *wt;		/* Taps loaded by echo_can_traintap(), Q22 */
+	short *x;		/* Reference, last block and this one */
+	short *e;		/* Error, this block */
+	short *w0;		/* Taps of partition 0 */
+	short *h;		/* Reference history for partition 0, twice L */
+	int hidx;
+	short *ymax;		/* Largest y_tilde of each block in the tail */
+	int nymax;
+
+	size_t allocsize;
+} echo_can_state_t;
+
+static inline int pbfd_sin(echo_can_state_t *ec, int k)
+{
+	return pbfd_cos[PBFD_FFT_MAX / 4 - k * ec->step];
+}
+
+/*
+ * In place radix-2 FFT of re/im, halving each stage.  Forward gives
+ * DFT / M; inverse gives IDFT / M, which with the 1/M of the forward
+ * transform in the spectra comes back out at the right scale.
+ */
+static inline void pbfd_fft(echo_can_state_t *ec, int *re, int *im, int inverse)
+{
+	int M = ec->M;
+	int i, j, k, bit, len, half, stride;
+	int c, s, tr, ti, t;
+
+	for (i=1,j=0;i<M;i++) {
+		for (bit=M>>1;j & bit;bit>>=1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+	for (len=2;len<=M;len<<=1) {
+		half = len >> 1;
+		stride = M / len;
+		for (k=0;k<half;k++) {
+			/* e^(-+ j 2 pi k / len) */
+			if (k * stride <= M / 4) {
+				c = pbfd_cos[k * stride * ec->step];
+				s = pbfd_sin(ec, k * stride);
+			} else {
+				c = -pbfd_cos[(M / 2 - k * stride) * ec->step];
+				s = pbfd_sin(ec, M / 2 - k * stride);
+			}
+			if (!inverse)
+				s = -s;
+			for (i=k;i<M;i+=len) {
+				j = i + half;
+				tr = (int)(((int64_t)re[j] * c - (int64_t)im[j] * s) >> 30);
+				ti = (int)(((int64_t)re[j] * s + (int64_t)im[j] * c) >> 30);
+				re[j] = (re[i] - tr) >> 1;
+				im[j] = (im[i] - ti) >> 1;
+				re[i] = (re[i] + tr) >> 1;
+				im[i] = (im[i] + ti) >> 1;
+			}
+		}
+	}
+}
+
+/* Fill in the upper half of a real signal's spectrum in re/im */
+static inline void pbfd_mirror(echo_can_state_t *ec)
+{
+	int k;
+	for (k=1;k<ec->M/2;k++) {
+		ec->re[ec->M - k] = ec->re[k];
+		ec->im[ec->M - k] = -ec->im[k];
+	}
+}
+
+static inline int pbfd_sat(int64_t v)
+{
+	if (v > (1 << 29))
+		return 1 << 29;
+	if (v < -(1 << 29))
+		return -(1 << 29);
+	return (int)v;
+}
+
+/* Load partition p from time domain taps t[0 .. L-1], Q29 */
+static inline void pbfd_load(echo_can_state_t *ec, int p)
+{
+	int k, o = p * ec->bins;
+	for (k=ec->L;k<ec->M;k++)
+		ec->re[k] = 0;
+	for (k=0;k<ec->M;k++)
+		ec->im[k] = 0;
+	pbfd_fft(ec, ec->re, ec->im, 0);
+	for (k=0;k<ec->bins;k++) {
+		ec->Vr[o + k] = ec->re[k];
+		ec->Vi[o + k] = ec->im[k];
+	}
+}
+
+/*
+ * Take partition p back to the time domain and drop the second half of
+ * its taps, which unconstrained updates leave behind and which would
+ * otherwise wrap around in the circular convolution.  Partition 0's taps
+ * are copied out for the FIR on the way.
+ */
+static inline void pbfd_constrain(echo_can_state_t *ec, int p)
+{
+	int k, o = p * ec->bins;
+	for (k=0;k<ec->bins;k++) {
+		ec->re[k] = ec->Vr[o + k];
+		ec->im[k] = ec->Vi[o + k];
+	}
+	pbfd_mirror(ec);
+	/* w / M in Q29 is w in Q22 */
+	pbfd_fft(ec, ec->re, ec->im, 1);
+	if (!p) {
+		for (k=0;k<ec->L;k++) {
+			int w = (ec->re[k] + (1 << 6)) >> 7;
+			if (w > 32767)
+				w = 32767;
+			else if (w < -32768)
+				w = -32768;
+			ec->w0[k] = w;
+		}
+	}
+	for (k=0;k<ec->L;k++)
+		ec->re[k] = pbfd_sat((int64_t)ec->re[k] << 7);
+	pbfd_load(ec, p);
+}
+
+/* The end of a block: adapt, then work out the tail echo of the next one */
+static inline void pbfd_block(echo_can_state_t *ec)
+{
+	int bins = ec->bins;
+	int k, p, o, xo, s, d, inv;
+	int64_t a, b, den;
+
+	/* Spectrum of the last 2 L reference samples */
+	ec->xcur = (ec->xcur + 1) % ec->P;
+	xo = ec->xcur * bins;
+	for (k=0;k<ec->M;k++) {
+		ec->re[k] = ec->x[k] << 8;
+		ec->im[k] = 0;
+	}
+	pbfd_fft(ec, ec->re, ec->im, 0);
+	for (k=0;k<bins;k++) {
+		/* The spectrum P blocks old drops out of the power as this one goes in */
+		ec->S[k] -= (int64_t)ec->Xr[xo + k] * ec->Xr[xo + k] + (int64_t)ec->Xi[xo + k] * ec->Xi[xo + k];
+		ec->S[k] += (int64_t)ec->re[k] * ec->re[k] + (int64_t)ec->im[k] * ec->im[k];
+		ec->Xr[xo + k] = ec->re[k];
+		ec->Xi[xo + k] = ec->im[k];
+	}
+
+	/* Remember the loudest reference for the near-end detector */
+	ec->ymax[ec->nymax] = ec->bmax;
+	if (++ec->nymax > ec->P)
+		ec->nymax = 0;
+	ec->bmax = 0;
+
+	if (!ec->hold && !ec->HCNTR_d && (ec->Lu_i > MIN_UPDATE_THRESH_I)) {
+		/* Error block, zero padded in front */
+		for (k=0;k<ec->L;k++) {
+			ec->re[k] = 0;
+			ec->re[ec->L + k] = ec->e[k] << 8;
+		}
+		for (k=0;k<ec->M;k++)
+			ec->im[k] = 0;
+		pbfd_fft(ec, ec->re, ec->im, 0);
+
+		/*
+		 * Divide the error by the reference power once per bin, keeping
+		 * a shift aside, so each partition's update is one complex
+		 * multiply.  The power is cut down to 16 bits for the divide.
+		 */
+		for (k=0;k<bins;k++) {
+			den = ec->S[k] + PBFD_DELTA;
+			s = 0;
+			while (den >= (1 << 24)) {
+				den >>= 8;
+				s += 8;
+			}
+			while (den >= (1 << 16)) {
+				den >>= 1;
+				s++;
+			}
+			d = (int)den;
+			inv = (int)(0x80000000U / (unsigned)d);
+			ec->Er[k] = (int)(((int64_t)ec->re[k] * inv) >> 16);
+			ec->Ei[k] = (int)(((int64_t)ec->im[k] * inv) >> 16);
+			/* mu, and the 1/M that V carries */
+			s += PBFD_MU_SHIFT + ec->logM - 14;
+			ec->sh[k] = (s > 0) ? s : 0;
+		}
+
+		/* Partition p lines up with the reference of p blocks ago */
+		for (p=0;p<ec->P;p++) {
+			o = p * bins;
+			xo = ((ec->xcur - p + ec->P) % ec->P) * bins;
+			for (k=0;k<bins;k++) {
+				/* conj(X) E */
+				a = (int64_t)ec->Xr[xo + k] * ec->Er[k] + (int64_t)ec->Xi[xo + k] * ec->Ei[k];
+				b = (int64_t)ec->Xr[xo + k] * ec->Ei[k] - (int64_t)ec->Xi[xo + k] * ec->Er[k];
+				ec->Vr[o + k] = pbfd_sat(ec->Vr[o + k] + (a >> ec->sh[k]));
+				ec->Vi[o + k] = pbfd_sat(ec->Vi[o + k] + (b >> ec->sh[k]));
+			}
+		}
+
+		/* Partition 0 every time, since the FIR needs it; one other in turn */
+		pbfd_constrain(ec, 0);
+		if (ec->P > 1) {
+			pbfd_constrain(ec, ec->rot);
+			if (++ec->rot >= ec->P)
+				ec->rot = 1;
+		}
+	}
+	ec->hold = 0;
+
+	/* Echo of partitions 1 .. P-1 over the next block */
+	if (ec->P > 1) {
+		for (k=0;k<bins;k++) {
+			a = 0;
+			b = 0;
+			for (p=1;p<ec->P;p++) {
+				o = p * bins + k;
+				xo = ((ec->xcur - p + 1 + ec->P) % ec->P) * bins + k;
+				a += (int64_t)ec->Vr[o] * ec->Xr[xo] - (int64_t)ec->Vi[o] * ec->Xi[xo];
+				b += (int64_t)ec->Vr[o] * ec->Xi[xo] + (int64_t)ec->Vi[o] * ec->Xr[xo];
+			}
+			/* Q29 * Q8 back to Q8, times M^2 for the two 1/M's */
+			ec->re[k] = pbfd_sat(a >> (29 - 2 * ec->logM));
+			ec->im[k] = pbfd_sat(b >> (29 - 2 * ec->logM));
+		}
+		pbfd_mirror(ec);
+		pbfd_fft(ec, ec->re, ec->im, 1);
+		for (k=0;k<ec->L;k++)
+			ec->tail[k] = ec->re[ec->L + k];
+	}
+
+	/* Slide the reference along */
+	for (k=0;k<ec->L;k++)
+		ec->x[k] = ec->x[ec->L + k];
+}
+
+static inline void echo_can_free(echo_can_state_t *ec)
+{
+	FREE(ec);
+}
+
+static inline short echo_can_update(echo_can_state_t *ec, short iref, short isig)
+{
+	int rs, u, k, ymax;
+	short u_s;
+
+	/* Partition 0 as a FIR, plus the tail worked out at the last block */
+	if (--ec->hidx < 0)
+		ec->hidx += ec->L;
+	ec->h[ec->hidx] = iref;
+	ec->h[ec->hidx + ec->L] = iref;
+	rs = CONVOLVE2(ec->w0, ec->h + ec->hidx, ec->L) >> 7;
+	rs = (rs + ec->tail[ec->pos] + (1 << 7)) >> 8;
+
+	u = isig - rs;
+	if (u > 32767)
+		u = 32767;
+	else if (u < -32768)
+		u = -32768;
+	u_s = u;
+
+	ec->x[ec->L + ec->pos] = iref;
+	ec->e[ec->pos] = u_s;
+
+	/* Power estimates, as MARK2 keeps them, over exponential windows */
+	ec->s_tilde_i += abs(isig) - (ec->s_tilde_i >> DEFAULT_ALPHA_ST_I);
+	ec->y_tilde_i += (abs(iref) - ec->y_tilde_i) >> DEFAULT_ALPHA_YT_I;
+	ec->Lu_i += abs(u_s) - (ec->Lu_i >> DEFAULT_SIGMA_LU_I);
+	ec->Ly_i += abs(iref) - (ec->Ly_i >> DEFAULT_SIGMA_LY_I);
+	if (ec->Ly_i < DEFAULT_CUTOFF_I)
+		ec->Ly_i = DEFAULT_CUTOFF_I;
+
+	/* Geigel detector against the loudest reference still in the tail */
+	if (ec->y_tilde_i > ec->bmax)
+		ec->bmax = ec->y_tilde_i;
+	ymax = ec->bmax;
+	for (k=0;k<=ec->P;k++) {
+		if (ec->ymax[k] > ymax)
+			ymax = ec->ymax[k];
+	}
+	if ((ec->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)) > ymax)
+		ec->HCNTR_d = DEFAULT_HANGT;
+	else if (ec->HCNTR_d > 0)
+		ec->HCNTR_d--;
+	if (ec->HCNTR_d)
+		ec->hold = 1;
+
+	if (++ec->pos >= ec->L) {
+		pbfd_block(ec);
+		ec->pos = 0;
+	}
+
+#ifndef NO_ECHO_SUPPRESSOR
+#ifdef AGGRESSIVE_SUPPRESSOR
+	if ((ec->HCNTR_d < AGGRESSIVE_HCNTR) && (ec->Ly_i > (ec->Lu_i << 1))) {
+		u_s = u_s * (ec->Lu_i >> DEFAULT_SIGMA_LU_I) / ((ec->Ly_i >> (DEFAULT_SIGMA_LY_I)) + 1);
+		u_s = u_s * (ec->Lu_i >> DEFAULT_SIGMA_LU_I) / ((ec->Ly_i >> (DEFAULT_SIGMA_LY_I)) + 1);
+	}
+#else
+	if ((ec->HCNTR_d == 0) && ((ec->Ly_i/(ec->Lu_i + 1)) > DEFAULT_SUPPR_I)) {
+		u_s = u_s * (ec->Lu_i >> DEFAULT_SIGMA_LU_I) / ((ec->Ly_i >> (DEFAULT_SIGMA_LY_I + 2)) + 1);
+	}
+#endif
+#endif
+	return u_s;
+}
+
+static inline echo_can_state_t *echo_can_create(int len, int adaption_mode)
+{
+	echo_can_state_t *ec;
+	int L, M, P, bins;
+	size_t size;
+	char *ptr;
+
+	L = (len < PBFD_BLOCK_MAX) ? len : PBFD_BLOCK_MAX;
+	if ((L < 8) || (L & (L - 1)) || (len % L))
+		return NULL;
+	M = 2 * L;
+	P = len / L;
+	bins = M / 2 + 1;
+	size = sizeof(echo_can_state_t) +
+					8 +				/* align */
+					sizeof(int64_t) * bins +	/* S */
+					4 * sizeof(int) * P * bins +	/* Vr, Vi, Xr, Xi */
+					3 * sizeof(int) * bins +	/* Er, Ei, sh */
+					2 * sizeof(int) * M +		/* re, im */
+					sizeof(int) * L +		/* tail */
+					sizeof(int) * len +		/* wt */
+					sizeof(short) * M +		/* x */
+					sizeof(short) * L +		/* e */
+					sizeof(short) * L +		/* w0 */
+					2 * sizeof(short) * L +		/* h */
+					sizeof(short) * (P + 1);	/* ymax */
+
+	ec = (echo_can_state_t *)MALLOC(size);
+	if (!ec)
+		return NULL;
+	bzero(ec, size);
+	ec->allocsize = size;
+	ec->N = len;
+	ec->L = L;
+	ec->M = M;
+	for (ec->logM=0;(1 << ec->logM) < M;ec->logM++);
+	ec->P = P;
+	ec->bins = bins;
+	ec->step = PBFD_FFT_MAX / M;
+	ec->rot = 1;
+	ec->Ly_i = DEFAULT_CUTOFF_I;
+	ec->Lu_i = DEFAULT_CUTOFF_I;
+
+	/* double-word align past end of state */
+	ptr = (char *)(((unsigned long)(ec + 1) + 7) & ~7UL);
+	ec->S = (int64_t *)ptr;		ptr += sizeof(int64_t) * bins;
+	ec->Vr = (int *)ptr;		ptr += sizeof(int) * P * bins;
+	ec->Vi = (int *)ptr;		ptr += sizeof(int) * P * bins;
+	ec->Xr = (int *)ptr;		ptr += sizeof(int) * P * bins;
+	ec->Xi = (int *)ptr;		ptr += sizeof(int) * P * bins;
+	ec->Er = (int *)ptr;		ptr += sizeof(int) * bins;
+	ec->Ei = (int *)ptr;		ptr += sizeof(int) * bins;
+	ec->sh = (int *)ptr;		ptr += sizeof(int) * bins;
+	ec->re = (int *)ptr;		ptr += sizeof(int) * M;
+	ec->im = (int *)ptr;		ptr += sizeof(int) * M;
+	ec->tail = (int *)ptr;		ptr += sizeof(int) * L;
+	ec->wt = (int *)ptr;		ptr += sizeof(int) * len;
+	ec->x = (short *)ptr;		ptr += sizeof(short) * M;
+	ec->e = (short *)ptr;		ptr += sizeof(short) * L;
+	ec->w0 = (short *)ptr;		ptr += sizeof(short) * L;
+	ec->h = (short *)ptr;		ptr += 2 * sizeof(short) * L;
+	ec->ymax = (short *)ptr;
+	return ec;
+}
+
+static inline int echo_can_traintap(echo_can_state_t *ec, int pos, short val)
+{
+	int p, k;
+
+	/* Reset hang counter to avoid adjustments after
+	   initial forced training */
+	ec->HCNTR_d = ec->N << 1;
+	if (pos >= ec->N)
+		return 1;
+	ec->wt[pos] = val << 8;
+	if (++pos < ec->N)
+		return 0;
+	/* Have them all; move them into the filter */
+	for (p=0;p<ec->P;p++) {
+		for (k=0;k<ec->L;k++)
+			ec->re[k] = pbfd_sat((int64_t)ec->wt[p * ec->L + k] << 7);
+		pbfd_load(ec, p);
+	}
+	pbfd_constrain(ec, 0);
+	return 1;
+}
+
+#endif
@@ -54,6 +54,8 @@
 #include <sys/poll.h>
 #include <sys/kmem.h>
 #include <sys/ksynch.h>
+#include <sys/atomic.h>
+#include <sys/mman.h>
 #include <stddef.h>
 
 /* Must be after other includes */
@@ -86,11 +88,76 @@
 #define FAST_HDLC_NEED_TABLES
 #include "fasthdlc.h"
 
+/* Echo canceller states come from zt_ecpool, see zt_ec_alloc() */
+static void *zt_ec_alloc(size_t size);
+static void zt_ec_free(void *ec, size_t size);
+#define MALLOC(a) zt_ec_alloc(a)
+#define FREE(a) zt_ec_free(a, (a)->allocsize)
+
 #include "zaptel.h"
 
 /* Get helper arithmetic */
 #include "arith.h"
 
+/* Echo canceller engines, each under its own names so that they can all
+   be built in; see zt_ec_engines[] */
+#define echo_can_state_t	mark2_state_t
+#define echo_can_create		mark2_create
+#define echo_can_free		mark2_free
+#define echo_can_update		mark2_update
+#define echo_can_update_chunk	mark2_update_chunk
+#define echo_can_traintap	mark2_traintap
+#include "mec2.h"
+#undef echo_can_state_t
+#undef echo_can_create
+#undef echo_can_free
+#undef echo_can_update
+#undef echo_can_update_chunk
+#undef echo_can_traintap
+
+#define echo_can_state_t	nlms_state_t
+#define echo_can_create		nlms_create
+#define echo_can_free		nlms_free
+#define echo_can_update		nlms_update
+#define echo_can_update_chunk	nlms_update_chunk
+#define echo_can_traintap	nlms_traintap
+#include "nlms.h"
+#undef echo_can_state_t
+#undef echo_can_create
+#undef echo_can_free
+#undef echo_can_update
+#undef echo_can_update_chunk
+#undef echo_can_traintap
+
+#define echo_can_state_t	pbfd_state_t
+#define echo_can_create		pbfd_create
+#define echo_can_free		pbfd_free
+#define echo_can_update		pbfd_update
+#define echo_can_traintap	pbfd_traintap
+#include "pbfd.h"
+#undef echo_can_state_t
+#undef echo_can_create
+#undef echo_can_free
+#undef echo_can_update
+#undef echo_can_traintap
+
+/* Compile time checks of the struct zt_chan layout described in zaptel.h.
+   A failing check shows up as a negative array size. */
+#define ZT_LAYOUT_CHECK(name, cond) \
+	typedef char zt_layout_##name[(cond) ? 1 : -1]
+
+/* The per-tick fields and the voice samples the tick keeps (getlin,
+   getlin_lastchunk, putlin) fill no more than five lines; chanlayout
+   shows the lines the rest of the tick touches */
+ZT_LAYOUT_CHECK(hot_head, offsetof(struct zt_chan, getlin_lastchunk) +
+	sizeof(((struct zt_chan *)0)->getlin_lastchunk) <= 5 * ZT_CACHE_LINE);
+/* The span's and the user's ends of each ring can't share a line,
+   wherever the channel starts */
+ZT_LAYOUT_CHECK(rings_split, offsetof(struct zt_chan, rxtail) >=
+	offsetof(struct zt_chan, txtail) + sizeof(uint_t) + ZT_CACHE_LINE);
+/* Cold state all comes after the hot part */
+ZT_LAYOUT_CHECK(cold_last, offsetof(struct zt_chan, name) > offsetof(struct zt_chan, txhead));
+
 /* macro-oni for determining a unit (channel) number */
 #define	UNIT(file) MINOR(file->f_dentry->d_inode->i_rdev)
 
@@ -110,6 +177,9 @@ static char *zt_txlevelnames[] = {
 
 static int deftaps = 64;
 
+/* Tail lengths ZT_ECHOCANCEL takes, up to each engine's maxtaps */
+static const int zt_ectaps[] = { 32, 64, 128, 256, 512, 1024 };
+
 static 
 unsigned short fcstab[256] =
 {
@@ -154,6 +224,16 @@ static inline unsigned int crc_ccitt_byte(unsigned int crc, const unsigned char
 
 static int debug = 0;
 
+/* ACSS/SCSS implementation, see arith.h; -1 picks one at load */
+int zt_arith = -1;
+
+/* Linear to companded encoder for whole buffers, see zt_lin2x().  Picked
+   by zt_conv_init() at module load; may be forced from /etc/system (set
+   zaptel:zt_xlawenc=N) */
+#define ZT_XLAWENC_TABLE	0	/* __zt_lin2mu[]/__zt_lin2a[] lookups */
+#define ZT_XLAWENC_CALC		1	/* Segment search by leading zeros */
+int zt_xlawenc = -1;
+
 /* states for transmit signalling */
 typedef enum {ZT_TXSTATE_ONHOOK,ZT_TXSTATE_OFFHOOK,ZT_TXSTATE_START,
 	ZT_TXSTATE_PREWINK,ZT_TXSTATE_WINK,ZT_TXSTATE_PREFLASH,
@@ -165,7 +245,7 @@ typedef enum {ZT_TXSTATE_ONHOOK,ZT_TXSTATE_OFFHOOK,ZT_TXSTATE_START,
 
 typedef short sumtype[ZT_MAX_CHUNKSIZE];
 
-static sumtype sums[(ZT_MAX_CONF + 1) * 3];
+static sumtype sums[(ZT_MAX_CONF + 1) * 3] __attribute__((aligned(8)));
 
 /* Translate conference aliases into actual conferences 
    and vice-versa */
@@ -176,8 +256,25 @@ static sumtype *conf_sums_next;
 static sumtype *conf_sums;
 static sumtype *conf_sums_prev;
 
+/* One bit per conference for each set of sums[], marking the entries that
+   have been summed into since that set was last cleared */
+#define ZT_CONF_WORDS	((ZT_MAX_CONF + 32) / 32)
+
+static unsigned int sums_dirty[3][ZT_CONF_WORDS];
+static unsigned int *conf_dirty_next;
+static unsigned int *conf_dirty;
+
+/* Conference sums cleared by the last rotate_sums(), and the peak */
+int zt_conf_touched;
+int zt_conf_touched_max;
+
 static struct zt_span *master;
 
+/* Conference sums rotate once per master tick, so only spans that tick
+   every ZT_CHUNKSIZE can provide timing or take part in conferences */
+#define ZT_SPAN_TIMING(s) ((s)->chunksize <= ZT_CHUNKSIZE)
+#define ZT_CHAN_MULTICHUNK(c) ((c)->span && !ZT_SPAN_TIMING((c)->span))
+
 static struct
 {
 	int	src;	/* source conf number */
@@ -231,20 +328,43 @@ of the next sample chunk's data (next time around the world).
 
 static int zt_chan_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *credp, int *rvalp);
 
-static struct zt_timer {
+/* /dev/zap/timer descriptors.  Their timers run on zt_fdwheel, which is
+   advanced by the master span's tick, so the tick only touches the timers
+   that run out.  ZT_TIMERCONFIG drives the one built in timer; after
+   ZT_TIMERSETUP a descriptor also carries an array of logical timers,
+   armed with ZT_TIMERSET and collected together with ZT_TIMERGET.
+   Everything here is under zt_fdwheel.lock. */
+struct zt_fdtimer;
+
+struct zt_ltimer {
+	struct zt_timer wt;		/* Our place on zt_fdwheel, must be first */
+	struct zt_fdtimer *fd;		/* Descriptor we belong to */
+	int id;				/* Index in fd->timers */
+	unsigned int period;		/* Chunks between runs, 0 for one-shot */
+	unsigned int tripped;		/* Runs not collected yet */
+	struct zt_ltimer *nextexp;	/* On fd->expired */
+};
+
+struct zt_fdtimer {
 	int dev;		/* Which dev number */
-	int ms;			/* Countdown */
-	int pos;		/* Position */
 	int ping;		/* Whether we've been ping'd */
-	int tripped;	/* Whether we're tripped */
-	struct zt_timer *next;	/* Linked list */
+	struct zt_ltimer one;	/* The ZT_TIMERCONFIG timer */
+	struct zt_ltimer *timers;	/* Logical timers (ZT_TIMERSETUP) */
+	int ntimers;
+	struct zt_ltimer *expired;	/* Logical timers with tripped runs */
+	struct zt_ltimer **exptail;
+	int waking;		/* Already on this tick's wakeup list */
+	struct zt_fdtimer *nextwake;
 	struct pollhead sel;
-} *zaptimers = NULL;
+};
 
-static kmutex_t zaptimerlock; /* = SPIN_LOCK_UNLOCKED;*/
+static struct zt_timerwheel zt_fdwheel;
 
 static kmutex_t bigzaplock; /* = SPIN_LOCK_UNLOCKED; */
 
+/* Serializes the master span's tick.  Nothing else takes it. */
+static kmutex_t zt_ticklock;
+
 struct zt_zone {
 	size_t allocsize;
 	char name[40];	/* Informational, only */
@@ -256,23 +376,195 @@ struct zt_zone {
 	   unavailable */
 };
 
-#define ZT_DEV_TIMER_BASE	5000
+/* Minor numbers.  A pseudo channel's minor is its channel number, so
+   the named nodes and the clone ranges all sit above ZT_MAX_CHANNELS. */
+#define ZT_DEV_CTL		0
+#define ZT_DEV_TIMER		ZT_MAX_CHANNELS		/* /dev/zap/timer */
+#define ZT_DEV_CHANNEL		(ZT_MAX_CHANNELS + 1)	/* /dev/zap/channel */
+#define ZT_DEV_PSEUDO		(ZT_MAX_CHANNELS + 2)	/* /dev/zap/pseudo */
+#define ZT_DEV_MUX		(ZT_MAX_CHANNELS + 3)	/* Clone node for /dev/zap/mux */
+
+#define ZT_DEV_MUX_BASE		(ZT_MAX_CHANNELS + 4)
+#define ZT_DEV_MUX_COUNT	64
+
+#define ZT_DEV_TIMER_BASE	(ZT_DEV_MUX_BASE + ZT_DEV_MUX_COUNT)
 #define ZT_DEV_TIMER_COUNT	1000
 
-#define ZT_DEV_CHAN_BASE	7000
-#define ZT_DEV_CHAN_COUNT	1000
+#define ZT_DEV_CHAN_BASE	(ZT_DEV_TIMER_BASE + ZT_DEV_TIMER_COUNT)
+#define ZT_DEV_CHAN_COUNT	ZT_MAX_CHANNELS
+
+/* Buffer ring positions (see rxhead/txhead in struct zt_chan) */
+#define ZT_RXBUF_IN(c)		((c)->rxhead % (c)->numbufs)
+#define ZT_RXBUF_OUT(c)		((c)->rxtail % (c)->numbufs)
+#define ZT_TXBUF_IN(c)		((c)->txhead % (c)->numbufs)
+#define ZT_TXBUF_OUT(c)		((c)->txtail % (c)->numbufs)
+/* Somewhere for the span to receive into */
+#define ZT_RXBUF_ROOM(c)	((c)->readbuf[0] && ((c)->rxhead - (c)->rxtail < (c)->numbufs))
+/* Something for the reader */
+#define ZT_RXBUF_READY(c)	((c)->rxhead != (c)->rxtail)
+/* Somewhere for the writer to write into */
+#define ZT_TXBUF_ROOM(c)	((c)->writebuf[0] && ((c)->txhead - (c)->txtail < (c)->numbufs))
+/* Something for the span to transmit */
+#define ZT_TXBUF_READY(c)	((c)->txhead != (c)->txtail)
+
+/* The span and channel tables, and chan_map[] below, start small and
+   double as they fill, up to ZT_MAX_SPANS / ZT_MAX_CHANNELS.  They are
+   indexed without a lock, so a table that has been outgrown may still be
+   in use and is kept on zt_oldtabs until the driver detaches; the copies
+   add up to less than the final table.  The new table is in place before
+   the count that lets anybody index past the old one (see
+   __zt_tab_grow()).  Changes happen under chan_lock as writer.
+
+   nchans and nspans are the sizes of the tables, maxchans and maxspans
+   one more than the highest slot in use.  Slots are handed out lowest
+   first; zt_chanfree is where a search for a free channel starts. */
+#define ZT_CHANTAB_MIN		64
+#define ZT_SPANTAB_MIN		8
+#define ZT_CHANMAP_MIN		32
+
+struct zt_oldtab {
+	struct zt_oldtab *next;
+	void *tab;
+	size_t size;
+};
 
-static struct zt_span *spans[ZT_MAX_SPANS];
-static struct zt_chan *chans[ZT_MAX_CHANNELS]; 
+static struct zt_oldtab *zt_oldtabs = NULL;
+
+static struct zt_span **spans = NULL;
+static struct zt_chan **chans = NULL;
+static int nspans = 0;
+static int nchans = 0;
+static int zt_chanfree = 1;
+
+/* Channels the master span has to visit every tick, by channel number.
+   Membership is only a hint: the tick re-checks each entry and skips the
+   ones that no longer qualify, and __zt_active_prune() drops them the
+   next time a snapshot is published, so removal may be lazy.  Changes
+   must happen under bigzaplock (see __zt_update_active()). */
+#define ZT_ACTIVE_CONF		0	/* Real channels with a confmode */
+#define ZT_ACTIVE_PSEUDO	1	/* Pseudo channels */
+
+static struct zt_activeset {
+	int n;
+	int size;			/* Slots in list[] and pos[] */
+	int *list;
+	int *pos;			/* Index into list + 1, 0 if absent */
+} activesets[2];
+
+/* What the tick works from: the active lists and the conference links
+   (already resolved to aliases), copied out under bigzaplock and
+   published with a single pointer store.  A snapshot is never changed
+   once published.  zt_tick_seq is odd while a tick is running; a
+   replaced snapshot is freed once the tick that might be using it has
+   finished. */
+struct zt_confsnap {
+	size_t size;
+	uint32_t retired;		/* zt_tick_seq when it was replaced */
+	struct zt_confsnap *next;	/* Retired list */
+	int nconf;
+	int npseudo;
+	int nlinks;
+	int *conf;
+	int *pseudo;
+	int *links;			/* src, dst alias pairs */
+};
 
-static int chan_map[ZT_DEV_CHAN_COUNT];
-static struct zt_timer *chan_timer_map[ZT_DEV_TIMER_COUNT];
+static struct zt_confsnap *volatile zt_snap = NULL;
+static struct zt_confsnap *zt_snap_retired = NULL;
+static volatile uint32_t zt_tick_seq = 0;
+/* Set while a tick's conference mix runs on the taskq */
+static volatile int zt_mix_busy = 0;
+
+static void __zt_mix_grow(int n);
+
+/* Channel number behind each /dev/zap/channel clone, -2 until
+   ZT_SPECIFY and -1 for a free minor */
+static int *chan_map = NULL;
+static int nchanmap = 0;
+static struct zt_fdtimer *chan_timer_map[ZT_DEV_TIMER_COUNT];
+
+/* /dev/zap/mux instances.  Each keeps a queue of channels that may have
+   become ready, with each channel queued at most once.  Bit n of
+   chan->muxwatch says that mux n is watching the channel.  The per
+   channel arrays are indexed by channel number and grow with ZT_MUX_SET.
+   Lock order is chan_lock, chan->lock, zt_muxlock, mux->lock. */
+struct zt_mux {
+	kmutex_t lock;
+	kcondvar_t readyq;
+	struct pollhead sel;
+	int slots;			/* Size of the arrays below */
+	short *interest;		/* ZT_MUX_* per channel */
+	u_char *queued;
+	int *queue;
+	int qhead;
+	int qlen;
+};
+
+static struct zt_mux *zt_muxes[ZT_DEV_MUX_COUNT];
+static kmutex_t zt_muxlock;
 
 static int maxspans = 0;
 static int maxchans = 0;
 static int maxconfs = 0;
 static int maxlinks = 0;
 
+/* Make *tabp, n slots of elem bytes, at least need slots long and return
+   its new size.  Called with chan_lock held as writer; see zt_oldtabs. */
+static int __zt_tab_grow(void **tabp, int n, int need, int min, int max, size_t elem)
+{
+	struct zt_oldtab *old;
+	void *tab;
+	int newn = n ? n : min;
+
+	while (newn < need)
+		newn <<= 1;
+	if (newn > max)
+		newn = max;
+	tab = kmem_zalloc(newn * elem, KM_SLEEP);
+	if (n) {
+		bcopy(*tabp, tab, n * elem);
+		old = kmem_alloc(sizeof(struct zt_oldtab), KM_SLEEP);
+		old->tab = *tabp;
+		old->size = n * elem;
+		old->next = zt_oldtabs;
+		zt_oldtabs = old;
+	}
+	/* Contents before the pointer, pointer before the new size */
+	membar_producer();
+	*tabp = tab;
+	membar_producer();
+	return newn;
+}
+
+static void zt_tab_cleanup(void)
+{
+	struct zt_oldtab *old;
+	int x;
+
+	while ((old = zt_oldtabs)) {
+		zt_oldtabs = old->next;
+		kmem_free(old->tab, old->size);
+		kmem_free(old, sizeof(struct zt_oldtab));
+	}
+	if (chans)
+		kmem_free(chans, nchans * sizeof(struct zt_chan *));
+	if (spans)
+		kmem_free(spans, nspans * sizeof(struct zt_span *));
+	if (chan_map)
+		kmem_free(chan_map, nchanmap * sizeof(int));
+	chans = NULL;
+	spans = NULL;
+	chan_map = NULL;
+	nchans = nspans = nchanmap = 0;
+	for (x=0;x<2;x++) {
+		if (activesets[x].size) {
+			kmem_free(activesets[x].list, activesets[x].size * sizeof(int));
+			kmem_free(activesets[x].pos, activesets[x].size * sizeof(int));
+		}
+		bzero(&activesets[x], sizeof(activesets[x]));
+	}
+}
+
 static int default_zone = DEFAULT_TONE_ZONE;
 
 short __zt_mulaw[256];
@@ -286,6 +578,181 @@ u_char __zt_lin2a[16384];
 
 static u_char defgain[256];
 
+/* Gain tables, shared by every channel with the same gains and law.  A
+   channel at 0 dB uses defgain and no entry.  Besides the companded
+   rx/tx gain tables each entry carries rxlin[], the received sample
+   with rx gain applied, already decoded to linear.  The list and the
+   reference counts are protected by zt_gainlock, which nests inside
+   chan->lock. */
+struct zt_gaintab {
+	struct zt_gaintab *next;
+	int refs;
+	short *xlaw;			/* Law rxlin[] decodes to */
+	short rxlin[256];		/* xlaw[rxgain[i]] */
+	u_char rxgain[256];
+	u_char txgain[256];
+};
+
+static struct zt_gaintab *zt_gaintabs = NULL;
+static kmutex_t zt_gainlock;
+
+/* An echo canceller a channel can run.  chan->ec is the state, made by
+   create() and only ever handed to the same engine's other calls.  The
+   counters are updated with atomics, from any channel. */
+struct zt_ec_engine {
+	int id;				/* ZT_EC_* */
+	char *name;
+	int maxtaps;
+	void *(*create)(int taps);
+	void (*free)(void *ec);
+	/* Cancel echo of iref[] out of isig[], ZT_CHUNKSIZE samples */
+	void (*chunk)(void *ec, const short *iref, short *isig);
+	int (*traintap)(void *ec, int pos, short val);
+	size_t (*size)(void *ec);
+	volatile uint32_t chans;	/* Channels running it */
+	volatile uint32_t bytes;	/* State they hold */
+	volatile uint64_t samples;	/* Samples timed */
+	volatile uint64_t ns;		/* Time spent cancelling them */
+};
+
+static void *zt_mark2_create(int taps)
+{
+	return mark2_create(taps, 0);
+}
+
+static void zt_mark2_free(void *ec)
+{
+	mark2_free(ec);
+}
+
+static void zt_mark2_chunk(void *ec, const short *iref, short *isig)
+{
+	mark2_update_chunk(ec, iref, isig);
+}
+
+static int zt_mark2_traintap(void *ec, int pos, short val)
+{
+	return mark2_traintap(ec, pos, val);
+}
+
+static size_t zt_mark2_size(void *ec)
+{
+	return ((mark2_state_t *)ec)->allocsize;
+}
+
+static void *zt_nlms_create(int taps)
+{
+	return nlms_create(taps, 0);
+}
+
+static void zt_nlms_free(void *ec)
+{
+	nlms_free(ec);
+}
+
+static void zt_nlms_chunk(void *ec, const short *iref, short *isig)
+{
+	nlms_update_chunk(ec, iref, isig);
+}
+
+static int zt_nlms_traintap(void *ec, int pos, short val)
+{
+	return nlms_traintap(ec, pos, val);
+}
+
+static size_t zt_nlms_size(void *ec)
+{
+	return ((nlms_state_t *)ec)->allocsize;
+}
+
+static void *zt_pbfd_create(int taps)
+{
+	return pbfd_create(taps, 0);
+}
+
+static void zt_pbfd_free(void *ec)
+{
+	pbfd_free(ec);
+}
+
+/* PBFD works a block at a time inside; its per sample call is it */
+static void zt_pbfd_chunk(void *ec, const short *iref, short *isig)
+{
+	int x;
+
+	for (x=0;x<ZT_CHUNKSIZE;x++)
+		isig[x] = pbfd_update(ec, iref[x], isig[x]);
+}
+
+static int zt_pbfd_traintap(void *ec, int pos, short val)
+{
+	return pbfd_traintap(ec, pos, val);
+}
+
+static size_t zt_pbfd_size(void *ec)
+{
+	return ((pbfd_state_t *)ec)->allocsize;
+}
+
+static struct zt_ec_engine zt_ec_engines[] = {
+	{ ZT_EC_MARK2, "MARK2", 1024, zt_mark2_create, zt_mark2_free,
+	  zt_mark2_chunk, zt_mark2_traintap, zt_mark2_size },
+	{ ZT_EC_NLMS, "NLMS", NLMS_MAX_TAPS, zt_nlms_create, zt_nlms_free,
+	  zt_nlms_chunk, zt_nlms_traintap, zt_nlms_size },
+	{ ZT_EC_PBFD, "PBFD", 1024, zt_pbfd_create, zt_pbfd_free,
+	  zt_pbfd_chunk, zt_pbfd_traintap, zt_pbfd_size },
+};
+
+#define ZT_NUM_ECENGINES	(sizeof(zt_ec_engines) / sizeof(zt_ec_engines[0]))
+
+/* The engine picked in zconfig.h or the Makefile */
+#if defined(ECHO_CAN_PBFD)
+#define ZT_EC_BUILTIN		ZT_EC_PBFD
+#elif defined(ECHO_CAN_NLMS)
+#define ZT_EC_BUILTIN		ZT_EC_NLMS
+#else
+#define ZT_EC_BUILTIN		ZT_EC_MARK2
+#endif
+
+/* Engines ZT_EC_DEFAULT gives analog (FXS or FXO signalled) and digital
+   channels; may be set from /etc/system (set zaptel:zt_ec_digital=2) to
+   run NLMS on the digital trunks, say.  A tail longer than the engine
+   takes gets the built in one instead. */
+int zt_ec_analog = ZT_EC_BUILTIN;
+int zt_ec_digital = ZT_EC_BUILTIN;
+
+/* Time one chunk in this many on each channel for the engine's cost */
+#define ZT_EC_TIMESAMPLE	16
+
+/* Echo canceller states, a class for each engine and tail length with
+   its own kmem cache.  A state that is freed goes on its class's free
+   list, not back to kmem, so once a tail length has been used enabling
+   and disabling echo cancellation (even from the disable tone detector,
+   in interrupt context) never gets to the allocator.  zt_ecpool_lock
+   nests inside chan->lock. */
+struct zt_ecpool {
+	size_t size;			/* Bytes per state, 0 for an unused class */
+	int engine;
+	int taps;
+	kmem_cache_t *cache;
+	void *free;			/* Linked through their first word */
+	int nfree;
+	int inuse;
+	int hiwat;			/* Most in use at once */
+	int fails;			/* Allocations that got nothing */
+};
+
+static struct zt_ecpool zt_ecpool[ZT_MAX_ECPOOL];
+static kmutex_t zt_ecpool_lock;
+/* Size of the last state made outside the pool, how zt_ecpool_init()
+   learns what each tail length takes */
+static size_t zt_ecpool_sized;
+
+/* States of each tail length made at load, for the engines
+   zt_ec_analog and zt_ec_digital pick; may be set from /etc/system
+   (set zaptel:zt_ecpool_prewarm=N) */
+int zt_ecpool_prewarm = 4;
+
 static krwlock_t zone_lock; /* = RW_LOCK_UNLOCKED; */
 static krwlock_t chan_lock; /* = RW_LOCK_UNLOCKED; */
 
@@ -300,6 +767,72 @@ typedef struct zt_soft_state {
   ddi_acc_handle_t      pci_conf_handle;
 } zt_soft_state_t;
 
+/* Shared memory rings (ZT_RING_SETUP), mapped into user space by devmap.
+   A mapping can outlive the channel's use of the ring, so the ring is
+   only freed once it is both released and unmapped.  maps and orphan are
+   protected by zt_ringlock.
+
+   The header is writable by the application, so the kernel never takes
+   the geometry or its own indices from it: those live here and are only
+   published to the header.  Of the header, only rx_tail and tx_head are
+   read, and how far they claim to be from the kernel's index is checked
+   against slots before it is used. */
+struct zt_ring {
+	ddi_umem_cookie_t cookie;
+	size_t size;
+	int maps;			/* Live user mappings */
+	int orphan;			/* Channel has let go of it */
+	struct zt_ring_hdr *hdr;
+	unsigned int slots;
+	unsigned int slotsize;
+	u_char *rx;			/* Slot 0 of each ring */
+	u_char *tx;
+	unsigned int rx_head;		/* Next rx slot the kernel fills */
+	unsigned int tx_tail;		/* Next tx slot the kernel empties */
+};
+
+static kmutex_t zt_ringlock;
+static dev_info_t *zt_dip = NULL;
+
+static int zt_ring_release(struct zt_chan *chan, int force);
+
+/* Called with mux->lock held */
+static void __zt_mux_queue(struct zt_mux *mux, int channo)
+{
+	if (mux->queued[channo])
+		return;
+	mux->queued[channo] = 1;
+	mux->queue[(mux->qhead + mux->qlen++) % mux->slots] = channo;
+	cv_broadcast(&mux->readyq);
+	pollwakeup(&mux->sel, POLLIN | POLLRDNORM);
+}
+
+static void zt_mux_notify(struct zt_chan *chan)
+{
+	struct zt_mux *mux;
+	uint64_t watch;
+	int x;
+
+	mutex_enter(&zt_muxlock);
+	watch = chan->muxwatch;
+	for (x=0;watch;x++,watch >>= 1) {
+		if (!(watch & 1) || !(mux = zt_muxes[x]))
+			continue;
+		mutex_enter(&mux->lock);
+		__zt_mux_queue(mux, chan->channo);
+		mutex_exit(&mux->lock);
+	}
+	mutex_exit(&zt_muxlock);
+}
+
+/* Wake up pollers of the channel and any mux watching it */
+static inline void zt_pollwakeup(struct zt_chan *chan, short events)
+{
+	pollwakeup(&chan->sel, events);
+	if (chan->muxwatch)
+		zt_mux_notify(chan);
+}
+
 static void inline check_pollwakeup(struct zt_chan *chan);
 static inline void chan_unlock(struct zt_chan *chan)
 {
@@ -311,11 +844,311 @@ static inline void rotate_sums(void)
 {
 	/* Rotate where we sum and so forth */
 	static int pos = 0;
+	unsigned int bits;
+	int x, y, touched = 0;
+
 	conf_sums_prev = sums + (ZT_MAX_CONF + 1) * pos;
 	conf_sums = sums + (ZT_MAX_CONF + 1) * ((pos + 1) % 3);
 	conf_sums_next = sums + (ZT_MAX_CONF + 1) * ((pos + 2) % 3);
+	conf_dirty = sums_dirty[(pos + 1) % 3];
+	conf_dirty_next = sums_dirty[(pos + 2) % 3];
 	pos = (pos + 1) % 3;
-	bzero(conf_sums_next, maxconfs * sizeof(sumtype));
+	/* Only clear the conferences that were actually summed into */
+	for (x=0;x<ZT_CONF_WORDS;x++) {
+		bits = conf_dirty_next[x];
+		if (!bits)
+			continue;
+		conf_dirty_next[x] = 0;
+		while (bits) {
+			y = ddi_ffs(bits) - 1;
+			bits &= bits - 1;
+			bzero(conf_sums_next[(x << 5) + y], sizeof(sumtype));
+			touched++;
+		}
+	}
+	zt_conf_touched = touched;
+	if (touched > zt_conf_touched_max)
+		zt_conf_touched_max = touched;
+}
+
+static inline void __zt_sum_dirty(unsigned int *dirty, int confn)
+{
+	unsigned int bit = 1U << (confn & 31);
+
+	/* Mixer partitions may share a word; only the first mark is atomic */
+	if (!(dirty[confn >> 5] & bit))
+		atomic_or_32(&dirty[confn >> 5], bit);
+}
+
+/* Make room for channo in an active set.  Called with bigzaplock held;
+   nothing outside it looks at the set. */
+static void __zt_active_grow(struct zt_activeset *as, int channo)
+{
+	int size = as->size ? as->size : ZT_CHANTAB_MIN;
+	int *list, *pos;
+
+	while (size <= channo)
+		size <<= 1;
+	list = kmem_zalloc(size * sizeof(int), KM_SLEEP);
+	pos = kmem_zalloc(size * sizeof(int), KM_SLEEP);
+	if (as->size) {
+		bcopy(as->list, list, as->n * sizeof(int));
+		bcopy(as->pos, pos, as->size * sizeof(int));
+		kmem_free(as->list, as->size * sizeof(int));
+		kmem_free(as->pos, as->size * sizeof(int));
+	}
+	as->list = list;
+	as->pos = pos;
+	as->size = size;
+}
+
+static void __zt_active_add(int set, int channo)
+{
+	struct zt_activeset *as = &activesets[set];
+
+	if (channo >= as->size)
+		__zt_active_grow(as, channo);
+	if (as->pos[channo])
+		return;
+	as->list[as->n++] = channo;
+	as->pos[channo] = as->n;
+}
+
+static void __zt_active_del(int set, int channo)
+{
+	struct zt_activeset *as = &activesets[set];
+	int x;
+
+	if (channo >= as->size)
+		return;
+	x = as->pos[channo];
+	if (!x)
+		return;
+	/* Move the last entry into the hole */
+	as->list[x - 1] = as->list[--as->n];
+	as->pos[as->list[x - 1]] = x;
+	as->pos[channo] = 0;
+}
+
+static inline int zt_active_conf(struct zt_chan *chan)
+{
+	return chan && chan->confmode && !(chan->flags & ZT_FLAG_PSEUDO);
+}
+
+static inline int zt_active_pseudo(struct zt_chan *chan)
+{
+	return chan && (chan->flags & ZT_FLAG_PSEUDO);
+}
+
+/* Must be called with bigzaplock held */
+static void __zt_update_active(struct zt_chan *chan)
+{
+	if ((chan->channo < 1) || (chan->channo >= maxchans))
+		return;
+	if (zt_active_conf(chan))
+		__zt_active_add(ZT_ACTIVE_CONF, chan->channo);
+	else
+		__zt_active_del(ZT_ACTIVE_CONF, chan->channo);
+	if (zt_active_pseudo(chan) && (chan->flags & ZT_FLAG_REGISTERED))
+		__zt_active_add(ZT_ACTIVE_PSEUDO, chan->channo);
+	else
+		__zt_active_del(ZT_ACTIVE_PSEUDO, chan->channo);
+}
+
+/* Channels nothing is using: closed, unconfigured or RBS-only ones.  The
+   span tick skips these and just transmits the idle pattern, the same
+   thing __zt_getbuf_chunk() would come up with for them. */
+#define ZT_IDLEMAP_WORDS(n)	(((n) + 31) >> 5)
+#define ZT_CHAN_IDLE(map, pos)	((map)[(pos) >> 5] & (1U << ((pos) & 31)))
+
+static inline int zt_conf_monitors(int confmode)
+{
+	int mode = confmode & ZT_CONF_MODE_MASK;
+
+	return ((mode >= ZT_CONF_MONITOR) && (mode <= ZT_CONF_MONITORBOTH)) ||
+		(mode == ZT_CONF_DIGITALMON);
+}
+
+static inline int zt_chan_idle(struct zt_chan *chan)
+{
+	if ((chan->master != chan) || chan->nextslave)
+		return 0;
+	if (chan->flags & (ZT_FLAG_OPEN | ZT_FLAG_NETDEV | ZT_FLAG_PPP | ZT_FLAG_HDLC))
+		return 0;
+	if (chan->confmode || chan->confmute || chan->curtone ||
+	    chan->dialing || chan->ec)
+		return 0;
+	/* Still ringing out a cadence */
+	if ((chan->txstate == ZT_TXSTATE_RINGON) || (chan->txstate == ZT_TXSTATE_RINGOFF) ||
+	    chan->cadencepos)
+		return 0;
+	/* SF signalling rides on the audio */
+	if ((chan->sig == ZT_SIG_SF) || chan->v1_1 || chan->v2_1 || chan->v3_1)
+		return 0;
+	return 1;
+}
+
+/* Is some channel listening to this one's audio?  Every channel with a
+   conference mode is on an active list.  Called with bigzaplock held. */
+static int __zt_monitored(struct zt_chan *chan)
+{
+	struct zt_chan *c;
+	int set, y;
+
+	for (set=0;set<2;set++) {
+		for (y=0;y<activesets[set].n;y++) {
+			c = chans[activesets[set].list[y]];
+			if (c && (c->confna == chan->channo) && zt_conf_monitors(c->confmode))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* Work out again whether the span tick can skip a channel.  Must be
+   called with bigzaplock held after anything zt_chan_idle() looks at
+   may have made it busy, and for a channel somebody may have started
+   monitoring.  Calls that make a channel idle may be missed; it then
+   just keeps being processed. */
+static void __zt_update_idle(struct zt_chan *chan)
+{
+	struct zt_span *span = chan->span;
+	unsigned int bit;
+	u_char idle;
+	int pos;
+
+	if (!span || !span->idlemap || (chan->flags & ZT_FLAG_PSEUDO))
+		return;
+	pos = chan - span->chans;
+	bit = 1U << (pos & 31);
+	if (zt_chan_idle(chan) && !__zt_monitored(chan)) {
+		if ((chan->flags & (ZT_FLAG_CLEAR | ZT_FLAG_AUDIO)) == ZT_FLAG_CLEAR)
+			idle = 0xff;
+		else
+			idle = ZT_LIN2X(0, chan);
+		if (chan->flags & ZT_FLAG_AUDIO)
+			idle = chan->txgain[idle];
+		chan->idlebyte = idle;
+		membar_producer();
+		atomic_or_32(&span->idlemap[pos >> 5], bit);
+	} else
+		atomic_and_32(&span->idlemap[pos >> 5], ~bit);
+}
+
+static void __zt_update_idleno(int channo)
+{
+	if ((channo > 0) && (channo < maxchans) && chans[channo])
+		__zt_update_idle(chans[channo]);
+}
+
+static void zt_update_idle(struct zt_chan *chan)
+{
+	mutex_enter(&bigzaplock);
+	__zt_update_idle(chan);
+	mutex_exit(&bigzaplock);
+}
+
+/* Drop channels that no longer belong on the active lists.  Called with
+   bigzaplock held, before a snapshot is taken. */
+static void __zt_active_prune(void)
+{
+	struct zt_activeset *as;
+	int y;
+
+	as = &activesets[ZT_ACTIVE_CONF];
+	for (y=0;y<as->n;) {
+		if (!zt_active_conf(chans[as->list[y]]))
+			__zt_active_del(ZT_ACTIVE_CONF, as->list[y]);
+		else
+			y++;
+	}
+	as = &activesets[ZT_ACTIVE_PSEUDO];
+	for (y=0;y<as->n;) {
+		if (!zt_active_pseudo(chans[as->list[y]]))
+			__zt_active_del(ZT_ACTIVE_PSEUDO, as->list[y]);
+		else
+			y++;
+	}
+}
+
+/* Free retired snapshots no tick can still be looking at */
+static void __zt_snap_reap(int all)
+{
+	struct zt_confsnap **pp = &zt_snap_retired, *snap;
+	uint32_t seq = zt_tick_seq;
+
+	while ((snap = *pp)) {
+		if (all || !(snap->retired & 1) || (snap->retired != seq)) {
+			*pp = snap->next;
+			kmem_free(snap, snap->size);
+		} else
+			pp = &snap->next;
+	}
+}
+
+/* Publish the current conference setup to the tick.  Must be called with
+   bigzaplock held after anything the tick reads has changed. */
+static void __zt_snap_publish(void)
+{
+	struct zt_confsnap *snap, *old;
+	int nlinks = 0, x, y, z;
+	size_t size;
+
+	__zt_active_prune();
+	if (activesets[ZT_ACTIVE_CONF].n > activesets[ZT_ACTIVE_PSEUDO].n)
+		__zt_mix_grow(activesets[ZT_ACTIVE_CONF].n);
+	else
+		__zt_mix_grow(activesets[ZT_ACTIVE_PSEUDO].n);
+	for (x=1;x<=maxlinks;x++)
+		if (confalias[conf_links[x].dst] && confalias[conf_links[x].src])
+			nlinks++;
+	size = sizeof(struct zt_confsnap) + sizeof(int) *
+		(activesets[ZT_ACTIVE_CONF].n + activesets[ZT_ACTIVE_PSEUDO].n + 2 * nlinks);
+	snap = kmem_alloc(size, KM_SLEEP);
+	snap->size = size;
+	snap->next = NULL;
+	snap->nconf = activesets[ZT_ACTIVE_CONF].n;
+	snap->npseudo = activesets[ZT_ACTIVE_PSEUDO].n;
+	snap->nlinks = nlinks;
+	snap->conf = (int *)(snap + 1);
+	snap->pseudo = snap->conf + snap->nconf;
+	snap->links = snap->pseudo + snap->npseudo;
+	bcopy(activesets[ZT_ACTIVE_CONF].list, snap->conf, snap->nconf * sizeof(int));
+	bcopy(activesets[ZT_ACTIVE_PSEUDO].list, snap->pseudo, snap->npseudo * sizeof(int));
+	for (x=1,y=0;x<=maxlinks;x++) {
+		if ((z = confalias[conf_links[x].dst]) && confalias[conf_links[x].src]) {
+			snap->links[y++] = confalias[conf_links[x].src];
+			snap->links[y++] = z;
+		}
+	}
+	/* The contents have to be visible before the pointer, and the
+	   pointer before we look at where the tick is */
+	membar_producer();
+	old = zt_snap;
+	zt_snap = snap;
+	membar_enter();
+	if (old) {
+		old->retired = zt_tick_seq;
+		old->next = zt_snap_retired;
+		zt_snap_retired = old;
+	}
+	__zt_snap_reap(0);
+}
+
+/* Wait for a tick in progress to finish, so that anything unpublished
+   before the call is no longer in use by it */
+static void zt_snap_sync(void)
+{
+	uint32_t seq;
+
+	membar_enter();
+	seq = zt_tick_seq;
+	if (seq & 1)
+		while (zt_tick_seq == seq)
+			delay(1);
+	/* and for the mix that tick may have started */
+	while (zt_mix_busy)
+		delay(1);
 }
 
   /* return quiescent (idle) signalling states, for the various signalling types */
@@ -438,29 +1271,85 @@ static void zt_check_conf(int x)
 	recalc_maxconfs();
 }
 
-/* enqueue an event on a channel */
-static void __qevent(struct zt_chan *chan, int event, int lock)
+/* The event ring is lock free for producers, who may run with or without
+   the channel lock and on any CPU: a producer claims a slot by moving
+   evhead, fills it in and publishes it through the slot's seq.  Readers
+   are serialized by the channel lock. */
+#define ZT_EVRING_MASK		(ZT_MAX_EVENTSIZE - 1)
+/* The next event to read has been published */
+#define ZT_EVENT_READY(c)	((c)->evring[(c)->evtail & ZT_EVRING_MASK].seq == (c)->evtail + 1)
+
+static void zt_event_init(struct zt_chan *chan)
 {
-	if (lock) mutex_enter(&chan->lock);
+	int x;
 
-	  /* if full, ignore */
-	if ((chan->eventoutidx == 0) && (chan->eventinidx == (ZT_MAX_EVENTSIZE - 1))) {
-		if (lock) chan_unlock(chan);
-		return;
-	}
+	for (x=0;x<ZT_MAX_EVENTSIZE;x++)
+		chan->evring[x].seq = x;
+	chan->evhead = chan->evtail = 0;
+	chan->evdropped = 0;
+}
 
-	  /* if full, ignore */
-	if (chan->eventinidx == (chan->eventoutidx - 1)) {
-		if (lock) chan_unlock(chan);
-		return;
+/* Queue an event, or count it as dropped if the ring is full */
+static int zt_event_put(struct zt_chan *chan, int event)
+{
+	struct zt_evslot *slot;
+	uint32_t pos;
+
+	for (;;) {
+		pos = chan->evhead;
+		slot = &chan->evring[pos & ZT_EVRING_MASK];
+		membar_consumer();
+		if ((int32_t)(slot->seq - pos) < 0) {
+			/* Not read yet since the last time around */
+			atomic_inc_32(&chan->evdropped);
+			return -1;
+		}
+		if ((slot->seq == pos) && (atomic_cas_32(&chan->evhead, pos, pos + 1) == pos))
+			break;
 	}
+	slot->event = event;
+	slot->when = gethrtime();
+	membar_producer();
+	slot->seq = pos + 1;
+	return 0;
+}
+
+/* Dequeue the oldest event.  chan->lock held. */
+static int zt_event_get(struct zt_chan *chan, hrtime_t *when)
+{
+	struct zt_evslot *slot;
+	int event;
+
+	if (!ZT_EVENT_READY(chan))
+		return ZT_EVENT_NONE;
+	slot = &chan->evring[chan->evtail & ZT_EVRING_MASK];
+	membar_consumer();
+	event = slot->event;
+	if (when)
+		*when = slot->when;
+	/* Done with the slot before handing it back to the producers */
+	membar_exit();
+	slot->seq = chan->evtail + ZT_MAX_EVENTSIZE;
+	chan->evtail++;
+	return event;
+}
 
-	  /* save the event */
-	chan->eventbuf[chan->eventinidx++] = event;
+/* Throw away everything queued.  chan->lock held. */
+static void zt_event_flush(struct zt_chan *chan)
+{
+	while (ZT_EVENT_READY(chan))
+		zt_event_get(chan, NULL);
+}
+
+/* enqueue an event on a channel */
+static void __qevent(struct zt_chan *chan, int event, int lock)
+{
+	if (zt_event_put(chan, event))
+		return;
 
-	  /* wrap the index, if necessary */
-	if (chan->eventinidx >= ZT_MAX_EVENTSIZE) 
-		chan->eventinidx = 0;
+	/* The event itself needs no lock, but waking the sleepers does, so
+	   that none of them can miss it between checking and sleeping */
+	if (lock) mutex_enter(&chan->lock);
 
 	  /* wake em all up */
 	if (chan->iomask & ZT_IOMUX_SIGEVENT) 
@@ -469,7 +1358,7 @@ static void __qevent(struct zt_chan *chan, int event, int lock)
 	cv_broadcast(&chan->writebufq);
 	if (debug) cmn_err(CE_CONT, "__qevent waking %lx, event was 0x%x\n", &chan->sel, event);
 	if (lock) chan_unlock(chan);
-	pollwakeup(&chan->sel,POLLIN|POLLOUT|POLLPRI);
+	zt_pollwakeup(chan, POLLIN|POLLOUT|POLLPRI);
 	return;
 }
 
@@ -502,8 +1391,8 @@ static inline void calc_fcs(struct zt_chan *ss)
 {
 	int x;
 	unsigned int fcs=PPP_INITFCS;
-	unsigned char *data = ss->writebuf[ss->inwritebuf];
-	int len = ss->writen[ss->inwritebuf];
+	unsigned char *data = ss->writebuf[ZT_TXBUF_IN(ss)];
+	int len = ss->writen[ZT_TXBUF_IN(ss)];
 	/* Not enough space to do FCS calculation */
 	if (len < 2)
 		return;
@@ -518,7 +1407,6 @@ static inline void calc_fcs(struct zt_chan *ss)
 static int zt_reallocbufs(struct zt_chan *ss, int j, int numbufs)
 {
 	unsigned char *newbuf, *oldbuf;
-	unsigned long flags;
 	size_t	oldbufsize;
 	int x;
 	/* Check numbufs */
@@ -534,7 +1422,10 @@ static int zt_reallocbufs(struct zt_chan *ss, int j, int numbufs)
 	} else
 		newbuf = NULL;
 	  /* Now that we've allocated our new buffer, we can safely
-	     move things around... */
+	     move things around, once no reader or writer is in the
+	     middle of a buffer and the span is kept out */
+	mutex_enter(&ss->readlock);
+	mutex_enter(&ss->writelock);
 	mutex_enter(&ss->lock);
 	oldbufsize = ss->blocksize * 2 * ss->numbufs;
 	ss->blocksize = j; /* set the blocksize */
@@ -558,17 +1449,10 @@ static int zt_reallocbufs(struct zt_chan *ss, int j, int numbufs)
 		ss->readn[x]=
 		ss->readidx[x] = 0;
 	
-	/* Keep track of where our data goes (if it goes
-	   anywhere at all) */
-	if (newbuf) {
-		ss->inreadbuf = 0;
-		ss->inwritebuf = 0;
-	} else {
-		ss->inreadbuf = -1;
-		ss->inwritebuf = -1;
-	}
-	ss->outreadbuf = -1;
-	ss->outwritebuf = -1;
+	/* Start the rings over.  Without buffers there is no room
+	   in them at all. */
+	ss->rxhead = ss->rxtail = 0;
+	ss->txhead = ss->txtail = 0;
 	ss->numbufs = numbufs;
 	if (ss->txbufpolicy == ZT_POLICY_WHEN_FULL)
 		ss->txdisable = 1;
@@ -581,6 +1465,8 @@ static int zt_reallocbufs(struct zt_chan *ss, int j, int numbufs)
 		ss->rxdisable = 0;
 
 	chan_unlock(ss);
+	mutex_exit(&ss->writelock);
+	mutex_exit(&ss->readlock);
 	if (oldbuf)
 		kmem_free(oldbuf, oldbufsize);
 	return 0;
@@ -588,6 +1474,19 @@ static int zt_reallocbufs(struct zt_chan *ss, int j, int numbufs)
 
 static int zt_hangup(struct zt_chan *chan);
 static void zt_set_law(struct zt_chan *chan, int law);
+static void zt_chan_pipeline(struct zt_chan *chan);
+static void zt_lin2x(struct zt_chan *chan, short *lin, u_char *xbuf, int n);
+
+/* Per-chunk audio routines for one channel setup, see zt_chan_pipeline() */
+struct zt_pipeline {
+	char *name;
+	void (*getaudio)(struct zt_chan *ss, unsigned char *txb);
+	void (*putaudio)(struct zt_chan *ss, unsigned char *rxb);
+};
+
+#define ZT_PIPELINES	9
+
+static struct zt_pipeline zt_pipelines[ZT_PIPELINES];
 
 /* Pull a ZT_CHUNKSIZE piece off the queue.  Returns
    0 on success or -1 on failure.  If failed, provides
@@ -687,45 +1586,512 @@ static int __buf_push(struct confq *q, u_char *data, char *label)
 	if (q->outbuf < 0) {
 		q->outbuf = oldinbuf;
 	}
-	return 0;
+	return 0;
+}
+
+static void reset_conf(struct zt_chan *chan)
+{
+	int x;
+	/* Empty out buffers and reset to initialization */
+	for (x=0;x<ZT_CB_SIZE;x++)
+		chan->confin.buf[x] = chan->confin.buffer + ZT_CHUNKSIZE * x;
+	chan->confin.inbuf = 0;
+	chan->confin.outbuf = -1;
+
+	for (x=0;x<ZT_CB_SIZE;x++)
+		chan->confout.buf[x] = chan->confout.buffer + ZT_CHUNKSIZE * x;
+	chan->confout.inbuf = 0;
+	chan->confout.outbuf = -1;
+}
+
+static void zt_wheel_init(struct zt_timerwheel *w)
+{
+	mutex_init(&w->lock, NULL, MUTEX_DRIVER, NULL);
+	w->tick = 0;
+	bzero(w->tv1, sizeof(w->tv1));
+	bzero(w->tv2, sizeof(w->tv2));
+}
+
+static void zt_timer_init(struct zt_timer *t, struct zt_chan *chan, int fire)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->chan = chan;
+	t->expires = 0;
+	t->fire = fire;
+}
+
+static struct zt_timerwheel *zt_timer_wheel(struct zt_timer *t)
+{
+	/* Pseudo channels have no span, so their timers never run */
+	if (!t->chan->span)
+		return NULL;
+	if (t->fire == ZT_TIMER_OTIMER)
+		return &t->chan->span->txwheel;
+	return &t->chan->span->rxwheel;
+}
+
+static void __zt_timer_add(struct zt_timerwheel *w, struct zt_timer *t)
+{
+	/* Called with w->lock held */
+	unsigned int idx = t->expires - w->tick;
+	unsigned int slot = t->expires;
+	struct zt_timer **head;
+
+	if ((int)idx < 0)
+		slot = w->tick;
+	if ((int)idx < ZT_TW1_SIZE) {
+		head = &w->tv1[slot & ZT_TW1_MASK];
+	} else {
+		/* Too far off for a second level slot: park it in the last
+		   one, it gets placed again when that slot is cascaded */
+		if (idx >= ZT_TW1_SIZE * ZT_TW2_SIZE)
+			slot = w->tick + ZT_TW1_SIZE * ZT_TW2_SIZE - 1;
+		head = &w->tv2[(slot >> ZT_TW1_BITS) & ZT_TW2_MASK];
+	}
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+static void __zt_timer_del(struct zt_timer *t)
+{
+	/* Called with the wheel lock held */
+	if (!t->pprev)
+		return;
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* (Re)start a channel timer to run out in the given number of samples,
+   rounded up to whole chunks, or stop it if samples is 0.  Called with
+   the channel lock held. */
+static void zt_timer_set(struct zt_timer *t, int samples)
+{
+	struct zt_timerwheel *w = zt_timer_wheel(t);
+
+	if (!w)
+		return;
+	mutex_enter(&w->lock);
+	__zt_timer_del(t);
+	if (t->fire)
+		atomic_and_32(&t->chan->timerfired, ~t->fire);
+	if (samples > 0) {
+		t->expires = w->tick + (samples + ZT_CHUNKSIZE - 1) / ZT_CHUNKSIZE;
+		__zt_timer_add(w, t);
+	}
+	mutex_exit(&w->lock);
+}
+
+/* Samples left on a channel timer, 0 if it isn't running.  A timer that
+   has run out but hasn't been handled yet still has its last chunk to
+   go, as it did when the tick counted the timers down itself.  Called
+   with the channel lock held. */
+static int zt_timer_left(struct zt_timer *t)
+{
+	struct zt_timerwheel *w = zt_timer_wheel(t);
+	int left = 0;
+
+	if (!w)
+		return 0;
+	mutex_enter(&w->lock);
+	if (t->pprev)
+		left = (t->expires - w->tick) * ZT_CHUNKSIZE;
+	else if (t->fire && (t->chan->timerfired & t->fire))
+		left = ZT_CHUNKSIZE;
+	mutex_exit(&w->lock);
+	return left;
+}
+
+/* Advance a timer wheel by one chunk.  Returns the timers that ran out,
+   already unlinked and chained through their next pointers.  Called with
+   w->lock held. */
+static struct zt_timer *__zt_wheel_advance(struct zt_timerwheel *w)
+{
+	struct zt_timer *t, *list;
+	unsigned int idx;
+
+	idx = ++w->tick & ZT_TW1_MASK;
+	if (!idx) {
+		/* Move the next block of timers down to the first level */
+		list = w->tv2[(w->tick >> ZT_TW1_BITS) & ZT_TW2_MASK];
+		w->tv2[(w->tick >> ZT_TW1_BITS) & ZT_TW2_MASK] = NULL;
+		while ((t = list)) {
+			list = t->next;
+			__zt_timer_add(w, t);
+		}
+	}
+	list = w->tv1[idx];
+	w->tv1[idx] = NULL;
+	for (t = list; t; t = t->next)
+		t->pprev = NULL;
+	return list;
+}
+
+/* Advance a span's timer wheel by one chunk, flagging the timers that
+   run out on their channels */
+static void zt_wheel_run(struct zt_timerwheel *w)
+{
+	struct zt_timer *t, *list;
+
+	mutex_enter(&w->lock);
+	list = __zt_wheel_advance(w);
+	while ((t = list)) {
+		list = t->next;
+		t->next = NULL;
+		if (t->fire)
+			atomic_or_32(&t->chan->timerfired, t->fire);
+	}
+	mutex_exit(&w->lock);
+}
+
+static void zt_chan_timers_init(struct zt_chan *chan)
+{
+	chan->timerfired = 0;
+	zt_timer_init(&chan->itimer, chan, ZT_TIMER_ITIMER);
+	zt_timer_init(&chan->otimer, chan, ZT_TIMER_OTIMER);
+	zt_timer_init(&chan->ringdebtimer, chan, 0);
+	zt_timer_init(&chan->ringtrailer, chan, ZT_TIMER_RINGTRAILER);
+	zt_timer_init(&chan->pulsetimer, chan, ZT_TIMER_PULSE);
+}
+
+
+/* Find or build the gain tables for the given gains and law, with a
+   reference held.  Returns NULL if out of memory. */
+static struct zt_gaintab *zt_gaintab_get(u_char *rxgain, u_char *txgain, short *xlaw)
+{
+	struct zt_gaintab *gt;
+	int x;
+
+	mutex_enter(&zt_gainlock);
+	for (gt = zt_gaintabs; gt; gt = gt->next) {
+		if ((gt->xlaw == xlaw) && !bcmp(gt->rxgain, rxgain, 256) &&
+		    !bcmp(gt->txgain, txgain, 256)) {
+			gt->refs++;
+			mutex_exit(&zt_gainlock);
+			return gt;
+		}
+	}
+	gt = kmem_alloc(sizeof(*gt), KM_NOSLEEP);
+	if (gt) {
+		gt->refs = 1;
+		gt->xlaw = xlaw;
+		bcopy(rxgain, gt->rxgain, 256);
+		bcopy(txgain, gt->txgain, 256);
+		for (x=0;x<256;x++)
+			gt->rxlin[x] = xlaw[rxgain[x]];
+		gt->next = zt_gaintabs;
+		zt_gaintabs = gt;
+	}
+	mutex_exit(&zt_gainlock);
+	return gt;
+}
+
+static void zt_gaintab_put(struct zt_gaintab *gt)
+{
+	struct zt_gaintab **pgt;
+
+	mutex_enter(&zt_gainlock);
+	if (--gt->refs) {
+		mutex_exit(&zt_gainlock);
+		return;
+	}
+	for (pgt = &zt_gaintabs; *pgt != gt; pgt = &(*pgt)->next)
+		;
+	*pgt = gt->next;
+	mutex_exit(&zt_gainlock);
+	kmem_free(gt, sizeof(*gt));
+}
+
+static struct zt_ec_engine *zt_ec_engine(int id)
+{
+	int x;
+
+	for (x=0;x<ZT_NUM_ECENGINES;x++)
+		if (zt_ec_engines[x].id == id)
+			return &zt_ec_engines[x];
+	return NULL;
+}
+
+static struct zt_ecpool *zt_ecpool_class(size_t size)
+{
+	int x;
+
+	for (x=0;x<ZT_MAX_ECPOOL;x++)
+		if (zt_ecpool[x].size == size)
+			return &zt_ecpool[x];
+	return NULL;
+}
+
+/* MALLOC() for echo_can_create(); never sleeps */
+static void *zt_ec_alloc(size_t size)
+{
+	struct zt_ecpool *p;
+	void *ec;
+
+	mutex_enter(&zt_ecpool_lock);
+	p = zt_ecpool_class(size);
+	if (!p) {
+		mutex_exit(&zt_ecpool_lock);
+		zt_ecpool_sized = size;
+		return kmem_alloc(size, KM_NOSLEEP);
+	}
+	if ((ec = p->free)) {
+		p->free = *(void **)ec;
+		p->nfree--;
+	} else
+		ec = kmem_cache_alloc(p->cache, KM_NOSLEEP);
+	if (ec) {
+		if (++p->inuse > p->hiwat)
+			p->hiwat = p->inuse;
+	} else
+		p->fails++;
+	mutex_exit(&zt_ecpool_lock);
+	return ec;
+}
+
+/* FREE() for echo_can_free(); safe from interrupt context */
+static void zt_ec_free(void *ec, size_t size)
+{
+	struct zt_ecpool *p;
+
+	mutex_enter(&zt_ecpool_lock);
+	p = zt_ecpool_class(size);
+	if (p) {
+		*(void **)ec = p->free;
+		p->free = ec;
+		p->nfree++;
+		p->inuse--;
+	}
+	mutex_exit(&zt_ecpool_lock);
+	if (!p)
+		kmem_free(ec, size);
+}
+
+/* Set up a class for each engine and tail length, with
+   zt_ecpool_prewarm states ready in those of the default engines */
+static void zt_ecpool_init(void)
+{
+	struct zt_ec_engine *eng;
+	struct zt_ecpool *p;
+	char name[32];
+	void *ec, *obj;
+	int e, x, y, n = 0;
+
+	mutex_init(&zt_ecpool_lock, NULL, MUTEX_DRIVER, NULL);
+	for (e=0;e<ZT_NUM_ECENGINES;e++) {
+		eng = &zt_ec_engines[e];
+		for (x=0;x<sizeof(zt_ectaps)/sizeof(zt_ectaps[0]);x++) {
+			if ((zt_ectaps[x] > eng->maxtaps) || (n >= ZT_MAX_ECPOOL))
+				continue;
+			/* Make one outside the pool to see how big it is */
+			zt_ecpool_sized = 0;
+			ec = eng->create(zt_ectaps[x]);
+			if (!ec)
+				continue;
+			eng->free(ec);
+			/* Same size as one already there: that class does for both */
+			if (zt_ecpool_class(zt_ecpool_sized))
+				continue;
+			p = &zt_ecpool[n++];
+			sprintf(name, "zt_ec_%s_%d", eng->name, zt_ectaps[x]);
+			p->cache = kmem_cache_create(name, zt_ecpool_sized, 8,
+				NULL, NULL, NULL, NULL, NULL, 0);
+			if (!p->cache)
+				continue;
+			p->engine = eng->id;
+			p->taps = zt_ectaps[x];
+			for (y=0;y<zt_ecpool_prewarm;y++) {
+				/* Only for the engines channels get by default */
+				if ((eng->id != zt_ec_analog) && (eng->id != zt_ec_digital))
+					break;
+				obj = kmem_cache_alloc(p->cache, KM_SLEEP);
+				*(void **)obj = p->free;
+				p->free = obj;
+				p->nfree++;
+			}
+			/* From here on states this size come from the class */
+			p->size = zt_ecpool_sized;
+		}
+	}
+}
+
+static void zt_ecpool_cleanup(void)
+{
+	struct zt_ecpool *p;
+	void *obj;
+	int x;
+
+	for (x=0;x<ZT_MAX_ECPOOL;x++) {
+		p = &zt_ecpool[x];
+		if (!p->cache)
+			continue;
+		if (p->hiwat || p->fails)
+			cmn_err(CE_CONT, "zaptel: %d tap %s echo cancellers: %d at most in use, %d allocations failed\n",
+				p->taps, zt_ec_engine(p->engine)->name, p->hiwat, p->fails);
+		while ((obj = p->free)) {
+			p->free = *(void **)obj;
+			kmem_cache_free(p->cache, obj);
+		}
+		if (p->inuse)
+			cmn_err(CE_WARN, "zaptel: %d tap %s echo cancellers still in use at unload\n",
+				p->taps, zt_ec_engine(p->engine)->name);
+		else
+			kmem_cache_destroy(p->cache);
+	}
+	mutex_destroy(&zt_ecpool_lock);
+}
+
+/* ZT_GETECPOOL */
+static void zt_ecpool_getstats(struct zt_ecpool_stats *st)
+{
+	struct zt_ecpool *p;
+	int x;
+
+	bzero(st, sizeof(*st));
+	mutex_enter(&zt_ecpool_lock);
+	for (x=0;x<ZT_MAX_ECPOOL;x++) {
+		p = &zt_ecpool[x];
+		if (!p->size)
+			continue;
+		st->cls[st->count].engine = p->engine;
+		st->cls[st->count].taps = p->taps;
+		st->cls[st->count].size = p->size;
+		st->cls[st->count].free = p->nfree;
+		st->cls[st->count].inuse = p->inuse;
+		st->cls[st->count].hiwat = p->hiwat;
+		st->cls[st->count].fails = p->fails;
+		st->count++;
+	}
+	mutex_exit(&zt_ecpool_lock);
+}
+
+/* The engine and tail length to run for a ZT_ECHOCANCEL argument, or
+   NULL if it asks for an engine there isn't or a tail it can't do */
+static struct zt_ec_engine *zt_ec_pick(struct zt_chan *chan, int arg, int *taps)
+{
+	struct zt_ec_engine *eng;
+	int id = (arg >> 16) & 0xffff;
+	int x;
+
+	*taps = arg & 0xffff;
+	for (x=0;x<sizeof(zt_ectaps)/sizeof(zt_ectaps[0]);x++)
+		if (zt_ectaps[x] == *taps)
+			break;
+	if (x == sizeof(zt_ectaps)/sizeof(zt_ectaps[0]))
+		*taps = deftaps;
+	if (id != ZT_EC_DEFAULT) {
+		eng = zt_ec_engine(id);
+		if (eng && (*taps > eng->maxtaps))
+			return NULL;
+		return eng;
+	}
+	/* By trunk type */
+	if (chan->sig & (__ZT_SIG_FXO | __ZT_SIG_FXS))
+		eng = zt_ec_engine(zt_ec_analog);
+	else
+		eng = zt_ec_engine(zt_ec_digital);
+	if (!eng || (*taps > eng->maxtaps))
+		eng = zt_ec_engine(ZT_EC_BUILTIN);
+	return eng;
+}
+
+/* Make a canceller on eng, counted against it; NULL if out of memory */
+static void *zt_ec_get(struct zt_ec_engine *eng, int taps)
+{
+	void *ec;
+
+	ec = eng->create(taps);
+	if (ec) {
+		atomic_inc_32(&eng->chans);
+		atomic_add_32(&eng->bytes, eng->size(ec));
+	}
+	return ec;
 }
 
-static void reset_conf(struct zt_chan *chan)
+/* Free one made by zt_ec_get(); safe from interrupt context */
+static void zt_ec_put(struct zt_ec_engine *eng, void *ec)
 {
+	atomic_dec_32(&eng->chans);
+	atomic_add_32(&eng->bytes, -(int32_t)eng->size(ec));
+	eng->free(ec);
+}
+
+/* ZT_GETECENGINES */
+static void zt_ec_getengines(struct zt_ecengines *st)
+{
+	struct zt_ec_engine *eng;
 	int x;
-	/* Empty out buffers and reset to initialization */
-	for (x=0;x<ZT_CB_SIZE;x++)
-		chan->confin.buf[x] = chan->confin.buffer + ZT_CHUNKSIZE * x;
-	chan->confin.inbuf = 0;
-	chan->confin.outbuf = -1;
 
-	for (x=0;x<ZT_CB_SIZE;x++)
-		chan->confout.buf[x] = chan->confout.buffer + ZT_CHUNKSIZE * x;
-	chan->confout.inbuf = 0;
-	chan->confout.outbuf = -1;
+	bzero(st, sizeof(*st));
+	st->builtin = ZT_EC_BUILTIN;
+	st->analog = zt_ec_analog;
+	st->digital = zt_ec_digital;
+	for (x=0;(x<ZT_NUM_ECENGINES) && (x<ZT_MAX_ECENGINES);x++) {
+		eng = &zt_ec_engines[x];
+		st->eng[x].id = eng->id;
+		strncpy(st->eng[x].name, eng->name, sizeof(st->eng[x].name) - 1);
+		st->eng[x].maxtaps = eng->maxtaps;
+		st->eng[x].chans = eng->chans;
+		st->eng[x].bytes = eng->bytes;
+		st->eng[x].samples = eng->samples;
+		st->eng[x].ns = eng->ns;
+		st->count++;
+	}
 }
 
+/* Switch a channel to the given gains, or to 0 dB if rxgain is NULL.
+   Called without chan->lock held. */
+static int zt_chan_setgains(struct zt_chan *chan, u_char *rxgain, u_char *txgain)
+{
+	struct zt_gaintab *gt = NULL, *old;
+
+	if (rxgain && (bcmp(rxgain, defgain, 256) || bcmp(txgain, defgain, 256))) {
+		gt = zt_gaintab_get(rxgain, txgain, chan->xlaw);
+		if (!gt)
+			return ENOMEM;
+	}
+	mutex_enter(&chan->lock);
+	old = chan->gaintab;
+	chan->gaintab = gt;
+	chan->rxgain = gt ? gt->rxgain : defgain;
+	chan->txgain = gt ? gt->txgain : defgain;
+	zt_chan_pipeline(chan);
+	chan_unlock(chan);
+	if (old)
+		zt_gaintab_put(old);
+	return 0;
+}
 
 static void close_channel(struct zt_chan *chan)
 {
 	unsigned long flags;
-	void *rxgain = NULL;
-	echo_can_state_t *ec = NULL;
+	struct zt_gaintab *gaintab;
+	struct zt_ec_engine *eng;
+	void *ec = NULL;
 	int oldconf;
 
+	zt_ring_release(chan, 1);
 	zt_reallocbufs(chan, 0, 0); 
 	mutex_enter(&chan->lock);
 	ec = chan->ec;
+	eng = chan->ecengine;
 	chan->ec = NULL;
 	chan->curtone = NULL;
 	chan->current_zone = NULL;
 	chan->cadencepos = 0;
 	chan->pdialcount = 0;
 	zt_hangup(chan); 
-	chan->itimerset = chan->itimer = 0;
+	chan->itimerset = 0;
+	zt_timer_set(&chan->itimer, 0);
 	chan->pulsecount = 0;
-	chan->pulsetimer = 0;
-	chan->ringdebtimer = 0;
+	zt_timer_set(&chan->pulsetimer, 0);
+	zt_timer_set(&chan->ringdebtimer, 0);
 
 	cv_init(&chan->readbufq, NULL, CV_DRIVER, NULL);
 	cv_init(&chan->writebufq, NULL, CV_DRIVER, NULL);
@@ -752,14 +2118,14 @@ static void close_channel(struct zt_chan *chan)
 	chan->gotgs = 0;
 	reset_conf(chan);
 	
-	if (chan->gainalloc && chan->rxgain)
-		rxgain = chan->rxgain;
-
+	gaintab = chan->gaintab;
+	chan->gaintab = NULL;
 	chan->rxgain = defgain;
 	chan->txgain = defgain;
-	chan->gainalloc = 0;
-	chan->eventinidx = chan->eventoutidx = 0;
+	zt_event_flush(chan);
+	chan->evdropped = 0;
 	chan->flags &= ~(ZT_FLAG_LINEAR | ZT_FLAG_PPP | ZT_FLAG_SIGFREEZE);
+	zt_chan_pipeline(chan);
 
 	zt_set_law(chan,0);
 
@@ -769,10 +2135,10 @@ static void close_channel(struct zt_chan *chan)
 
 	chan_unlock(chan);
 
-	if (rxgain)
-		kmem_free(rxgain, 512);
+	if (gaintab)
+		zt_gaintab_put(gaintab);
 	if (ec)
-		echo_can_free(ec);
+		zt_ec_put(eng, ec);
 
 }
 
@@ -891,6 +2257,7 @@ static void zt_set_law(struct zt_chan *chan, int law)
 		chan->lin2x = __zt_lin2mu;
 #endif
 	}
+	zt_chan_pipeline(chan);
 }
 
 static int zt_chan_reg(struct zt_chan *chan)
@@ -900,31 +2267,40 @@ static int zt_chan_reg(struct zt_chan *chan)
 	unsigned long flags;
 	
 	rw_enter(&chan_lock, RW_WRITER);
-	for (x=1;x<ZT_MAX_CHANNELS;x++) {
-		if (!chans[x]) {
-			mutex_init(&chan->lock, NULL, MUTEX_DRIVER, NULL);
-			chans[x] = chan;
-			if (maxchans < x + 1)
-				maxchans = x + 1;
-			chan->channo = x;
-			if (!chan->master)
-				chan->master = chan;
-			if (!chan->readchunk)
-				chan->readchunk = chan->sreadchunk;
-			if (!chan->writechunk)
-				chan->writechunk = chan->swritechunk;
-			zt_set_law(chan, 0);
-			close_channel(chan); 
-			/* set this AFTER running close_channel() so that
-				HDLC channels wont cause hangage */
-			chan->flags |= ZT_FLAG_REGISTERED;
-			res = 0;
+	for (x=zt_chanfree;x<maxchans;x++)
+		if (!chans[x])
 			break;
-		}
+	if (x >= ZT_MAX_CHANNELS) {
+		rw_exit(&chan_lock);
+		cmn_err(CE_CONT, "No more channels available\n");
+		return ENOMEM;
 	}
+	if (x >= nchans)
+		nchans = __zt_tab_grow((void **)&chans, nchans, x + 1,
+			ZT_CHANTAB_MIN, ZT_MAX_CHANNELS, sizeof(struct zt_chan *));
+	mutex_init(&chan->lock, NULL, MUTEX_DRIVER, NULL);
+	mutex_init(&chan->readlock, NULL, MUTEX_DRIVER, NULL);
+	mutex_init(&chan->writelock, NULL, MUTEX_DRIVER, NULL);
+	chans[x] = chan;
+	if (maxchans < x + 1)
+		maxchans = x + 1;
+	zt_chanfree = x + 1;
+	chan->channo = x;
+	chan->muxwatch = 0;
+	if (!chan->master)
+		chan->master = chan;
+	if (!chan->readchunk)
+		chan->readchunk = chan->sreadchunk;
+	if (!chan->writechunk)
+		chan->writechunk = chan->swritechunk;
+	zt_set_law(chan, 0);
+	zt_chan_timers_init(chan);
+	zt_event_init(chan);
+	close_channel(chan); 
+	/* set this AFTER running close_channel() so that
+		HDLC channels wont cause hangage */
+	chan->flags |= ZT_FLAG_REGISTERED;
 	rw_exit(&chan_lock);	
-	if (x >= ZT_MAX_CHANNELS)
-		cmn_err(CE_CONT, "No more channels available\n");
 	return res;
 }
 
@@ -937,7 +2313,7 @@ char *zt_lboname(int x)
 
 static void zt_chan_unreg(struct zt_chan *chan)
 {
-	int x;
+	int x, n;
 	unsigned long flags;
 
 	if (chan == NULL) {
@@ -949,11 +2325,13 @@ static void zt_chan_unreg(struct zt_chan *chan)
 	if (chan->flags & ZT_FLAG_REGISTERED) {
 		chans[chan->channo] = NULL;
 		chan->flags &= ~ZT_FLAG_REGISTERED;
+		if (chan->channo < zt_chanfree)
+			zt_chanfree = chan->channo;
 	}
-	maxchans = 0;
-	for (x=1;x<ZT_MAX_CHANNELS;x++) 
+	n = 0;
+	for (x=1;x<maxchans;x++) 
 		if (chans[x]) {
-			maxchans = x + 1;
+			n = x + 1;
 			/* Remove anyone pointing to us as master
 			   and make them their own thing */
 			if (chans[x]->master == chan) {
@@ -970,18 +2348,335 @@ static void zt_chan_unreg(struct zt_chan *chan)
 				chans[x]->confna = 0;
 				chans[x]->_confn = 0;
 				chans[x]->confmode = 0;
+				zt_chan_pipeline(chans[x]);
 			}
 		}
+	maxchans = n;
 	chan->channo = -1;
 	rw_exit(&chan_lock);
 }
 
+/* The application has taken the current read buffer.  Only the
+   consumer of the read ring calls this: a reader holding chan->readlock,
+   or the tick for the shared rings.  rxdisable is left to the span. */
+static void __zt_readbuf_done(struct zt_chan *chan)
+{
+	int oldbuf = ZT_RXBUF_OUT(chan);
+
+	chan->readidx[oldbuf] = 0;
+	chan->readn[oldbuf] = 0;
+	/* Finish with the buffer before handing it back */
+	membar_exit();
+	chan->rxtail++;
+}
+
+/* The application has filled the current write buffer.  Only the
+   producer of the write ring calls this: a writer holding
+   chan->writelock, or the tick for the shared rings. */
+static void __zt_writebuf_done(struct zt_chan *chan)
+{
+	/* Publish the contents before the buffer */
+	membar_producer();
+	chan->txhead++;
+	if (!ZT_TXBUF_ROOM(chan))
+		/* Make sure the transmitter is transmitting in case of POLICY_WHEN_FULL */
+		chan->txdisable = 0;
+}
+
+/* Writing audio cancels any tone or dialing in progress */
+static void __zt_stop_tones(struct zt_chan *chan)
+{
+	if ((chan->curtone || chan->pdialcount) && !(chan->flags & ZT_FLAG_PSEUDO)) {
+		chan->curtone = NULL;
+		chan->tonep = 0;
+		chan->dialing = 0;
+		chan->txdialbuf[0] = '\0';
+		chan->pdialcount = 0;
+	}
+}
+
+/* Only takes the lock when there is something to stop */
+static void zt_stop_tones(struct zt_chan *chan)
+{
+	if (chan->curtone || chan->pdialcount) {
+		mutex_enter(&chan->lock);
+		__zt_stop_tones(chan);
+		chan_unlock(chan);
+	}
+}
+
+static struct zt_chan *zt_dev_chan(dev_t dev)
+{
+	int unit = getminor(dev);
+
+	if (unit >= ZT_DEV_CHAN_BASE && unit < ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT) {
+		if (unit - ZT_DEV_CHAN_BASE >= nchanmap)
+			return NULL;
+		if (chan_map[unit - ZT_DEV_CHAN_BASE] < 0)
+			return NULL;
+		return chans[chan_map[unit - ZT_DEV_CHAN_BASE]];
+	}
+	if ((unit < 1) || (unit >= maxchans))
+		return NULL;
+	return chans[unit];
+}
+
+static void zt_ring_free(struct zt_ring *ring)
+{
+	ddi_umem_free(ring->cookie);
+	kmem_free(ring, sizeof(struct zt_ring));
+}
+
+static int zt_ring_setup(struct zt_chan *chan, int slots, int *size)
+{
+	struct zt_ring *ring;
+	struct zt_ring_hdr *hdr;
+	unsigned int slotsize, hdrsize;
+
+	if ((slots < 2) || (slots > 1024))
+		return EINVAL;
+	/* Whole frames only, so no HDLC */
+	if (!(chan->flags & ZT_FLAG_AUDIO) || (chan->flags & (ZT_FLAG_HDLC | ZT_FLAG_PPP)))
+		return EINVAL;
+	/* Room for a full size block in linear mode */
+	slotsize = (sizeof(struct zt_ring_slot) + (ZT_MAX_BLOCKSIZE << 1) + 7) & ~7;
+	hdrsize = (sizeof(struct zt_ring_hdr) + 63) & ~63;
+	ring = kmem_zalloc(sizeof(struct zt_ring), KM_SLEEP);
+	ring->size = ptob(btopr(hdrsize + 2 * slots * slotsize));
+	hdr = ddi_umem_alloc(ring->size, DDI_UMEM_SLEEP, &ring->cookie);
+	if (!hdr) {
+		kmem_free(ring, sizeof(struct zt_ring));
+		return ENOMEM;
+	}
+	ring->slots = slots;
+	ring->slotsize = slotsize;
+	ring->rx = (u_char *)hdr + hdrsize;
+	ring->tx = ring->rx + slots * slotsize;
+	hdr->slots = slots;
+	hdr->slotsize = slotsize;
+	hdr->rx_offset = hdrsize;
+	hdr->tx_offset = hdrsize + slots * slotsize;
+	ring->hdr = hdr;
+	/* Let a read() or write() in progress finish with its buffer */
+	mutex_enter(&chan->readlock);
+	mutex_enter(&chan->writelock);
+	mutex_enter(&chan->lock);
+	if (chan->ring) {
+		chan_unlock(chan);
+		mutex_exit(&chan->writelock);
+		mutex_exit(&chan->readlock);
+		zt_ring_free(ring);
+		return EBUSY;
+	}
+	chan->ring = ring;
+	chan_unlock(chan);
+	mutex_exit(&chan->writelock);
+	mutex_exit(&chan->readlock);
+	*size = ring->size;
+	return 0;
+}
+
+/* Detach the rings from the channel.  Fails with EBUSY if they are still
+   mapped, unless the channel is going away (force). */
+static int zt_ring_release(struct zt_chan *chan, int force)
+{
+	struct zt_ring *ring;
+
+	mutex_enter(&zt_ringlock);
+	ring = chan->ring;
+	if (!ring) {
+		mutex_exit(&zt_ringlock);
+		return 0;
+	}
+	if (ring->maps && !force) {
+		mutex_exit(&zt_ringlock);
+		return EBUSY;
+	}
+	mutex_enter(&chan->lock);
+	chan->ring = NULL;
+	chan_unlock(chan);
+	if (ring->maps) {
+		/* Last unmap frees it */
+		ring->orphan = 1;
+		ring = NULL;
+	}
+	mutex_exit(&zt_ringlock);
+	if (ring)
+		zt_ring_free(ring);
+	return 0;
+}
+
+/* Move completed read buffers into the rx ring.  Called with chan->lock
+   held, once the chunk has been received. */
+static void __zt_ring_rx(struct zt_chan *chan)
+{
+	struct zt_ring *ring = chan->ring;
+	struct zt_ring_hdr *hdr = ring->hdr;
+	struct zt_ring_slot *slot;
+	unsigned int head, len, x;
+	u_char *buf;
+	int moved = 0;
+
+	while (ZT_RXBUF_READY(chan) && !chan->rxdisable) {
+		membar_consumer();
+		head = ring->rx_head;
+		/* A tail past the head reads as a full ring too */
+		if (head - hdr->rx_tail >= ring->slots) {
+			hdr->rx_stalls++;
+			break;
+		}
+		slot = (struct zt_ring_slot *)(ring->rx + (head % ring->slots) * ring->slotsize);
+		buf = chan->readbuf[ZT_RXBUF_OUT(chan)];
+		len = chan->readn[ZT_RXBUF_OUT(chan)];
+		if (chan->flags & ZT_FLAG_LINEAR) {
+			short *lin = (short *)(slot + 1);
+			for (x=0;x<len;x++)
+				lin[x] = ZT_XLAW(buf[x], chan);
+			len <<= 1;
+		} else
+			bcopy(buf, slot + 1, len);
+		slot->len = len;
+		membar_producer();
+		ring->rx_head = head + 1;
+		hdr->rx_head = head + 1;
+		__zt_readbuf_done(chan);
+		moved++;
+	}
+	if (moved)
+		zt_pollwakeup(chan, POLLIN | POLLRDNORM);
+}
+
+/* Fill free write buffers from the tx ring.  Called with chan->lock held,
+   before the chunk is transmitted. */
+static void __zt_ring_tx(struct zt_chan *chan)
+{
+	struct zt_ring *ring = chan->ring;
+	struct zt_ring_hdr *hdr = ring->hdr;
+	struct zt_ring_slot *slot;
+	unsigned int tail, avail, len;
+	u_char *buf;
+	int moved = 0;
+
+	tail = ring->tx_tail;
+	avail = hdr->tx_head - tail;
+	/* A head more than a ring ahead can only be garbage; send what
+	   the slots hold */
+	if (avail > ring->slots)
+		avail = ring->slots;
+	while (ZT_TXBUF_ROOM(chan) && avail) {
+		membar_consumer();
+		slot = (struct zt_ring_slot *)(ring->tx + (tail % ring->slots) * ring->slotsize);
+		buf = chan->writebuf[ZT_TXBUF_IN(chan)];
+		/* Read once, the application may change it under us */
+		len = *(volatile unsigned int *)&slot->len;
+		__zt_stop_tones(chan);
+		if (chan->flags & ZT_FLAG_LINEAR) {
+			short *lin = (short *)(slot + 1);
+			len >>= 1;
+			if (len > chan->blocksize)
+				len = chan->blocksize;
+			zt_lin2x(chan, lin, buf, len);
+		} else {
+			if (len > chan->blocksize)
+				len = chan->blocksize;
+			bcopy(slot + 1, buf, len);
+		}
+		chan->writen[ZT_TXBUF_IN(chan)] = len;
+		chan->writeidx[ZT_TXBUF_IN(chan)] = 0;
+		tail++;
+		avail--;
+		ring->tx_tail = tail;
+		hdr->tx_tail = tail;
+		__zt_writebuf_done(chan);
+		moved++;
+	}
+	if (moved)
+		zt_pollwakeup(chan, POLLOUT | POLLWRNORM);
+}
+
+static int zt_ring_map(devmap_cookie_t dhp, dev_t dev, uint_t flags, offset_t off, size_t len, void **pvtp)
+{
+	struct zt_chan *chan = zt_dev_chan(dev);
+
+	mutex_enter(&zt_ringlock);
+	if (!chan || !chan->ring) {
+		mutex_exit(&zt_ringlock);
+		return ENXIO;
+	}
+	chan->ring->maps++;
+	*pvtp = chan->ring;
+	mutex_exit(&zt_ringlock);
+	return 0;
+}
+
+static int zt_ring_dup(devmap_cookie_t dhp, void *pvtp, devmap_cookie_t new_dhp, void **new_pvtp)
+{
+	struct zt_ring *ring = pvtp;
+
+	mutex_enter(&zt_ringlock);
+	ring->maps++;
+	*new_pvtp = ring;
+	mutex_exit(&zt_ringlock);
+	return 0;
+}
+
+static void zt_ring_unmap(devmap_cookie_t dhp, void *pvtp, offset_t off, size_t len,
+	devmap_cookie_t new_dhp1, void **new_pvtp1, devmap_cookie_t new_dhp2, void **new_pvtp2)
+{
+	struct zt_ring *ring = pvtp;
+
+	mutex_enter(&zt_ringlock);
+	/* A partial unmap leaves up to two pieces still mapped */
+	if (new_dhp1) {
+		ring->maps++;
+		*new_pvtp1 = ring;
+	}
+	if (new_dhp2) {
+		ring->maps++;
+		*new_pvtp2 = ring;
+	}
+	if (--ring->maps || !ring->orphan)
+		ring = NULL;
+	mutex_exit(&zt_ringlock);
+	if (ring)
+		zt_ring_free(ring);
+}
+
+static struct devmap_callback_ctl zt_ring_callbacks = {
+	DEVMAP_OPS_REV,
+	zt_ring_map,
+	NULL,				/* devmap_access */
+	zt_ring_dup,
+	zt_ring_unmap,
+};
+
+static int zt_devmap(dev_t dev, devmap_cookie_t dhp, offset_t off, size_t len, size_t *maplen, uint_t model)
+{
+	struct zt_chan *chan = zt_dev_chan(dev);
+	int res;
+
+	if (!chan)
+		return ENXIO;
+	mutex_enter(&zt_ringlock);
+	if (!chan->ring || (off < 0) || (off + len > chan->ring->size)) {
+		mutex_exit(&zt_ringlock);
+		return ENXIO;
+	}
+	res = devmap_umem_setup(dhp, zt_dip, &zt_ring_callbacks, chan->ring->cookie,
+		off, ptob(btopr(len)), PROT_READ | PROT_WRITE | PROT_USER, 0, NULL);
+	mutex_exit(&zt_ringlock);
+	if (res)
+		return res;
+	*maplen = ptob(btopr(len));
+	return 0;
+}
+
 static ssize_t zt_chan_read(dev_t dev, struct uio *uiop, cred_t *credp)
 {
 	struct zt_chan *chan;
 	int amnt;
 	int res, rv;
-	int oldbuf,x;
+	int x;
 	unsigned long flags;
 	int unit;
 	int count;
@@ -989,12 +2684,16 @@ static ssize_t zt_chan_read(dev_t dev, struct uio *uiop, cred_t *credp)
 	unit = getminor(dev);
 	if (unit >= ZT_DEV_CHAN_BASE && unit < ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT)
 	{
+		if (unit - ZT_DEV_CHAN_BASE >= nchanmap)
+			return ENXIO;
 		if (chan_map[unit - ZT_DEV_CHAN_BASE] < 0)
-			return -1;
+			return ENXIO;
 		chan = chans[chan_map[unit - ZT_DEV_CHAN_BASE]];
 	}
-	else
+	else if (unit < nchans)
  		chan = chans[unit];
+	else
+		return ENXIO;
 	count = uiop->uio_resid;
 
 	// cmn_err(CE_CONT, "zaptel: zt_chan_read(unit = %d, count = %d)\n", unit, count);
@@ -1006,29 +2705,45 @@ static ssize_t zt_chan_read(dev_t dev, struct uio *uiop, cred_t *credp)
 	if (count < 1)
 		return EINVAL;
 
-	mutex_enter(&chan->lock);
-	for(;;) {
-		if (chan->eventinidx != chan->eventoutidx) {
-			chan_unlock(chan);
+	for (;;) {
+		/* The shared rings are the only reader */
+		if (chan->ring)
+			return EBUSY;
+		if (ZT_EVENT_READY(chan))
 			return ELAST;
-		}
-		res = chan->outreadbuf;
-		if (chan->rxdisable)
-			res = -1;
-		if (res >= 0) break;
-		if (uiop->uio_fmode & O_NONBLOCK) {
+		/* Only take the lock if we have to sleep */
+		if (!ZT_RXBUF_READY(chan) || chan->rxdisable) {
+			mutex_enter(&chan->lock);
+			for(;;) {
+				if (ZT_EVENT_READY(chan)) {
+					chan_unlock(chan);
+					return ELAST;
+				}
+				if (ZT_RXBUF_READY(chan) && !chan->rxdisable)
+					break;
+				if (uiop->uio_fmode & O_NONBLOCK) {
+					chan_unlock(chan);
+					return EAGAIN;
+				}
+				// rv = schluffen(&chan->readbufq);
+				// if (rv) return (rv);
+				cv_wait(&chan->readbufq, &chan->lock);
+			}
 			chan_unlock(chan);
-			return EAGAIN;
 		}
-		// rv = schluffen(&chan->readbufq);
-		// if (rv) return (rv);
-		cv_wait(&chan->readbufq, &chan->lock);
+		/* One reader at a time takes the buffer.  If another one
+		   got it first, go back to waiting. */
+		mutex_enter(&chan->readlock);
+		if (!chan->ring && ZT_RXBUF_READY(chan) && !chan->rxdisable)
+			break;
+		mutex_exit(&chan->readlock);
 	}
-	chan_unlock(chan);
+	membar_consumer();
+	res = ZT_RXBUF_OUT(chan);
 	amnt = count;
 	if (chan->flags & ZT_FLAG_LINEAR) {
-		if (amnt > (chan->readn[chan->outreadbuf] << 1)) 
-			amnt = chan->readn[chan->outreadbuf] << 1;
+		if (amnt > (chan->readn[res] << 1)) 
+			amnt = chan->readn[res] << 1;
 		if (amnt) {
 			/* There seems to be a max stack size, so we have
 			   to do this in smaller pieces */
@@ -1041,37 +2756,27 @@ static ssize_t zt_chan_read(dev_t dev, struct uio *uiop, cred_t *credp)
 				if (pass > 128)
 					pass = 128;
 				for (x=0;x<pass;x++)
-					lindata[x] = ZT_XLAW(chan->readbuf[chan->outreadbuf][x + pos], chan);
-				if (uiomove(lindata, pass << 1, UIO_READ, uiop))
+					lindata[x] = ZT_XLAW(chan->readbuf[res][x + pos], chan);
+				if (uiomove(lindata, pass << 1, UIO_READ, uiop)) {
+					mutex_exit(&chan->readlock);
 					return EFAULT;
+				}
 				left -= pass;
 				pos += pass;
 			}
 		}
 	} else {
-		if (amnt > chan->readn[chan->outreadbuf]) 
-			amnt = chan->readn[chan->outreadbuf];
+		if (amnt > chan->readn[res]) 
+			amnt = chan->readn[res];
 		if (amnt) {
-			if (uiomove(chan->readbuf[chan->outreadbuf], amnt, UIO_READ, uiop))
+			if (uiomove(chan->readbuf[res], amnt, UIO_READ, uiop)) {
+				mutex_exit(&chan->readlock);
 				return EFAULT;
+			}
 		}
 	}
-	mutex_enter(&chan->lock);
-	chan->readidx[chan->outreadbuf] = 0;
-	chan->readn[chan->outreadbuf] = 0;
-	oldbuf = chan->outreadbuf;
-	chan->outreadbuf = (chan->outreadbuf + 1) % chan->numbufs;
-	if (chan->outreadbuf == chan->inreadbuf) {
-		/* Out of stuff */
-		chan->outreadbuf = -1;
-		if (chan->rxbufpolicy == ZT_POLICY_WHEN_FULL)
-			chan->rxdisable = 1;
-	}
-	if (chan->inreadbuf < 0) {
-		/* Notify interrupt handler that we have some space now */
-		chan->inreadbuf = oldbuf;
-	}
-	chan_unlock(chan);
+	__zt_readbuf_done(chan);
+	mutex_exit(&chan->readlock);
 	
 	return 0;
 }
@@ -1080,17 +2785,21 @@ static int zt_chan_write(dev_t dev, struct uio *uiop, cred_t *credp)
 {
 	unsigned long flags;
 	struct zt_chan *chan;
-	int res, amnt, oldbuf, rv,x, unit, count;
+	int res, amnt, unit, count;
 
 	unit = getminor(dev);
 	if (unit >= ZT_DEV_CHAN_BASE && unit < ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT)
 	{
+		if (unit - ZT_DEV_CHAN_BASE >= nchanmap)
+			return ENXIO;
 		if (chan_map[unit - ZT_DEV_CHAN_BASE] < 0)
 			return ENXIO;
 		chan = chans[chan_map[unit - ZT_DEV_CHAN_BASE]];
 	}
-	else
+	else if (unit < nchans)
  		chan = chans[unit];
+	else
+		return ENXIO;
 
 	count = uiop->uio_resid;
 
@@ -1102,32 +2811,42 @@ static int zt_chan_write(dev_t dev, struct uio *uiop, cred_t *credp)
 		return EINVAL;
 	if (count < 1)
 		return EINVAL;
-	mutex_enter(&chan->lock);
-	for(;;) {
-		if ((chan->curtone || chan->pdialcount) && !(chan->flags & ZT_FLAG_PSEUDO)) {
-			chan->curtone = NULL;
-			chan->tonep = 0;
-			chan->dialing = 0;
-			chan->txdialbuf[0] = '\0';
-			chan->pdialcount = 0;
-		}
-		if (chan->eventinidx != chan->eventoutidx) {
-			chan_unlock(chan);
+	for (;;) {
+		/* The shared rings are the only writer */
+		if (chan->ring)
+			return EBUSY;
+		zt_stop_tones(chan);
+		if (ZT_EVENT_READY(chan))
 			return ELAST;
-		}
-		res = chan->inwritebuf;
-		if (res >= 0) 
-			break;
-		if (uiop->uio_fmode & O_NONBLOCK) {
+		/* Only take the lock if we have to sleep */
+		if (!ZT_TXBUF_ROOM(chan)) {
+			mutex_enter(&chan->lock);
+			for(;;) {
+				if (ZT_EVENT_READY(chan)) {
+					chan_unlock(chan);
+					return ELAST;
+				}
+				if (ZT_TXBUF_ROOM(chan))
+					break;
+				if (uiop->uio_fmode & O_NONBLOCK) {
+					chan_unlock(chan);
+					return EAGAIN;
+				}
+				/* Wait for something to be available */
+				// rv = schluffen(&chan->writebufq);
+				// if (rv) return rv;
+				cv_wait(&chan->writebufq, &chan->lock);
+			}
 			chan_unlock(chan);
-			return EAGAIN;
 		}
-		/* Wait for something to be available */
-		// rv = schluffen(&chan->writebufq);
-		// if (rv) return rv;
-		cv_wait(&chan->writebufq, &chan->lock);
+		/* One writer at a time fills the buffer.  If another one
+		   got it first, go back to waiting. */
+		mutex_enter(&chan->writelock);
+		if (!chan->ring && ZT_TXBUF_ROOM(chan))
+			break;
+		mutex_exit(&chan->writelock);
 	}
-	chan_unlock(chan);
+	res = ZT_TXBUF_IN(chan);
 
 	amnt = count;
 	if (chan->flags & ZT_FLAG_LINEAR) {
@@ -1139,8 +2858,8 @@ static int zt_chan_write(dev_t dev, struct uio *uiop, cred_t *credp)
 	}
 
 #if CONFIG_ZAPATA_DEBUG
-	cmn_err(CE_CONT, "zt_chan_write(unit: %d, inwritebuf: %d, outwritebuf: %d amnt: %d\n", 
-		unit, chan->inwritebuf, chan->outwritebuf, amnt);
+	cmn_err(CE_CONT, "zt_chan_write(unit: %d, txhead: %u, txtail: %u amnt: %d\n", 
+		unit, chan->txhead, chan->txtail, amnt);
 #endif
 
 	if (amnt) {
@@ -1155,40 +2874,200 @@ static int zt_chan_write(dev_t dev, struct uio *uiop, cred_t *credp)
 				pass = left;
 				if (pass > 128)
 					pass = 128;
-				if (uiomove(lindata, pass << 1, UIO_WRITE, uiop))
+				if (uiomove(lindata, pass << 1, UIO_WRITE, uiop)) {
+					mutex_exit(&chan->writelock);
 					return EFAULT;
+				}
 				left -= pass;
-				for (x=0;x<pass;x++)
-					chan->writebuf[chan->inwritebuf][x + pos] = ZT_LIN2X(lindata[x], chan);
+				zt_lin2x(chan, lindata, chan->writebuf[res] + pos, pass);
 				pos += pass;
 			}
-			chan->writen[chan->inwritebuf] = amnt >> 1;
+			chan->writen[res] = amnt >> 1;
 		} else {
-			uiomove(chan->writebuf[chan->inwritebuf], amnt, UIO_WRITE, uiop);
-			chan->writen[chan->inwritebuf] = amnt;
+			uiomove(chan->writebuf[res], amnt, UIO_WRITE, uiop);
+			chan->writen[res] = amnt;
 		}
-		chan->writeidx[chan->inwritebuf] = 0;
+		chan->writeidx[res] = 0;
 		if (chan->flags & ZT_FLAG_FCS)
 			calc_fcs(chan);
-		oldbuf = chan->inwritebuf;
-		mutex_enter(&chan->lock);
-		chan->inwritebuf = (chan->inwritebuf + 1) % chan->numbufs;
-		if (chan->inwritebuf == chan->outwritebuf) {
-			/* Don't stomp on the transmitter, just wait for them to 
-			   wake us up */
-			chan->inwritebuf = -1;
-			/* Make sure the transmitter is transmitting in case of POLICY_WHEN_FULL */
-			chan->txdisable = 0;
+		__zt_writebuf_done(chan);
+	}
+	mutex_exit(&chan->writelock);
+	return 0;
+}
+
+/* One ZT_BUFVEC read, with chan->readlock held.  Returns bytes moved or
+   a negative errno. */
+static int zt_bufvec_read(struct zt_chan *chan, u_char *ubuf, int len, int mode)
+{
+	short lindata[128];
+	int amnt, left, pos, pass, x, buf;
+
+	if (chan->ring)
+		return -EBUSY;
+	if (ZT_EVENT_READY(chan))
+		return -ELAST;
+	if (!ZT_RXBUF_READY(chan) || chan->rxdisable)
+		return -EAGAIN;
+	membar_consumer();
+	buf = ZT_RXBUF_OUT(chan);
+	amnt = chan->readn[buf];
+	if (chan->flags & ZT_FLAG_LINEAR) {
+		if (amnt > (len >> 1))
+			amnt = len >> 1;
+		left = amnt;
+		pos = 0;
+		while(left) {
+			pass = left;
+			if (pass > 128)
+				pass = 128;
+			for (x=0;x<pass;x++)
+				lindata[x] = ZT_XLAW(chan->readbuf[buf][x + pos], chan);
+			if (ddi_copyout(lindata, ubuf + (pos << 1), pass << 1, mode))
+				return -EFAULT;
+			left -= pass;
+			pos += pass;
 		}
-		if (chan->outwritebuf < 0) {
-			/* Okay, the interrupt handler has been waiting for us.  Give them a buffer */
-			chan->outwritebuf = oldbuf;
+		amnt <<= 1;
+	} else {
+		if (amnt > len)
+			amnt = len;
+		if (amnt && ddi_copyout(chan->readbuf[buf], ubuf, amnt, mode))
+			return -EFAULT;
+	}
+	__zt_readbuf_done(chan);
+	return amnt;
+}
+
+/* One ZT_BUFVEC write, with chan->writelock held.  Returns bytes moved
+   or a negative errno. */
+static int zt_bufvec_write(struct zt_chan *chan, u_char *ubuf, int len, int mode)
+{
+	short lindata[128];
+	int amnt, left, pos, pass, buf;
+
+	if (chan->ring)
+		return -EBUSY;
+	zt_stop_tones(chan);
+	if (ZT_EVENT_READY(chan))
+		return -ELAST;
+	if (!ZT_TXBUF_ROOM(chan))
+		return -EAGAIN;
+	buf = ZT_TXBUF_IN(chan);
+	if (chan->flags & ZT_FLAG_LINEAR) {
+		amnt = len >> 1;
+		if (amnt > chan->blocksize)
+			amnt = chan->blocksize;
+		left = amnt;
+		pos = 0;
+		while(left) {
+			pass = left;
+			if (pass > 128)
+				pass = 128;
+			if (ddi_copyin(ubuf + (pos << 1), lindata, pass << 1, mode))
+				return -EFAULT;
+			zt_lin2x(chan, lindata, chan->writebuf[buf] + pos, pass);
+			left -= pass;
+			pos += pass;
 		}
-		chan_unlock(chan);
+		chan->writen[buf] = amnt;
+		amnt <<= 1;
+	} else {
+		amnt = len;
+		if (amnt > chan->blocksize)
+			amnt = chan->blocksize;
+		if (ddi_copyin(ubuf, chan->writebuf[buf], amnt, mode))
+			return -EFAULT;
+		chan->writen[buf] = amnt;
+	}
+	if (!amnt)
+		return 0;
+	chan->writeidx[buf] = 0;
+	if (chan->flags & ZT_FLAG_FCS)
+		calc_fcs(chan);
+	__zt_writebuf_done(chan);
+	return amnt;
+}
+
+#define ZT_BUFVEC_BATCH		32
+
+static int zt_bufvec(struct zt_bufvec *bv, int mode)
+{
+	struct zt_bufvec_desc desc[ZT_BUFVEC_BATCH];
+	int res[ZT_BUFVEC_BATCH];
+	struct zt_chan *chan;
+	int x, y, n;
+
+	if ((bv->count < 0) || (bv->count > ZT_MAX_BUFVEC))
+		return EINVAL;
+	bv->moved = 0;
+	for (x=0;x<bv->count;x+=n) {
+		n = bv->count - x;
+		if (n > ZT_BUFVEC_BATCH)
+			n = ZT_BUFVEC_BATCH;
+		if (ddi_copyin(bv->desc + x, desc, n * sizeof(desc[0]), mode))
+			return EFAULT;
+		for (y=0;y<n;y++) {
+			chan = NULL;
+			if ((desc[y].chan > 0) && (desc[y].chan < maxchans))
+				chan = chans[desc[y].chan];
+			if (!chan || !(chan->flags & (ZT_FLAG_OPEN | ZT_FLAG_PSEUDO)))
+				res[y] = -ENXIO;
+			else if (desc[y].len < 1)
+				res[y] = -EINVAL;
+			else if (desc[y].op == ZT_BUFVEC_READ) {
+				mutex_enter(&chan->readlock);
+				res[y] = zt_bufvec_read(chan, desc[y].buf, desc[y].len & 0xffff, mode);
+				mutex_exit(&chan->readlock);
+			} else if (desc[y].op == ZT_BUFVEC_WRITE) {
+				mutex_enter(&chan->writelock);
+				res[y] = zt_bufvec_write(chan, desc[y].buf, desc[y].len & 0xffff, mode);
+				mutex_exit(&chan->writelock);
+			} else
+				res[y] = -EINVAL;
+			if (res[y] > 0)
+				bv->moved++;
+		}
+		if (ddi_copyout(res, bv->result + x, n * sizeof(res[0]), mode))
+			return EFAULT;
 	}
 	return 0;
 }
 
+/* ZT_GETEVENTS: dequeue up to count events with their timestamps */
+static int zt_getevents(struct zt_chan *chan, intptr_t data, int mode)
+{
+	struct zt_eventvec *evv;
+	hrtime_t when;
+	int x, res = 0;
+
+	evv = kmem_alloc(sizeof(*evv), KM_SLEEP);
+	if (ddi_copyin((void *)data, evv, offsetof(struct zt_eventvec, ev), mode)) {
+		res = EFAULT;
+		goto out;
+	}
+	if (evv->count < 0) {
+		res = EINVAL;
+		goto out;
+	}
+	if (evv->count > ZT_MAX_GETEVENTS)
+		evv->count = ZT_MAX_GETEVENTS;
+	mutex_enter(&chan->lock);
+	for (x=0;(x<evv->count) && ZT_EVENT_READY(chan);x++) {
+		evv->ev[x].event = zt_event_get(chan, &when);
+		evv->ev[x].reserved = 0;
+		evv->ev[x].when = when;
+	}
+	chan_unlock(chan);
+	evv->count = x;
+	evv->dropped = atomic_swap_32(&chan->evdropped, 0);
+	if (ddi_copyout(evv, (void *)data, offsetof(struct zt_eventvec, ev[x]), mode))
+		res = EFAULT;
+out:
+	kmem_free(evv, sizeof(*evv));
+	return res;
+}
+
 static int zt_ctl_open(dev_t *inode, int flag, int otyp, cred_t *credp)
 {
 	/* Nothing to do, really */
@@ -1202,20 +3081,29 @@ static int zt_chan_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 	/* Allocate a new device */
 	newdev = -1;
 
-	for (x = 0; x < ZT_DEV_CHAN_COUNT; x++)
+	rw_enter(&chan_lock, RW_WRITER);
+	for (x = 0; x < nchanmap; x++)
 		if (chan_map[x] == -1)
 		{
 			newdev = x;
 			break;
 		}
+	if ((newdev == -1) && (nchanmap < ZT_DEV_CHAN_COUNT)) {
+		newdev = nchanmap;
+		nchanmap = __zt_tab_grow((void **)&chan_map, nchanmap, nchanmap + 1,
+			ZT_CHANMAP_MIN, ZT_DEV_CHAN_COUNT, sizeof(int));
+		for (x = newdev; x < nchanmap; x++)
+			chan_map[x] = -1;
+	}
+	if (newdev != -1)
+		chan_map[newdev] = -2;
+	rw_exit(&chan_lock);
 
 	if (newdev == -1)
 		return ENOMEM;
 
 	*devp=makedevice(getmajor(*devp), newdev + ZT_DEV_CHAN_BASE);
 
-	chan_map[newdev] = -2;
-
 	// cmn_err(CE_CONT, "zaptel: channel open, allocated minor %d\n", newdev);
 	
 	return 0;
@@ -1320,7 +3208,7 @@ who cares what the sig bits are as long as they are stable */
 				set_txtone(chan,0,0,0);
 			}
 		}
-		chan->otimer = timeout * 8;			/* Otimer is timer in samples */
+		zt_timer_set(&chan->otimer, timeout * 8);	/* Otimer is timer in samples */
 		return;
 	}
 	if (chan->span->hooksig) {
@@ -1328,7 +3216,7 @@ who cares what the sig bits are as long as they are stable */
 			chan->txhooksig = txsig;
 			chan->span->hooksig(chan, txsig);
 		}
-		chan->otimer = timeout * 8;			/* Otimer is timer in samples */
+		zt_timer_set(&chan->otimer, timeout * 8);	/* Otimer is timer in samples */
 		return;
 	} else {
 		for (x=0;x<NUM_SIGS;x++) {
@@ -1339,7 +3227,7 @@ who cares what the sig bits are as long as they are stable */
 				chan->txhooksig = txsig;
 				chan->txsig = outs[x][txsig+1];
 				chan->span->rbsbits(chan, chan->txsig);
-				chan->otimer = timeout * 8;	/* Otimer is timer in samples */
+				zt_timer_set(&chan->otimer, timeout * 8);	/* Otimer is timer in samples */
 				return;
 			}
 		}
@@ -1375,7 +3263,8 @@ static int zt_hangup(struct zt_chan *chan)
 
 
 	if ((chan->sig == ZT_SIG_FXSLS) || (chan->sig == ZT_SIG_FXSKS) ||
-		(chan->sig == ZT_SIG_FXSGS)) chan->ringdebtimer = RING_DEBOUNCE_TIME;
+		(chan->sig == ZT_SIG_FXSGS))
+		zt_timer_set(&chan->ringdebtimer, RING_DEBOUNCE_TIME * ZT_CHUNKSIZE);
 
 	if (chan->span->flags & ZT_FLAG_RBS) {
 		if (chan->sig == ZT_SIG_CAS) {
@@ -1404,15 +3293,8 @@ static int zt_hangup(struct zt_chan *chan)
 		chan->readn[x]=
 		chan->readidx[x] = 0;
 	}	
-	if (chan->readbuf[0]) {
-		chan->inreadbuf = 0;
-		chan->inwritebuf = 0;
-	} else {
-		chan->inreadbuf = -1;
-		chan->inwritebuf = -1;
-	}
-	chan->outreadbuf = -1;
-	chan->outwritebuf = -1;
+	chan->rxhead = chan->rxtail = 0;
+	chan->txhead = chan->txtail = 0;
 	chan->dialing = 0;
 	chan->afterdialingtimer = 0;
 	chan->curtone = NULL;
@@ -1426,8 +3308,9 @@ static int initialize_channel(struct zt_chan *chan)
 {
 	int res;
 	unsigned long flags;
-	void *rxgain=NULL;
-	echo_can_state_t *ec=NULL;
+	struct zt_gaintab *gaintab;
+	struct zt_ec_engine *eng;
+	void *ec=NULL;
 	if ((res = zt_reallocbufs(chan, ZT_DEFAULT_BLOCKSIZE, ZT_DEFAULT_NUM_BUFS)))
 		return res;
 
@@ -1438,6 +3321,7 @@ static int initialize_channel(struct zt_chan *chan)
 
 	/* Free up the echo canceller if there is one */
 	ec = chan->ec;
+	eng = chan->ecengine;
 	chan->ec = NULL;
 	chan->echocancel = 0;
 	chan->echostate = ECHO_STATE_IDLE;
@@ -1477,8 +3361,10 @@ static int initialize_channel(struct zt_chan *chan)
 	chan->pulseaftertime = ZT_DEFAULT_PULSEAFTERTIME;
 	
 	/* Initialize RBS timers */
-	chan->itimerset = chan->itimer = chan->otimer = 0;
-	chan->ringdebtimer = 0;		
+	chan->itimerset = 0;
+	zt_timer_set(&chan->itimer, 0);
+	zt_timer_set(&chan->otimer, 0);
+	zt_timer_set(&chan->ringdebtimer, 0);
 
 	cv_init(&chan->readbufq, NULL, CV_DRIVER, NULL);
 	cv_init(&chan->writebufq, NULL, CV_DRIVER, NULL);
@@ -1506,12 +3392,12 @@ static int initialize_channel(struct zt_chan *chan)
 	chan->tonep = 0;
 	chan->pdialcount = 0;
 	set_tone_zone(chan, -1);
-	if (chan->gainalloc && chan->rxgain)
-		rxgain = chan->rxgain;
+	gaintab = chan->gaintab;
+	chan->gaintab = NULL;
 	chan->rxgain = defgain;
 	chan->txgain = defgain;
-	chan->gainalloc = 0;
-	chan->eventinidx = chan->eventoutidx = 0;
+	zt_event_flush(chan);
+	chan->evdropped = 0;
 	zt_set_law(chan,0);
 	zt_hangup(chan);
 
@@ -1534,20 +3420,57 @@ static int initialize_channel(struct zt_chan *chan)
 	}
 	chan_unlock(chan);
 
-	if (rxgain)
-		kmem_free(rxgain, 512);
+	if (gaintab)
+		zt_gaintab_put(gaintab);
 	if (ec)
-		echo_can_free(ec);
+		zt_ec_put(eng, ec);
 	return 0;
 }
 
+/* Chunks until a timer of the given number of samples runs out */
+#define ZT_TIMER_CHUNKS(samples)	(((samples) + ZT_CHUNKSIZE - 1) / ZT_CHUNKSIZE)
+
+static void zt_ltimer_init(struct zt_ltimer *lt, struct zt_fdtimer *fd, int id)
+{
+	zt_timer_init(&lt->wt, NULL, 0);
+	lt->fd = fd;
+	lt->id = id;
+	lt->period = 0;
+	lt->tripped = 0;
+	lt->nextexp = NULL;
+}
+
+/* Run a logical timer out after first samples, then every period samples
+   (0 for just once), or stop it if first is 0.  Runs not yet collected
+   are kept.  zt_fdwheel.lock held. */
+static void __zt_ltimer_arm(struct zt_ltimer *lt, int first, int period)
+{
+	__zt_timer_del(&lt->wt);
+	lt->period = (period > 0) ? ZT_TIMER_CHUNKS(period) : 0;
+	if (first > 0) {
+		lt->wt.expires = zt_fdwheel.tick + ZT_TIMER_CHUNKS(first);
+		__zt_timer_add(&zt_fdwheel, &lt->wt);
+	}
+}
+
+/* Take a descriptor's logical timers off the wheel and forget the ones
+   that ran out.  zt_fdwheel.lock held. */
+static void __zt_fdtimer_stop(struct zt_fdtimer *fd)
+{
+	int x;
+
+	for (x=0;x<fd->ntimers;x++)
+		__zt_timer_del(&fd->timers[x].wt);
+	fd->expired = NULL;
+	fd->exptail = &fd->expired;
+}
+
 static int zt_timing_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 {
-	struct zt_timer *t;
-	unsigned long flags;
+	struct zt_fdtimer *t;
 	int newdev, x;
 
-	t = kmem_alloc(sizeof(struct zt_timer), KM_NOSLEEP);
+	t = kmem_zalloc(sizeof(struct zt_fdtimer), KM_NOSLEEP);
 	if (!t)
 		return ENOMEM;
 
@@ -1561,54 +3484,37 @@ static int zt_timing_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 			break;
 		}
 
-	if (newdev == -1)
+	if (newdev == -1) {
+		kmem_free(t, sizeof(struct zt_fdtimer));
 		return ENOMEM;
+	}
 
 	*devp=makedevice(getmajor(*devp), newdev + ZT_DEV_TIMER_BASE);
 
-	chan_timer_map[newdev] = t;
-
-	/* Allocate a new timer */
-	bzero(t, sizeof(struct zt_timer));
+	/* Set up the new timer */
 	t->dev = newdev;
+	zt_ltimer_init(&t->one, t, -1);
+	t->exptail = &t->expired;
 
-	mutex_enter(&zaptimerlock);
-	t->next = zaptimers;
-	zaptimers = t;
-	mutex_exit(&zaptimerlock);
+	chan_timer_map[newdev] = t;
 	return 0;
 }
 
 static int zt_timer_release(dev_t dev, int flag, int otyp, cred_t *credp)
 {
-	struct zt_timer *t, *cur, *prev;
-	unsigned long flags;
+	struct zt_fdtimer *t;
 
 	t = chan_timer_map[getminor(dev) - ZT_DEV_TIMER_BASE];
 	chan_timer_map[getminor(dev) - ZT_DEV_TIMER_BASE] = NULL;
 
 	if (t) {
-		mutex_enter(&zaptimerlock);
-		prev = NULL;
-		cur = zaptimers;
-		while(cur) {
-			if (t == cur)
-				break;
-			prev = cur;
-			cur = cur->next;
-		}
-		if (cur) {
-			if (prev)
-				prev->next = cur->next;
-			else
-				zaptimers = cur->next;
-		}
-		mutex_exit(&zaptimerlock);
-		if (!cur) {
-			cmn_err(CE_CONT, "Zap Timer: Not on list??\n");
-			return 0;
-		}
-		kmem_free(t, sizeof(struct zt_timer));
+		mutex_enter(&zt_fdwheel.lock);
+		__zt_timer_del(&t->one.wt);
+		__zt_fdtimer_stop(t);
+		mutex_exit(&zt_fdwheel.lock);
+		if (t->timers)
+			kmem_free(t->timers, t->ntimers * sizeof(struct zt_ltimer));
+		kmem_free(t, sizeof(struct zt_fdtimer));
 	}
 	return 0;
 }
@@ -1620,6 +3526,8 @@ static int zt_specchan_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 
 	// cmn_err(CE_CONT, "zt_specchan_open: unit=%d\n", unit);
 
+	if ((unit < 1) || (unit >= maxchans))
+		return ENXIO;
 	if (chans[unit] && chans[unit]->sig) {
 		/* Make sure we're not already open, a net device, or a slave device */
 		if (chans[unit]->flags & ZT_FLAG_OPEN) 
@@ -1643,6 +3551,7 @@ static int zt_specchan_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 			} else {
 				close_channel(chans[unit]);
 			}
+			zt_update_idle(chans[unit]);
 		}
 	} else
 		res = ENXIO;
@@ -1651,20 +3560,26 @@ static int zt_specchan_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 
 static int zt_specchan_release(dev_t dev, int flag, int otyp, cred_t *credp)
 {
-	int res=0;
+	int res=0, mon;
 	int unit, unit1 = getminor(dev) - ZT_DEV_CHAN_BASE;
 
-	if (unit1 < 0 || unit1 > ZT_DEV_CHAN_COUNT)
+	if (unit1 < 0 || unit1 >= nchanmap)
 		return ENXIO;
 
 	unit = chan_map[unit1];
 
 	if (chans[unit]) {
+		/* Whoever we were monitoring may be idle now, too */
+		mon = chans[unit]->confna;
 		chans[unit]->flags &= ~ZT_FLAG_OPEN;
 		// chans[unit]->file = NULL;
 		close_channel(chans[unit]);
 		if (chans[unit]->span && chans[unit]->span->close)
 			res = chans[unit]->span->close(chans[unit]);
+		mutex_enter(&bigzaplock);
+		__zt_update_idle(chans[unit]);
+		__zt_update_idleno(mon);
+		mutex_exit(&bigzaplock);
 	} else
 		res = ENXIO;
 	chan_map[unit1] = -1;
@@ -1689,8 +3604,11 @@ static struct zt_chan *zt_alloc_pseudo(void)
 	if (zt_chan_reg(pseudo)) {
 		kmem_free(pseudo, sizeof(struct zt_chan));
 		pseudo = NULL;
-	} else
+	} else {
 		sprintf(pseudo->name, "Pseudo/%d", pseudo->channo);
+		__zt_update_active(pseudo);
+		__zt_snap_publish();
+	}
 	mutex_exit(&bigzaplock);
 	return pseudo;	
 }
@@ -1700,12 +3618,278 @@ static void zt_free_pseudo(struct zt_chan *pseudo)
 	unsigned long flags;
 	if (pseudo) {
 		mutex_enter(&bigzaplock);
+		__zt_active_del(ZT_ACTIVE_PSEUDO, pseudo->channo);
 		zt_chan_unreg(pseudo);
+		__zt_update_idleno(pseudo->confna);
+		__zt_snap_publish();
 		mutex_exit(&bigzaplock);
+		/* The tick may still have it from the old snapshot */
+		zt_snap_sync();
 		kmem_free(pseudo, sizeof(struct zt_chan));
 	}
 }
 
+/* What a poll() on the channel would report right now */
+static short zt_chan_ready(struct zt_chan *chan)
+{
+	short ret = 0;
+
+	if (chan->ring) {
+		struct zt_ring *ring = chan->ring;
+		/* if the tx ring has room, or the rx ring has frames */
+		if (ring->hdr->tx_head - ring->tx_tail < ring->slots)
+			ret |= POLLOUT | POLLWRNORM;
+		if (ring->rx_head != ring->hdr->rx_tail)
+			ret |= POLLIN | POLLRDNORM;
+	} else {
+		   /* if at least 1 write buffer avail */
+		if (ZT_TXBUF_ROOM(chan))
+			ret |= POLLOUT | POLLWRNORM;
+		if (ZT_RXBUF_READY(chan) && !chan->rxdisable)
+			ret |= POLLIN | POLLRDNORM;
+	}
+	if (ZT_EVENT_READY(chan))
+		/* Indicate an exception */
+		ret |= POLLPRI | POLLERR;
+	return ret;
+}
+
+static int zt_mux_open(dev_t *devp, int flag, int otyp, cred_t *credp)
+{
+	struct zt_mux *mux;
+	int x;
+
+	mux = kmem_zalloc(sizeof(struct zt_mux), KM_SLEEP);
+	mutex_init(&mux->lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&mux->readyq, NULL, CV_DRIVER, NULL);
+	mutex_enter(&zt_muxlock);
+	for (x=0;x<ZT_DEV_MUX_COUNT;x++)
+		if (!zt_muxes[x])
+			break;
+	if (x == ZT_DEV_MUX_COUNT) {
+		mutex_exit(&zt_muxlock);
+		kmem_free(mux, sizeof(struct zt_mux));
+		return ENOMEM;
+	}
+	zt_muxes[x] = mux;
+	mutex_exit(&zt_muxlock);
+	*devp = makedevice(getmajor(*devp), ZT_DEV_MUX_BASE + x);
+	return 0;
+}
+
+static void zt_mux_free_slots(short *interest, u_char *queued, int *queue, int slots)
+{
+	if (!slots)
+		return;
+	kmem_free(interest, slots * sizeof(short));
+	kmem_free(queued, slots * sizeof(u_char));
+	kmem_free(queue, slots * sizeof(int));
+}
+
+static int zt_mux_release(dev_t dev, int flag, int otyp, cred_t *credp)
+{
+	int x = getminor(dev) - ZT_DEV_MUX_BASE;
+	uint64_t bit = 1ULL << x;
+	struct zt_mux *mux;
+	int y;
+
+	rw_enter(&chan_lock, RW_READER);
+	mutex_enter(&zt_muxlock);
+	mux = zt_muxes[x];
+	zt_muxes[x] = NULL;
+	for (y=1;y<maxchans;y++)
+		if (chans[y])
+			chans[y]->muxwatch &= ~bit;
+	mutex_exit(&zt_muxlock);
+	rw_exit(&chan_lock);
+	if (mux) {
+		cv_destroy(&mux->readyq);
+		mutex_destroy(&mux->lock);
+		zt_mux_free_slots(mux->interest, mux->queued, mux->queue, mux->slots);
+		kmem_free(mux, sizeof(struct zt_mux));
+	}
+	return 0;
+}
+
+/* Give a mux room for channels up to channo.  The arrays are allocated
+   before taking any lock and swapped in under mux->lock, with the queue
+   unrolled to start at 0. */
+static void zt_mux_grow(struct zt_mux *mux, int channo)
+{
+	short *interest, *ointerest;
+	u_char *queued, *oqueued;
+	int *queue, *oqueue;
+	int slots, oslots, x;
+
+	slots = ZT_CHANTAB_MIN;
+	while (slots <= channo)
+		slots <<= 1;
+	interest = kmem_zalloc(slots * sizeof(short), KM_SLEEP);
+	queued = kmem_zalloc(slots * sizeof(u_char), KM_SLEEP);
+	queue = kmem_zalloc(slots * sizeof(int), KM_SLEEP);
+	mutex_enter(&mux->lock);
+	if (slots > mux->slots) {
+		if (mux->slots) {
+			bcopy(mux->interest, interest, mux->slots * sizeof(short));
+			bcopy(mux->queued, queued, mux->slots * sizeof(u_char));
+			for (x=0;x<mux->qlen;x++)
+				queue[x] = mux->queue[(mux->qhead + x) % mux->slots];
+		}
+		ointerest = mux->interest;
+		oqueued = mux->queued;
+		oqueue = mux->queue;
+		oslots = mux->slots;
+		mux->interest = interest;
+		mux->queued = queued;
+		mux->queue = queue;
+		mux->slots = slots;
+		mux->qhead = 0;
+	} else {
+		/* Somebody beat us to it */
+		ointerest = interest;
+		oqueued = queued;
+		oqueue = queue;
+		oslots = slots;
+	}
+	mutex_exit(&mux->lock);
+	zt_mux_free_slots(ointerest, oqueued, oqueue, oslots);
+}
+
+static int zt_mux_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *credp, int *rvalp)
+{
+	int x = getminor(dev) - ZT_DEV_MUX_BASE;
+	struct zt_mux_entry me;
+	struct zt_mux *mux;
+
+	switch(cmd) {
+	case ZT_MUX_SET:
+		if (ddi_copyin((void *)data, &me, sizeof(me), mode))
+			return EFAULT;
+		if (me.chan < 1)
+			return EINVAL;
+		mux = zt_muxes[x];
+		if (!mux)
+			return ENXIO;
+		/* Only this descriptor's ioctls grow the arrays */
+		if (me.chan >= mux->slots)
+			zt_mux_grow(mux, me.chan);
+		rw_enter(&chan_lock, RW_READER);
+		if ((me.chan >= maxchans) || !chans[me.chan]) {
+			rw_exit(&chan_lock);
+			return EINVAL;
+		}
+		mutex_enter(&zt_muxlock);
+		mutex_enter(&mux->lock);
+		mux->interest[me.chan] = me.events & (ZT_MUX_IN | ZT_MUX_OUT | ZT_MUX_PRI | ZT_MUX_GETEVENT);
+		if (mux->interest[me.chan]) {
+			chans[me.chan]->muxwatch |= (1ULL << x);
+			/* Report whatever is already ready */
+			__zt_mux_queue(mux, me.chan);
+		} else
+			chans[me.chan]->muxwatch &= ~(1ULL << x);
+		mutex_exit(&mux->lock);
+		mutex_exit(&zt_muxlock);
+		rw_exit(&chan_lock);
+		return 0;
+	}
+	return ENOTTY;
+}
+
+#define ZT_MUX_BATCH		32
+
+static int zt_mux_read(dev_t dev, struct uio *uiop, cred_t *credp)
+{
+	struct zt_mux *mux = zt_muxes[getminor(dev) - ZT_DEV_MUX_BASE];
+	struct zt_mux_event ev[ZT_MUX_BATCH];
+	int picked[ZT_MUX_BATCH];
+	short want[ZT_MUX_BATCH];
+	struct zt_chan *chan;
+	int max, n, x, y, interest;
+	short ready;
+
+	if (!mux)
+		return ENXIO;
+	max = uiop->uio_resid / sizeof(struct zt_mux_event);
+	if (max < 1)
+		return EINVAL;
+	if (max > ZT_MUX_BATCH)
+		max = ZT_MUX_BATCH;
+	for (;;) {
+		/* Take candidates off the queue */
+		mutex_enter(&mux->lock);
+		while (!mux->qlen) {
+			if (uiop->uio_fmode & O_NONBLOCK) {
+				mutex_exit(&mux->lock);
+				return EAGAIN;
+			}
+			if (!cv_wait_sig(&mux->readyq, &mux->lock)) {
+				mutex_exit(&mux->lock);
+				return EINTR;
+			}
+		}
+		for (n=0;(n < max) && mux->qlen;n++) {
+			picked[n] = mux->queue[mux->qhead];
+			want[n] = mux->interest[picked[n]];
+			mux->qhead = (mux->qhead + 1) % mux->slots;
+			mux->qlen--;
+			mux->queued[picked[n]] = 0;
+		}
+		mutex_exit(&mux->lock);
+
+		/* Keep the ones that are really ready.  chan_lock keeps the
+		   channels from being unregistered and freed under us. */
+		rw_enter(&chan_lock, RW_READER);
+		for (x=0,y=0;x<n;x++) {
+			if (picked[x] >= maxchans)
+				continue;
+			chan = chans[picked[x]];
+			interest = want[x];
+			if (!chan || !interest)
+				continue;
+			mutex_enter(&chan->lock);
+			ready = zt_chan_ready(chan);
+			ev[y].revents = 0;
+			if ((interest & ZT_MUX_IN) && (ready & POLLIN))
+				ev[y].revents |= ZT_MUX_IN;
+			if ((interest & ZT_MUX_OUT) && (ready & POLLOUT))
+				ev[y].revents |= ZT_MUX_OUT;
+			if ((interest & ZT_MUX_PRI) && (ready & POLLPRI))
+				ev[y].revents |= ZT_MUX_PRI;
+			ev[y].event = ZT_EVENT_NONE;
+			if ((interest & ZT_MUX_GETEVENT) && ZT_EVENT_READY(chan)) {
+				ev[y].event = zt_event_get(chan, NULL);
+			}
+			chan_unlock(chan);
+			if (!ev[y].revents && (ev[y].event == ZT_EVENT_NONE))
+				continue;
+			ev[y++].chan = picked[x];
+		}
+		rw_exit(&chan_lock);
+		if (y)
+			break;
+	}
+	/* Level triggered: anything reported gets looked at again next time */
+	mutex_enter(&mux->lock);
+	for (x=0;x<y;x++)
+		__zt_mux_queue(mux, ev[x].chan);
+	mutex_exit(&mux->lock);
+	return uiomove(ev, y * sizeof(struct zt_mux_event), UIO_READ, uiop);
+}
+
+static int zt_mux_poll(dev_t dev, short events, int anyyet, short *reventsp, struct pollhead **phpp)
+{
+	struct zt_mux *mux = zt_muxes[getminor(dev) - ZT_DEV_MUX_BASE];
+
+	if (!mux)
+		return EINVAL;
+	*reventsp = 0;
+	if ((events & (POLLIN|POLLRDNORM)) && mux->qlen)
+		*reventsp = POLLIN | POLLRDNORM;
+	if (!*reventsp && !anyyet)
+		*phpp = &mux->sel;
+	return 0;
+}
+
 static int zt_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 {
 	int unit = getminor(*devp);
@@ -1713,16 +3897,18 @@ static int zt_open(dev_t *devp, int flag, int otyp, cred_t *credp)
 	/* Minor 0: Special "control" descriptor */
 	if (!unit) 
 		return zt_ctl_open(devp, flag, otyp, credp);
-	if (unit == 253) {
+	if (unit == ZT_DEV_TIMER) {
 		if (maxspans) {
 			return zt_timing_open(devp, flag, otyp, credp);
 		} else {
 			return ENXIO;
 		}
 	}
-	if (unit == 254)
+	if (unit == ZT_DEV_CHANNEL)
 		return zt_chan_open(devp, flag, otyp, credp);
-	if (unit == 255) {
+	if (unit == ZT_DEV_MUX)
+		return zt_mux_open(devp, flag, otyp, credp);
+	if (unit == ZT_DEV_PSEUDO) {
 		if (maxspans) {
 			chan = zt_alloc_pseudo();
 			if (chan) {
@@ -1750,10 +3936,13 @@ static int zt_read(dev_t dev, struct uio *uiop, cred_t *credp)
 		return EINVAL;
 	}
 	
-	if (unit == 253) 
+	if (unit == ZT_DEV_TIMER) 
 		return EINVAL;
 	
-	if (unit == 254) {
+	if (unit >= ZT_DEV_MUX_BASE && unit < ZT_DEV_MUX_BASE + ZT_DEV_MUX_COUNT)
+		return zt_mux_read(dev, uiop, credp);
+
+	if (unit == ZT_DEV_CHANNEL) {
 #if 0
 // SL FIXME
 		chan = file->private_data;
@@ -1763,7 +3952,7 @@ static int zt_read(dev_t dev, struct uio *uiop, cred_t *credp)
 #endif
 	}
 	
-	if (unit == 255) {
+	if (unit == ZT_DEV_PSEUDO) {
 #if 0
 // SL Not needed?
 		chan = file->private_data;
@@ -1791,9 +3980,9 @@ static int zt_write(dev_t dev, struct uio *uiop, cred_t *credp)
 		return EINVAL;
 	if (uiop->uio_resid < 0)
 		return EINVAL;
-	if (unit == 253)
+	if (unit == ZT_DEV_TIMER)
 		return EINVAL;
-	if (unit == 254) {
+	if (unit == ZT_DEV_CHANNEL) {
 #if 0
 // SL FIXME
 		chan = file->private_data;
@@ -1803,7 +3992,7 @@ static int zt_write(dev_t dev, struct uio *uiop, cred_t *credp)
 #endif
 		return EINVAL;
 	}
-	if (unit == 255) {
+	if (unit == ZT_DEV_PSEUDO) {
 		return EINVAL;
 #if 0
 		chan = file->private_data;
@@ -2039,16 +4228,18 @@ static int zt_release(dev_t dev, int flag, int otyp, cred_t *credp)
 
 	if (!unit) 
 		return zt_ctl_release(dev, flag, otyp, credp);
-	if (unit >= ZT_DEV_TIMER_BASE && unit <= ZT_DEV_TIMER_BASE + ZT_DEV_TIMER_COUNT) {
+	if (unit >= ZT_DEV_TIMER_BASE && unit < ZT_DEV_TIMER_BASE + ZT_DEV_TIMER_COUNT) {
 		return zt_timer_release(dev, flag, otyp, credp);
 	}
-	if (unit >= ZT_DEV_CHAN_BASE && unit <= ZT_DEV_CHAN_BASE + ZT_DEV_CHAN_COUNT) {
+	if (unit >= ZT_DEV_MUX_BASE && unit < ZT_DEV_MUX_BASE + ZT_DEV_MUX_COUNT)
+		return zt_mux_release(dev, flag, otyp, credp);
+	if (unit >= ZT_DEV_CHAN_BASE && unit < ZT_DEV_CHAN_BASE + ZT_DEV_CHAN_COUNT) {
 		if (chan_map[unit - ZT_DEV_CHAN_BASE] < 0)
 			return zt_chan_release(dev, flag, otyp, credp);
 		else
 			return zt_specchan_release(dev, flag, otyp, credp);
 	}
-	if (unit == 253 || unit == 254 || unit == 255) {
+	if (unit == ZT_DEV_TIMER || unit == ZT_DEV_CHANNEL || unit == ZT_DEV_PSEUDO) {
 		/* Shouldn't happen, but just in case... */
 		return 0;
 	}
@@ -2083,7 +4274,8 @@ void zt_alarm_notify(struct zt_span *span)
 			zt_qevent_lock(&span->chans[x], j);
 		/* Switch to other master if current master in alarm */
 		for (x=1; x<maxspans; x++) {
-			if (spans[x] && !spans[x]->alarms && (spans[x]->flags & ZT_FLAG_RUNNING)) {
+			if (spans[x] && !spans[x]->alarms && (spans[x]->flags & ZT_FLAG_RUNNING) &&
+			    ZT_SPAN_TIMING(spans[x])) {
 				if(master != spans[x])
 					cmn_err(CE_CONT, "Zaptel: Master changed to %s\n", spans[x]->name);
 				master = spans[x];
@@ -2094,7 +4286,7 @@ void zt_alarm_notify(struct zt_span *span)
 }
 
 #define VALID_SPAN(j) do { \
-	if ((j >= ZT_MAX_SPANS) || (j < 1)) \
+	if ((j >= maxspans) || (j < 1)) \
 		return EINVAL; \
 	if (!spans[j]) \
 		return ENXIO; \
@@ -2108,17 +4300,78 @@ void zt_alarm_notify(struct zt_span *span)
 } while(0)
 
 #define VALID_CHANNEL(j) do { \
-	if ((j >= ZT_MAX_CHANNELS) || (j < 1)) \
+	if ((j >= maxchans) || (j < 1)) \
 		return EINVAL; \
 	if (!chans[j]) \
 		return ENXIO; \
 } while(0)
 
+/* ZT_TIMERSETUP: replace a descriptor's logical timers with count new ones */
+static int zt_timer_setup(struct zt_fdtimer *timer, int count)
+{
+	struct zt_ltimer *new = NULL, *old;
+	int x, oldcount;
+
+	if ((count < 0) || (count > ZT_MAX_TIMERS))
+		return EINVAL;
+	if (count) {
+		new = kmem_alloc(count * sizeof(struct zt_ltimer), KM_SLEEP);
+		for (x=0;x<count;x++)
+			zt_ltimer_init(&new[x], timer, x);
+	}
+	mutex_enter(&zt_fdwheel.lock);
+	__zt_fdtimer_stop(timer);
+	old = timer->timers;
+	oldcount = timer->ntimers;
+	timer->timers = new;
+	timer->ntimers = count;
+	mutex_exit(&zt_fdwheel.lock);
+	if (old)
+		kmem_free(old, oldcount * sizeof(struct zt_ltimer));
+	return 0;
+}
+
+/* ZT_TIMERGET: collect the logical timers that ran out, oldest first */
+static int zt_timer_get(struct zt_fdtimer *timer, intptr_t data, int mode)
+{
+	struct zt_timervec *tv;
+	struct zt_ltimer *lt;
+	int x, res = 0;
+
+	tv = kmem_alloc(sizeof(*tv), KM_SLEEP);
+	if (ddi_copyin((void *)data, tv, offsetof(struct zt_timervec, exp), mode)) {
+		res = EFAULT;
+		goto out;
+	}
+	if (tv->count < 0) {
+		res = EINVAL;
+		goto out;
+	}
+	if (tv->count > ZT_MAX_TIMERGET)
+		tv->count = ZT_MAX_TIMERGET;
+	mutex_enter(&zt_fdwheel.lock);
+	for (x=0;(x<tv->count) && (lt = timer->expired);x++) {
+		timer->expired = lt->nextexp;
+		tv->exp[x].id = lt->id;
+		tv->exp[x].tripped = lt->tripped;
+		lt->tripped = 0;
+	}
+	if (!timer->expired)
+		timer->exptail = &timer->expired;
+	mutex_exit(&zt_fdwheel.lock);
+	tv->count = x;
+	if (ddi_copyout(tv, (void *)data, offsetof(struct zt_timervec, exp[x]), mode))
+		res = EFAULT;
+out:
+	kmem_free(tv, sizeof(*tv));
+	return res;
+}
+
 static int zt_timer_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *credp, int *rvalp)
 {
 	int j;
-	unsigned long flags;
-	struct zt_timer	*timer;
+	struct zt_fdtimer *timer;
+	struct zt_timerset ts;
 
 	timer = chan_timer_map[getminor(dev) - ZT_DEV_TIMER_BASE];
 	
@@ -2130,40 +4383,57 @@ static int zt_timer_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *c
 		ddi_copyin((void *)data, &j, sizeof(int), mode);
 		if (j < 0)
 			j = 0;
-		mutex_enter(&zaptimerlock);
-		timer->ms = timer->pos = j;
-		mutex_exit(&zaptimerlock);
+		mutex_enter(&zt_fdwheel.lock);
+		__zt_ltimer_arm(&timer->one, j, j);
+		mutex_exit(&zt_fdwheel.lock);
 		break;
 	case ZT_TIMERACK:
 		ddi_copyin((void *)data, &j, sizeof(int), mode);
-		mutex_enter(&zaptimerlock);
-		if ((j < 1) || (j > timer->tripped))
-			j = timer->tripped;
-		timer->tripped -= j;
-		mutex_exit(&zaptimerlock);
+		mutex_enter(&zt_fdwheel.lock);
+		if ((j < 1) || (j > timer->one.tripped))
+			j = timer->one.tripped;
+		timer->one.tripped -= j;
+		mutex_exit(&zt_fdwheel.lock);
 		break;
 	case ZT_GETEVENT:  /* Get event on queue */
 		j = ZT_EVENT_NONE;
-		mutex_enter(&zaptimerlock);
+		mutex_enter(&zt_fdwheel.lock);
 		  /* set up for no event */
-		if (timer->tripped)
+		if (timer->one.tripped || timer->expired)
 			j = ZT_EVENT_TIMER_EXPIRED;
 		if (timer->ping)
 			j = ZT_EVENT_TIMER_PING;
-		mutex_exit(&zaptimerlock);
+		mutex_exit(&zt_fdwheel.lock);
 		ddi_copyout(&j, (void *)data, sizeof(int), mode);
 		break;
 	case ZT_TIMERPING:
-		mutex_enter(&zaptimerlock);
+		mutex_enter(&zt_fdwheel.lock);
 		timer->ping = 1;
-		mutex_exit(&zaptimerlock);
+		mutex_exit(&zt_fdwheel.lock);
 		pollwakeup(&timer->sel, POLLPRI|POLLERR);
 		break;
 	case ZT_TIMERPONG:
-		mutex_enter(&zaptimerlock);
+		mutex_enter(&zt_fdwheel.lock);
 		timer->ping = 0;
-		mutex_exit(&zaptimerlock);
+		mutex_exit(&zt_fdwheel.lock);
+		break;
+	case ZT_TIMERSETUP:
+		if (ddi_copyin((void *)data, &j, sizeof(int), mode))
+			return EFAULT;
+		return zt_timer_setup(timer, j);
+	case ZT_TIMERSET:
+		if (ddi_copyin((void *)data, &ts, sizeof(ts), mode))
+			return EFAULT;
+		mutex_enter(&zt_fdwheel.lock);
+		if ((ts.id < 0) || (ts.id >= timer->ntimers)) {
+			mutex_exit(&zt_fdwheel.lock);
+			return EINVAL;
+		}
+		__zt_ltimer_arm(&timer->timers[ts.id], ts.samples, ts.period);
+		mutex_exit(&zt_fdwheel.lock);
 		break;
+	case ZT_TIMERGET:
+		return zt_timer_get(timer, data, mode);
 	default:
 		return ENOTTY;
 	}
@@ -2181,6 +4451,7 @@ static int zt_common_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *
 #ifdef ALLOW_CHAN_DIAG
 	/* This structure is huge and will bork a 4k stack */
 	struct zt_chan mychan;
+	int itimer, otimer, ringdebtimer;
 	unsigned long flags;
 #endif	
 	int i,j;
@@ -2284,7 +4555,7 @@ static int zt_common_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *
 		   /* if zero, use current channel no */
 		if (!i) i = unit;
 		  /* make sure channel number makes sense */
-		if ((i < 0) || (i > ZT_MAX_CHANNELS) || !chans[i]) return(EINVAL);
+		if ((i < 0) || (i >= maxchans) || !chans[i]) return(EINVAL);
 		
 		if (!(chans[i]->flags & ZT_FLAG_AUDIO)) return (EINVAL);
 		stack.gain.chan = i; /* put the span # in here */
@@ -2302,33 +4573,14 @@ static int zt_common_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *
 		   /* if zero, use current channel no */
 		if (!i) i = unit;
 		  /* make sure channel number makes sense */
-		if ((i < 0) || (i > ZT_MAX_CHANNELS) || !chans[i]) return(EINVAL);
+		if ((i < 0) || (i >= maxchans) || !chans[i]) return(EINVAL);
 		if (!(chans[i]->flags & ZT_FLAG_AUDIO)) return (EINVAL);
-		if (!chans[i]->gainalloc) {
-			chans[i]->rxgain = kmem_alloc(512, KM_NOSLEEP);
-			if (!chans[i]->rxgain) {
-				chans[i]->rxgain = defgain;
-				return ENOMEM;
-			} else {
-				chans[i]->gainalloc = 1;
-				chans[i]->txgain = chans[i]->rxgain + 256;
-			}
-		}
 		stack.gain.chan = i; /* put the span # in here */
-		for (j=0;j<256;j++) {
-			chans[i]->rxgain[j] = stack.gain.rxgain[j];
-			chans[i]->txgain[j] = stack.gain.txgain[j];
-		}
-		if (!bcmp(chans[i]->rxgain, defgain, 256) && 
-		    !bcmp(chans[i]->txgain, defgain, 256)) {
-			/* This is really just a normal gain, so 
-			   deallocate the memory and go back to defaults */
-			if (chans[i]->gainalloc)
-				kmem_free(chans[i]->rxgain, 512);
-			chans[i]->rxgain = defgain;
-			chans[i]->txgain = defgain;
-			chans[i]->gainalloc = 0;
-		}
+		/* 0 dB drops back to defgain */
+		if (zt_chan_setgains(chans[i], stack.gain.rxgain, stack.gain.txgain))
+			return ENOMEM;
+		/* The idle pattern goes through the gain */
+		zt_update_idle(chans[i]);
 		if (ddi_copyout(&stack.gain, (void *)data, sizeof(stack.gain), mode))
 			return EIO;
 		break;
@@ -2377,18 +4629,21 @@ static int zt_common_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *
 		mutex_enter(&chans[j]->lock);
 		/* make static copy of channel */
 		bcopy(chans[j],&mychan,sizeof(struct zt_chan));
+		itimer = zt_timer_left(&chans[j]->itimer);
+		otimer = zt_timer_left(&chans[j]->otimer);
+		ringdebtimer = zt_timer_left(&chans[j]->ringdebtimer);
 		/* let irq's go */
 		chan_unlock(chans[j]);
 		cmn_err(CE_CONT, "Dump of Zaptel Channel %d (%s,%d,%d):\n\n",j,
 			mychan.name,mychan.channo,mychan.chanpos);
 		cmn_err(CE_CONT, "flags: %x hex, writechunk: %08lx, readchunk: %08lx\n",
 			mychan.flags, (long) mychan.writechunk, (long) mychan.readchunk);
-		cmn_err(CE_CONT, "rxgain: %08lx, txgain: %08lx, gainalloc: %d\n",
-			(long) mychan.rxgain, (long)mychan.txgain, mychan.gainalloc);
+		cmn_err(CE_CONT, "rxgain: %08lx, txgain: %08lx, gaintab: %08lx\n",
+			(long) mychan.rxgain, (long)mychan.txgain, (long) mychan.gaintab);
 		cmn_err(CE_CONT, "span: %08lx, sig: %x hex, sigcap: %x hex\n",
 			(long)mychan.span, mychan.sig, mychan.sigcap);
-		cmn_err(CE_CONT, "inreadbuf: %d, outreadbuf: %d, inwritebuf: %d, outwritebuf: %d\n",
-			mychan.inreadbuf, mychan.outreadbuf, mychan.inwritebuf, mychan.outwritebuf);
+		cmn_err(CE_CONT, "rxhead: %u, rxtail: %u, txhead: %u, txtail: %u\n",
+			mychan.rxhead, mychan.rxtail, mychan.txhead, mychan.txtail);
 		cmn_err(CE_CONT, "blocksize: %d, numbufs: %d, txbufpolicy: %d, txbufpolicy: %d\n",
 			mychan.blocksize, mychan.numbufs, mychan.txbufpolicy, mychan.rxbufpolicy);
 		cmn_err(CE_CONT, "txdisable: %d, rxdisable: %d, iomask: %d\n",
@@ -2400,12 +4655,14 @@ static int zt_common_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *
 				mychan.afterdialingtimer, mychan.cadencepos);
 		cmn_err(CE_CONT, "confna: %d, confn: %d, confmode: %d, confmute: %d\n",
 			mychan.confna, mychan._confn, mychan.confmode, mychan.confmute);
-		cmn_err(CE_CONT, "ec: %08lx, echocancel: %d, deflaw: %d, xlaw: %08lx\n",
-			(long) mychan.ec, mychan.echocancel, mychan.deflaw, (long) mychan.xlaw);
+		cmn_err(CE_CONT, "ec: %08lx (%s), echocancel: %d, deflaw: %d, xlaw: %08lx\n",
+			(long) mychan.ec, mychan.ec ? mychan.ecengine->name : "none",
+			mychan.echocancel, mychan.deflaw, (long) mychan.xlaw);
 		cmn_err(CE_CONT, "echostate: %02x, echotimer: %d, echolastupdate: %d\n",
 			(int) mychan.echostate, mychan.echotimer, mychan.echolastupdate);
+		cmn_err(CE_CONT, "pipeline: %s\n", zt_pipelines[mychan.pipeline].name);
 		cmn_err(CE_CONT, "itimer: %d, otimer: %d, ringdebtimer: %d\n\n",
-			mychan.itimer,mychan.otimer,mychan.ringdebtimer);
+			itimer,otimer,ringdebtimer);
 #if 0
 		if (mychan.ec) {
 			int x;
@@ -2486,10 +4743,31 @@ static int zt_ctl_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cre
 	struct zt_dialparams tdp;
 	struct zt_maintinfo maint;
 	struct zt_indirect_data ind;
+	struct zt_bufvec bv;
+	struct zt_ecpool_stats ecs;
+	struct zt_ecengines ece;
 	unsigned long flags;
 	int rv;
 
 	switch(cmd) {
+	case ZT_GETECPOOL:
+		zt_ecpool_getstats(&ecs);
+		if (ddi_copyout(&ecs, (void *)data, sizeof(ecs), mode))
+			return EFAULT;
+		return 0;
+	case ZT_GETECENGINES:
+		zt_ec_getengines(&ece);
+		if (ddi_copyout(&ece, (void *)data, sizeof(ece), mode))
+			return EFAULT;
+		return 0;
+	case ZT_BUFVEC:
+		if (ddi_copyin((void *)data, &bv, sizeof(bv), mode))
+			return EFAULT;
+		if ((rv = zt_bufvec(&bv, mode)))
+			return rv;
+		if (ddi_copyout(&bv, (void *)data, sizeof(bv), mode))
+			return EFAULT;
+		return 0;
 	case ZT_INDIRECT:
 		if (ddi_copyin((void *)data, &ind, sizeof(ind), mode))
 			return EFAULT;
@@ -2535,7 +4813,7 @@ static int zt_ctl_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cre
 		VALID_CHANNEL(ch.chan);
 		if (ch.sigtype == ZT_SIG_SLAVE) {
 			/* We have to use the master's sigtype */
-			if ((ch.master < 1) || (ch.master >= ZT_MAX_CHANNELS))
+			if ((ch.master < 1) || (ch.master >= maxchans))
 				return EINVAL;
 			if (!chans[ch.master])
 				return EINVAL;
@@ -2543,10 +4821,13 @@ static int zt_ctl_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cre
 			newmaster = chans[ch.master];
 		} else if ((ch.sigtype & __ZT_SIG_DACS) == __ZT_SIG_DACS) {
 			newmaster = chans[ch.chan];
-			if ((ch.idlebits < 1) || (ch.idlebits >= ZT_MAX_CHANNELS))
+			if ((ch.idlebits < 1) || (ch.idlebits >= maxchans))
 				return EINVAL;
 			if (!chans[ch.idlebits])
 				return EINVAL;
+			/* Cross connects run on 1 ms ticks */
+			if (ZT_CHAN_MULTICHUNK(chans[ch.chan]) || ZT_CHAN_MULTICHUNK(chans[ch.idlebits]))
+				return EINVAL;
 		} else {
 			newmaster = chans[ch.chan];
 		}
@@ -2633,7 +4914,18 @@ static int zt_ctl_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cre
 #if CONFIG_ZAPATA_DEBUG
 		cmn_err(CE_CONT, "Configured channel %s, flags %04x, sig %04x\n", chans[ch.chan]->name, chans[ch.chan]->flags, chans[ch.chan]->sig);
 #endif		
+		zt_chan_pipeline(chans[ch.chan]);
 		chan_unlock(chans[ch.chan]);
+		/* DACS channels come up in a conference mode */
+		mutex_enter(&bigzaplock);
+		__zt_update_active(chans[ch.chan]);
+		__zt_update_idle(chans[ch.chan]);
+		if (newmaster)
+			__zt_update_idle(newmaster);
+		/* A DACS peer is monitored now */
+		__zt_update_idleno(chans[ch.chan]->confna);
+		__zt_snap_publish();
+		mutex_exit(&bigzaplock);
 		return res;
 	case ZT_SFCONFIG:
 		if (ddi_copyin((void *)data, &sf, sizeof(sf), mode))
@@ -2708,7 +5000,7 @@ static int zt_ctl_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cre
 		if (ddi_copyin((void *)data, &maint, sizeof(maint), mode))
 			return EIO;
 		/* must be valid span number */
-		if ((maint.spanno < 1) || (maint.spanno > ZT_MAX_SPANS) || (!spans[maint.spanno]))
+		if ((maint.spanno < 1) || (maint.spanno >= maxspans) || (!spans[maint.spanno]))
 			return EINVAL;
 		if (!spans[maint.spanno]->maint)
 			return ENOSYS;
@@ -2764,7 +5056,9 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		struct zt_bufferinfo bi;
 		struct zt_confinfo conf;
 		struct zt_ring_cadence cad;
+		struct zt_ring_params rp;
 	} stack;
+	struct zt_gaintab *gaintab;
 	unsigned long flags, flagso;
 	int i, j, k, rv;
 	int ret, c, unit;
@@ -2845,6 +5139,19 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		if ((rv = zt_reallocbufs(chan,  stack.bi.bufsize, stack.bi.numbufs)))
 			return (rv);
 		break;
+	case ZT_RING_SETUP:
+		if (ddi_copyin((void *)data, &stack.rp, sizeof(stack.rp), mode))
+			return EFAULT;
+		if (!stack.rp.slots) {
+			stack.rp.size = 0;
+			rv = zt_ring_release(chan, 0);
+		} else
+			rv = zt_ring_setup(chan, stack.rp.slots, &stack.rp.size);
+		if (rv)
+			return rv;
+		if (ddi_copyout(&stack.rp, (void *)data, sizeof(stack.rp), mode))
+			return EFAULT;
+		break;
 	case ZT_GET_BLOCKSIZE:  /* get blocksize */
 		ddi_copyout(&chan->blocksize, (void *)data, sizeof(int), mode);
 		break;
@@ -2861,12 +5168,16 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		break;
 	case ZT_FLUSH:  /* flush input buffer, output buffer, and/or event queue */
 		ddi_copyin((void *)data, &i, sizeof(int), mode);
+		/* Not while a reader or writer is in the middle of a buffer */
+		if (i & ZT_FLUSH_READ)
+			mutex_enter(&chan->readlock);
+		if (i & ZT_FLUSH_WRITE)
+			mutex_enter(&chan->writelock);
 		mutex_enter(&chan->lock);
 		if (i & ZT_FLUSH_READ)  /* if for read (input) */
 		   {
 			  /* initialize read buffers and pointers */
-			chan->inreadbuf = 0;
-			chan->outreadbuf = -1;
+			chan->rxhead = chan->rxtail = 0;
 			for (j=0;j<chan->numbufs;j++) {
 				/* Do we need this? */
 				chan->readn[j] = 0;
@@ -2874,20 +5185,19 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			}
 			if (debug) cmn_err(CE_CONT, "ZT_FLUSH waking %lx\n", &chan->sel);
 			cv_broadcast(&chan->readbufq);  /* wake_up_interruptible waiting on read */
-			pollwakeup(&chan->sel, POLLIN);
+			zt_pollwakeup(chan, POLLIN);
 		   }
 		if (i & ZT_FLUSH_WRITE) /* if for write (output) */
 		   {
 			  /* initialize write buffers and pointers */
-			chan->outwritebuf = -1;
-			chan->inwritebuf = 0;
+			chan->txhead = chan->txtail = 0;
 			for (j=0;j<chan->numbufs;j++) {
 				/* Do we need this? */
 				chan->writen[j] = 0;
 				chan->writeidx[j] = 0;
 			}
 			cv_broadcast(&chan->writebufq); /* wake_up_interruptible waiting on write */
-			pollwakeup(&chan->sel, POLLOUT);
+			zt_pollwakeup(chan, POLLOUT);
 			   /* if IO MUX wait on write empty, well, this
 				certainly *did* empty the write */
 			if (chan->iomask & ZT_IOMUX_WRITEEMPTY)
@@ -2895,17 +5205,21 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		   }
 		if (i & ZT_FLUSH_EVENT) /* if for events */
 		   {
-			   /* initialize the event pointers */
-			chan->eventinidx = chan->eventoutidx = 0;
+			   /* throw away the queued events */
+			zt_event_flush(chan);
 		   }
 		chan_unlock(chan);
+		if (i & ZT_FLUSH_WRITE)
+			mutex_exit(&chan->writelock);
+		if (i & ZT_FLUSH_READ)
+			mutex_exit(&chan->readlock);
 		break;
 	case ZT_SYNC:  /* wait for no tx */
 		mutex_enter(&chan->lock);
 		for(;;)  /* loop forever */
 		   {
 			  /* Know if there is a write pending */
-			i = (chan->outwritebuf > -1);
+			i = ZT_TXBUF_READY(chan);
 			if (!i) break; /* skip if none */
 			cv_wait(&chan->writebufq, &chan->lock);
 			// rv = schluffen(&chan->writebufq);
@@ -2925,13 +5239,13 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			if (chan->iomask & ZT_IOMUX_READ)
 			   {
 				/* if read available */
-				if ((chan->outreadbuf > -1)  && !chan->rxdisable)
+				if (ZT_RXBUF_READY(chan) && !chan->rxdisable)
 					ret |= ZT_IOMUX_READ;
 			   }
 			  /* if looking for write avail */
 			if (chan->iomask & ZT_IOMUX_WRITE)
 			   {
-				if (chan->inwritebuf > -1)
+				if (ZT_TXBUF_ROOM(chan))
 					ret |= ZT_IOMUX_WRITE;
 			   }
 			  /* if looking for write empty */
@@ -2939,14 +5253,14 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			   {
 				  /* if everything empty -- be sure the transmitter is enabled */
 				chan->txdisable = 0;
-				if (chan->outwritebuf < 0)
+				if (!ZT_TXBUF_READY(chan))
 					ret |= ZT_IOMUX_WRITEEMPTY;
 			   }
 			  /* if looking for signalling event */
 			if (chan->iomask & ZT_IOMUX_SIGEVENT)
 			   {
 				  /* if event */
-				if (chan->eventinidx != chan->eventoutidx)
+				if (ZT_EVENT_READY(chan))
 					ret |= ZT_IOMUX_SIGEVENT;
 			   }
 			  /* if something to return, or not to wait */
@@ -2965,27 +5279,20 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		chan->iomask = 0;
 		break;
 	case ZT_GETEVENT:  /* Get event on queue */
-		  /* set up for no event */
-		j = ZT_EVENT_NONE;
+		  /* ZT_EVENT_NONE if the queue is empty */
 		mutex_enter(&chan->lock);
-		  /* if some event in queue */
-		if (chan->eventinidx != chan->eventoutidx)
-		   {
-			j = chan->eventbuf[chan->eventoutidx++];
-			  /* get the data, bump index */
-			  /* if index overflow, set to beginning */
-			if (chan->eventoutidx >= ZT_MAX_EVENTSIZE)
-				chan->eventoutidx = 0;
-		   }		
+		j = zt_event_get(chan, NULL);
 		chan_unlock(chan);
 		ddi_copyout(&j, (void *)data, sizeof(int), mode);
 		break;
+	case ZT_GETEVENTS:  /* Get a batch of events */
+		return zt_getevents(chan, data, mode);
 	case ZT_CONFMUTE:  /* set confmute flag */
 		ddi_copyin((void *)data, &j, sizeof(int), mode);
 		if (!(chan->flags & ZT_FLAG_AUDIO)) return (EINVAL);
-		mutex_enter(&bigzaplock);
+		mutex_enter(&chan->lock);
 		chan->confmute = j;
-		mutex_exit(&bigzaplock);
+		chan_unlock(chan);
 		break;
 	case ZT_GETCONFMUTE:  /* get confmute flag */
 		if (!(chan->flags & ZT_FLAG_AUDIO)) return (EINVAL);
@@ -3020,7 +5327,7 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		   /* if zero, use current channel no */
 		if (!i) i = chan->channo;
 		  /* make sure channel number makes sense */
-		if ((i < 0) || (i > ZT_MAX_CONF) || (!chans[i])) return(EINVAL);
+		if ((i < 0) || (i >= maxchans) || (!chans[i])) return(EINVAL);
 		if (!(chans[i]->flags & ZT_FLAG_AUDIO)) return (EINVAL);
 		stack.conf.chan = i;  /* get channel number */
 		stack.conf.confno = chans[i]->confna;  /* get conference number */
@@ -3033,11 +5340,11 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		   /* if zero, use current channel no */
 		if (!i) i = chan->channo;
 		  /* make sure channel number makes sense */
-		if ((i < 1) || (i > ZT_MAX_CHANNELS) || (!chans[i])) return(EINVAL);
+		if ((i < 1) || (i >= maxchans) || (!chans[i])) return(EINVAL);
 		if (!(chans[i]->flags & ZT_FLAG_AUDIO)) return (EINVAL); 
 		if (stack.conf.confmode && ((stack.conf.confmode & ZT_CONF_MODE_MASK) < 4)) {
 			/* Monitor mode -- it's a channel */
-			if ((stack.conf.confno < 0) || (stack.conf.confno >= ZT_MAX_CHANNELS) || !chans[stack.conf.confno]) return(EINVAL);
+			if ((stack.conf.confno < 0) || (stack.conf.confno >= maxchans) || !chans[stack.conf.confno]) return(EINVAL);
 		} else {
 			  /* make sure conf number makes sense, too */
 			if ((stack.conf.confno < -1) || (stack.conf.confno > ZT_MAX_CONF)) return(EINVAL);
@@ -3045,6 +5352,11 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			
 		  /* if taking off of any conf, must have 0 mode */
 		if ((!stack.conf.confno) && stack.conf.confmode) return(EINVAL);
+		  /* conferences run on 1 ms ticks */
+		if (stack.conf.confmode && (ZT_CHAN_MULTICHUNK(chans[i]) ||
+		    (((stack.conf.confmode & ZT_CONF_MODE_MASK) < 4) &&
+		     ZT_CHAN_MULTICHUNK(chans[stack.conf.confno]))))
+			return (EINVAL);
 		  /* likewise if 0 mode must have no conf */
 		if ((!stack.conf.confmode) && stack.conf.confno) return (EINVAL);
 		stack.conf.chan = i;  /* return with real channel # */
@@ -3067,6 +5379,7 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		j = chans[i]->confna;  /* save old conference number */
 		chans[i]->confna = stack.conf.confno;   /* set conference number */
 		chans[i]->confmode = stack.conf.confmode;  /* set conference mode */
+		zt_chan_pipeline(chans[i]);
 		chans[i]->_confn = 0;		     /* Clear confn */
 		zt_check_conf(j);
 		zt_check_conf(stack.conf.confno);
@@ -3077,7 +5390,13 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			/* Get alias */
 			chans[i]->_confn = zt_get_conf_alias(stack.conf.confno);
 		}
+		__zt_update_active(chans[i]);
+		__zt_update_idle(chans[i]);
+		/* The channel it monitored and the one it monitors now */
+		__zt_update_idleno(j);
+		__zt_update_idleno(stack.conf.confno);
 		chan_unlock(chan);
+		__zt_snap_publish();
 		mutex_exit(&bigzaplock);
 		ddi_copyout(&stack.conf, (void *)data, sizeof(stack.conf), mode);
 		break;
@@ -3098,6 +5417,7 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			bzero(conf_links,sizeof(conf_links));
 			recalc_maxlinks();
 			chan_unlock(chan);
+			__zt_snap_publish();
 			mutex_exit(&bigzaplock);
 			break;
 		   }
@@ -3149,6 +5469,7 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		   }
 		recalc_maxlinks();
 		chan_unlock(chan);
+		__zt_snap_publish();
 		mutex_exit(&bigzaplock);
 		return(rv);
 	case ZT_CONFDIAG:  /* output diagnostic info to console */
@@ -3158,7 +5479,7 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		for(i = ((j) ? j : 1); i <= ((j) ? j : ZT_MAX_CONF); i++)
 		   {
 			c = 0;
-			for(k = 1; k < ZT_MAX_CHANNELS; k++)
+			for(k = 1; k < maxchans; k++)
 			   {
 				  /* skip if no pointer */
 				if (!chans[k]) continue;
@@ -3183,6 +5504,8 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 			   }
 			if (c) cmn_err(CE_CONT, "\n");
 		   }
+		cmn_err(CE_CONT, "Conference sums touched: %d (max %d)\n",
+			zt_conf_touched, zt_conf_touched_max);
 		break;
 	case ZT_CHANNO:  /* get channel number of stream */
 		ddi_copyout(&unit, (void *)data, sizeof(int), mode);
@@ -3192,6 +5515,11 @@ static int zt_chanandpseudo_ioctl(dev_t dev, int cmd, intptr_t data, int mode, c
 		if ((j < 0) || (j > ZT_LAW_ALAW))
 			return EINVAL;
 		zt_set_law(chan, j);
+		/* Rebuild rxlin[] for the new law */
+		gaintab = chan->gaintab;
+		if (gaintab && (gaintab->xlaw != chan->xlaw) &&
+		    zt_chan_setgains(chan, gaintab->rxgain, gaintab->txgain))
+			return ENOMEM;
 		break;
 	case ZT_SETLINEAR:
 		ddi_copyin((void *)data, &j, sizeof(int), mode);
@@ -3259,11 +5587,12 @@ static int zt_chan_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cr
 	int j, rv;
 	int ret;
 	int oldconf;
-	void *rxgain=NULL;
-	echo_can_state_t *ec, *tec;
+	struct zt_gaintab *gaintab;
+	struct zt_ec_engine *eng, *teng;
+	void *ec, *tec;
 	int unit = getminor(dev) - ZT_DEV_CHAN_BASE;
 
-	if (unit < 0 || unit > ZT_DEV_CHAN_COUNT)
+	if (unit < 0 || unit >= nchanmap)
 		return ENOSYS;
 
 	if (chan_map[unit] < 0)
@@ -3320,23 +5649,21 @@ static int zt_chan_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cr
 			bzero(chan->conflast1, sizeof(chan->conflast1));
 			bzero(chan->conflast2, sizeof(chan->conflast2));
 			ec = chan->ec;
+			eng = chan->ecengine;
 			chan->ec = NULL;
 			/* release conference resource, if any to release */
 			reset_conf(chan);
-			if (chan->gainalloc && chan->rxgain)
-				rxgain = chan->rxgain;
-			else
-				rxgain = NULL;
-
+			gaintab = chan->gaintab;
+			chan->gaintab = NULL;
 			chan->rxgain = defgain;
 			chan->txgain = defgain;
-			chan->gainalloc = 0;
+			zt_chan_pipeline(chan);
 			chan_unlock(chan);
 
-			if (rxgain)
-				kmem_free(rxgain,512);
+			if (gaintab)
+				zt_gaintab_put(gaintab);
 			if (ec)
-				echo_can_free(ec);
+				zt_ec_put(eng, ec);
 			if (oldconf) zt_check_conf(oldconf);
 		}
 		break;
@@ -3369,41 +5696,41 @@ static int zt_chan_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *cr
 			return EINVAL;
 		ddi_copyin((void *)data, &j, sizeof(int), mode);
 		if (j) {
-			if ((j == 32) ||
-			    (j == 64) ||
-			    (j == 128) ||
-			    (j == 256)) {
-				/* Okay */
-			} else {
-				j = deftaps;
-			}
-			ec = echo_can_create(j, 0);
+			eng = zt_ec_pick(chan, j, &j);
+			if (!eng)
+				return EINVAL;
+			ec = zt_ec_get(eng, j);
 			if (!ec)
 				return ENOMEM;
 			mutex_enter(&chan->lock);
 			/* If we had an old echo can, zap it now */
 			tec = chan->ec;
+			teng = chan->ecengine;
 			chan->echocancel = j;
 			chan->ec = ec;
+			chan->ecengine = eng;
 			chan->echostate = ECHO_STATE_IDLE;
 			chan->echolastupdate = 0;
 			chan->echotimer = 0;
 			echo_can_disable_detector_init(&chan->txecdis);
 			echo_can_disable_detector_init(&chan->rxecdis);
+			zt_chan_pipeline(chan);
 			chan_unlock(chan);
 			if (tec)
-				echo_can_free(tec);
+				zt_ec_put(teng, tec);
 		} else {
 			mutex_enter(&chan->lock);
 			tec = chan->ec;
+			teng = chan->ecengine;
 			chan->echocancel = 0;
 			chan->ec = NULL;
 			chan->echostate = ECHO_STATE_IDLE;
 			chan->echolastupdate = 0;
 			chan->echotimer = 0;
+			zt_chan_pipeline(chan);
 			chan_unlock(chan);
 			if (tec)
-				echo_can_free(tec);
+				zt_ec_put(teng, tec);
 		}
 		break;
 	case ZT_ECHOTRAIN:
@@ -3554,7 +5881,7 @@ static int zt_prechan_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t
 		// cmn_err(CE_CONT, "ZT_SPECIFY channo = %d\n", channo);
 		if (channo < 1)
 			return EINVAL;
-		if (channo > ZT_MAX_CHANNELS)
+		if (channo >= maxchans)
 			return EINVAL;
 		newdev = makedevice(getmajor(dev), channo);
 		res = zt_specchan_open(&newdev, 0, 0, NULL);
@@ -3574,7 +5901,6 @@ static int zt_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *credp,
 {
 	int unit = getminor(dev);
 	struct zt_chan *chan;
-	struct zt_timer *timer;
 
 	if (unit == 0)
 		return zt_ctl_ioctl(dev, cmd, data, mode, credp, rvalp);
@@ -3595,24 +5921,26 @@ static int zt_ioctl(dev_t dev, int cmd, intptr_t data, int mode, cred_t *credp,
 	}
 	*/
 	
-	if (unit == 253) {
+	if (unit == ZT_DEV_TIMER) {
 		/* Shouldn't happen - unit will have been replaced in open */
 		return EINVAL;
 	}
-	if (unit >= ZT_DEV_TIMER_BASE && unit <= (ZT_DEV_TIMER_BASE + ZT_DEV_TIMER_COUNT)) {
+	if (unit >= ZT_DEV_TIMER_BASE && unit < (ZT_DEV_TIMER_BASE + ZT_DEV_TIMER_COUNT)) {
 		return zt_timer_ioctl(dev, cmd, data, mode, credp, rvalp);
 	}
-	if (unit == 254) {
+	if (unit >= ZT_DEV_MUX_BASE && unit < ZT_DEV_MUX_BASE + ZT_DEV_MUX_COUNT)
+		return zt_mux_ioctl(dev, cmd, data, mode, credp, rvalp);
+	if (unit == ZT_DEV_CHANNEL) {
 		/* Shouldn't happen - unit will have been replaced in open */
 		return EINVAL;
 	}
-	if (unit >= ZT_DEV_CHAN_BASE && unit <= (ZT_DEV_CHAN_BASE + ZT_DEV_CHAN_COUNT)) {
+	if (unit >= ZT_DEV_CHAN_BASE && unit < (ZT_DEV_CHAN_BASE + ZT_DEV_CHAN_COUNT)) {
 		if (chan_map[unit - ZT_DEV_CHAN_BASE] > 0)
 			return zt_chan_ioctl(dev, cmd, data, mode, credp, rvalp);
 		else
 			return zt_prechan_ioctl(dev, cmd, data, mode, credp, rvalp);
 	}
-	if (unit == 255) {
+	if (unit == ZT_DEV_PSEUDO) {
 		/* Shouldn't happen - unit will have been replaced in open */
 		return EINVAL;
 	}
@@ -3638,20 +5966,45 @@ int zt_register(struct zt_span *span, int prefmaster)
 			cmn_err(CE_CONT, "Span %s already in list\n", span->name);
 			return EBUSY;
 		}
-	for (x=1;x<ZT_MAX_SPANS;x++)
+	if (!span->chunksize)
+		span->chunksize = ZT_CHUNKSIZE;
+	if ((span->chunksize < ZT_CHUNKSIZE) || (span->chunksize > ZT_MAX_SPAN_CHUNKSIZE) ||
+	    (span->chunksize % ZT_CHUNKSIZE)) {
+		cmn_err(CE_CONT, "Span %s has unsupported chunk size %d\n", span->name, span->chunksize);
+		return EINVAL;
+	}
+	if (span->chunksize > ZT_CHUNKSIZE) {
+		/* sreadchunk/swritechunk only hold ZT_MAX_CHUNKSIZE */
+		for (x=0;x<span->channels;x++) {
+			if (!span->chans[x].readchunk || !span->chans[x].writechunk) {
+				cmn_err(CE_CONT, "Span %s needs its own chunk buffers for %d samples\n", span->name, span->chunksize);
+				return EINVAL;
+			}
+		}
+	}
+	rw_enter(&chan_lock, RW_WRITER);
+	for (x=1;x<maxspans;x++)
 		if (!spans[x])
 			break;
 	if (x < ZT_MAX_SPANS) {
+		if (x >= nspans)
+			nspans = __zt_tab_grow((void **)&spans, nspans, x + 1,
+				ZT_SPANTAB_MIN, ZT_MAX_SPANS, sizeof(struct zt_span *));
 		spans[x] = span;
 		if (maxspans < x + 1)
 			maxspans = x + 1;
+		rw_exit(&chan_lock);
 	} else {
+		rw_exit(&chan_lock);
 		cmn_err(CE_CONT, "Too many zapata spans registered\n");
 		return EBUSY;
 	}
 	span->flags |= ZT_FLAG_REGISTERED;
 	span->spanno = x;
 	mutex_init(&span->lock, NULL, MUTEX_DRIVER, NULL);
+	zt_wheel_init(&span->rxwheel);
+	zt_wheel_init(&span->txwheel);
+	span->idlemap = kmem_zalloc(ZT_IDLEMAP_WORDS(span->channels) * sizeof(uint32_t), KM_SLEEP);
 	if (!span->deflaw) {
 		cmn_err(CE_CONT, "zaptel: Span %s didn't specify default law.  Assuming mulaw, please fix driver!\n", span->name);
 		span->deflaw = ZT_LAW_MULAW;
@@ -3661,9 +6014,13 @@ int zt_register(struct zt_span *span, int prefmaster)
 		span->chans[x].span = span;
 		zt_chan_reg(&span->chans[x]); 
 	}
+	mutex_enter(&bigzaplock);
+	for (x=0;x<span->channels;x++)
+		__zt_update_idle(&span->chans[x]);
+	mutex_exit(&bigzaplock);
 
 	cmn_err(CE_CONT, "Registered Span %d ('%s') with %d channels\n", span->spanno, span->name, span->channels);
-	if (!master || prefmaster) {
+	if ((!master || prefmaster) && ZT_SPAN_TIMING(span)) {
 		master = span;
 		cmn_err(CE_CONT, "Span ('%s') is new master\n", span->name);
 	}
@@ -3672,7 +6029,8 @@ int zt_register(struct zt_span *span, int prefmaster)
 
 int zt_unregister(struct zt_span *span)
 {
-	int x;
+	uint32_t *idlemap;
+	int x, n;
 
 	if (!(span->flags & ZT_FLAG_REGISTERED)) {
 		cmn_err(CE_CONT, "Span %s does not appear to be registered\n", span->name);
@@ -3694,144 +6052,55 @@ int zt_unregister(struct zt_span *span)
 	span->flags &= ~ZT_FLAG_REGISTERED;
 	for (x=0;x<span->channels;x++)
 		zt_chan_unreg(&span->chans[x]);
-	maxspans = 0;
+	mutex_enter(&bigzaplock);
+	__zt_snap_publish();
+	idlemap = span->idlemap;
+	span->idlemap = NULL;
+	mutex_exit(&bigzaplock);
+	/* The driver frees the channels once we return */
+	zt_snap_sync();
+	if (idlemap)
+		kmem_free(idlemap, ZT_IDLEMAP_WORDS(span->channels) * sizeof(uint32_t));
 	if (master == span)
 		master = NULL;
-	for (x=1;x<ZT_MAX_SPANS;x++) {
+	rw_enter(&chan_lock, RW_WRITER);
+	n = 0;
+	for (x=1;x<maxspans;x++) {
 		if (spans[x]) {
-			maxspans = x+1;
-			if (!master)
+			n = x+1;
+			if (!master && ZT_SPAN_TIMING(spans[x]))
 				master = spans[x];
 		}
 	}
+	maxspans = n;
+	rw_exit(&chan_lock);
 
 	return 0;
 }
 
-/*
-** This routine converts from linear to ulaw
-**
-** Craig Reese: IDA/Supercomputing Research Center
-** Joe Campbell: Department of Defense
-** 29 September 1989
-**
-** References:
-** 1) CCITT Recommendation G.711  (very difficult to follow)
-** 2) "A New Digital Technique for Implementation of Any
-**     Continuous PCM Companding Law," Villeret, Michel,
-**     et al. 1973 IEEE Int. Conf. on Communications, Vol 1,
-**     1973, pg. 11.12-11.17
-** 3) MIL-STD-188-113,"Interoperability and Performance Standards
-**     for Analog-to_Digital Conversion Techniques,"
-**     17 February 1987
-**
-** Input: Signed 16 bit linear sample
-** Output: 8 bit ulaw sample
-*/
-
-#define ZEROTRAP    /* turn on the trap as per the MIL-STD */
-#define BIAS 0x84   /* define the add-in bias for 16 bit samples */
-#define CLIP 32635
-
-#ifdef CONFIG_CALC_XLAW
-unsigned char
-#else
-static unsigned char 
-#endif
-__zt_lineartoulaw(short sample)
-{
-  static int exp_lut[256] = {0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3,
-                             4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
-                             5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-                             5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-                             6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-                             6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-                             6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-                             6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-                             7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7};
-  int sign, exponent, mantissa;
-  unsigned char ulawbyte;
-
-  /* Get the sample into sign-magnitude. */
-  sign = (sample >> 8) & 0x80;          /* set aside the sign */
-  if (sign != 0) sample = -sample;              /* get magnitude */
-  if (sample > CLIP) sample = CLIP;             /* clip the magnitude */
-
-  /* Convert from 16 bit linear to ulaw. */
-  sample = sample + BIAS;
-  exponent = exp_lut[(sample >> 7) & 0xFF];
-  mantissa = (sample >> (exponent + 3)) & 0x0F;
-  ulawbyte = ~(sign | (exponent << 4) | mantissa);
-#ifdef ZEROTRAP
-  if (ulawbyte == 0) ulawbyte = 0x02;   /* optional CCITT trap */
-#endif
-  if (ulawbyte == 0xff) ulawbyte = 0x7f;   /* never return 0xff */
-  return(ulawbyte);
-}
-
-#define AMI_MASK 0x55
-
-#ifdef CONFIG_CALC_XLAW
-unsigned char
-#else
-static inline unsigned char 
-#endif
-__zt_lineartoalaw (short linear)
-{
-    int mask;
-    int seg;
-    int pcm_val;
-    static int seg_end[8] =
-    {
-         0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF, 0x3FFF, 0x7FFF
-    };
-    
-    pcm_val = linear;
-    if (pcm_val >= 0)
-    {
-        /* Sign (7th) bit = 1 */
-        mask = AMI_MASK | 0x80;
-    }
-    else
-    {
-        /* Sign bit = 0 */
-        mask = AMI_MASK;
-        pcm_val = -pcm_val;
-    }
-
-    /* Convert the scaled magnitude to segment number. */
-    for (seg = 0;  seg < 8;  seg++)
-    {
-        if (pcm_val <= seg_end[seg])
-	    break;
-    }
-    /* Combine the sign, segment, and quantization bits. */
-    return  ((seg << 4) | ((pcm_val >> ((seg)  ?  (seg + 3)  :  4)) & 0x0F)) ^ mask;
-}
-/*- End of function --------------------------------------------------------*/
+#include "xlaw.h"
 
-static inline short int alaw2linear (uint8_t alaw)
+/* Encode n linear samples in the channel's law */
+static void zt_lin2x(struct zt_chan *chan, short *lin, u_char *xbuf, int n)
 {
-    int i;
-    int seg;
+	int x;
 
-    alaw ^= AMI_MASK;
-    i = ((alaw & 0x0F) << 4);
-    seg = (((int) alaw & 0x70) >> 4);
-    if (seg)
-        i = (i + 0x100) << (seg - 1);
-    return (short int) ((alaw & 0x80)  ?  i  :  -i);
+	if (zt_xlawenc == ZT_XLAWENC_CALC) {
+		if (chan->xlaw == __zt_alaw) {
+			for (x=0;x<n;x++)
+				xbuf[x] = __zt_calc_lin2a(lin[x]);
+		} else {
+			for (x=0;x<n;x++)
+				xbuf[x] = __zt_calc_lin2mu(lin[x]);
+		}
+		return;
+	}
+	for (x=0;x<n;x++)
+		xbuf[x] = ZT_LIN2X(lin[x], chan);
 }
-/*- End of function --------------------------------------------------------*/
 static void  zt_conv_init(void)
 {
+	static char *encnames[] = { "table", "computed" };
 	int i;
 
 	/* 
@@ -3860,8 +6129,69 @@ static void  zt_conv_init(void)
 		__zt_lin2mu[((unsigned short)(short)i) >> 2] = __zt_lineartoulaw(i);
 		__zt_lin2a[((unsigned short)(short)i) >> 2] = __zt_lineartoalaw(i);
 	   }
+	/* The tables stay in cache on everything measured so far */
+	if ((zt_xlawenc < ZT_XLAWENC_TABLE) || (zt_xlawenc > ZT_XLAWENC_CALC))
+		zt_xlawenc = ZT_XLAWENC_TABLE;
+#else
+	zt_xlawenc = ZT_XLAWENC_CALC;
+#endif
+	if (debug)
+		cmn_err(CE_CONT, "zaptel: using %s linear to law encoding\n", encnames[zt_xlawenc]);
+}
+
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+static int zt_cpu_has_sse2(void)
+{
+	unsigned int a = 1, b, c, d;
+	__asm__ __volatile__ ("cpuid" : "+a" (a), "=b" (b), "=c" (c), "=d" (d));
+	return (d >> 26) & 1;
+}
+#endif
+
+static void zt_arith_init(void)
+{
+	static char *names[] = { "C", "SWAR", "SSE2" };
+
+	if ((zt_arith < ZT_ARITH_C) || (zt_arith > ZT_ARITH_SSE2)) {
+		zt_arith = ZT_ARITH_SWAR;
+#if defined(CONFIG_ZAPTEL_SSE2) && (defined(__i386) || defined(__amd64))
+		if (zt_cpu_has_sse2())
+			zt_arith = ZT_ARITH_SSE2;
+#endif
+	}
+#if !defined(CONFIG_ZAPTEL_SSE2) || !(defined(__i386) || defined(__amd64))
+	if (zt_arith == ZT_ARITH_SSE2)
+		zt_arith = ZT_ARITH_SWAR;
 #endif
+	if (debug)
+		cmn_err(CE_CONT, "zaptel: using %s conference and echo canceller arithmetic\n", names[zt_arith]);
+}
+
+#ifndef NO_ECHOCAN_DISABLE
+/* Drop the echo canceller if the disable tone shows up in the chunk */
+static inline void __zt_ec_disable_check(struct zt_chan *ss,
+	echo_can_disable_detector_state_t *det, short *lin, char *dir)
+{
+	/* Called with ss->lock held */
+	struct zt_chan *ms = ss->master;
+	int x;
+
+	for (x=0;x<ZT_CHUNKSIZE;x++) {
+		/* Check for echo cancel disabling tone */
+		if (echo_can_disable_detector_update(det, lin[x])) {
+			cmn_err(CE_CONT, "zaptel Disabled echo canceller because of tone (%s) on channel %d\n", dir, ss->channo);
+			ms->echocancel = 0;
+			ms->echostate = ECHO_STATE_IDLE;
+			ms->echolastupdate = 0;
+			ms->echotimer = 0;
+			zt_ec_put(ms->ecengine, ms->ec);
+			ms->ec = NULL;
+			zt_chan_pipeline(ms);
+			break;
+		}
+	}
 }
+#endif
 
 static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char *txb)
 {
@@ -3869,28 +6199,16 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 	/* Called with ss->lock held */
 	struct zt_chan *ms = ss->master;
 	/* Linear representation */
-	short getlin[ZT_CHUNKSIZE], k[ZT_CHUNKSIZE];
+	short getlin[ZT_CHUNKSIZE] __attribute__((aligned(8)));
+	short k[ZT_CHUNKSIZE] __attribute__((aligned(8)));
 	int x;
 
 	/* Okay, now we've got something to transmit */
 	for (x=0;x<ZT_CHUNKSIZE;x++)
 		getlin[x] = ZT_XLAW(txb[x], ms);
 #ifndef NO_ECHOCAN_DISABLE
-	if (ms->ec) {
-		for (x=0;x<ZT_CHUNKSIZE;x++) {
-			/* Check for echo cancel disabling tone */
-			if (echo_can_disable_detector_update(&ms->txecdis, getlin[x])) {
-				cmn_err(CE_CONT, "zaptel Disabled echo canceller because of tone (tx) on channel %d\n", ss->channo);
-				ms->echocancel = 0;
-				ms->echostate = ECHO_STATE_IDLE;
-				ms->echolastupdate = 0;
-				ms->echotimer = 0;
-				kmem_free(ms->ec, ms->ec->allocsize);
-				ms->ec = NULL;
-				break;
-			}
-		}
-	}
+	if (ms->ec)
+		__zt_ec_disable_check(ss, &ms->txecdis, getlin, "tx");
 #endif
 	if ((!ms->confmute && !ms->dialing) || (ms->flags & ZT_FLAG_PSEUDO)) {
 		/* Handle conferencing on non-clear channel and non-HDLC channels */
@@ -3907,8 +6225,7 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 			} else {
 				ACSS(getlin, chans[ms->confna]->putlin);
 			}
-			for (x=0;x<ZT_CHUNKSIZE;x++)
-				txb[x] = ZT_LIN2X(getlin[x], ms);
+			zt_lin2x(ms, getlin, txb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_MONITORTX: /* Monitor a channel's tx mode */
 			  /* if a pseudo-channel, ignore */
@@ -3920,16 +6237,14 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 				ACSS(getlin, chans[ms->confna]->getlin);
 			}
 
-			for (x=0;x<ZT_CHUNKSIZE;x++)
-				txb[x] = ZT_LIN2X(getlin[x], ms);
+			zt_lin2x(ms, getlin, txb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_MONITORBOTH: /* monitor a channel's rx and tx mode */
 			  /* if a pseudo-channel, ignore */
 			if (ms->flags & ZT_FLAG_PSEUDO) break;
 			ACSS(getlin, chans[ms->confna]->putlin);
 			ACSS(getlin, chans[ms->confna]->getlin);
-			for (x=0;x<ZT_CHUNKSIZE;x++)
-				txb[x] = ZT_LIN2X(getlin[x], ms);
+			zt_lin2x(ms, getlin, txb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_REALANDPSEUDO:
 			/* This strange mode takes the transmit buffer and
@@ -3949,6 +6264,7 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 				SCSS(ms->conflast1, conf_sums_next[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums_next[ms->_confn], ms->conflast1);
+				__zt_sum_dirty(conf_dirty_next, ms->_confn);
 			} else {
 				bzero(ms->conflast1, ZT_CHUNKSIZE * sizeof(short));
 				bzero(ms->conflast2, ZT_CHUNKSIZE * sizeof(short));
@@ -3972,6 +6288,7 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 					SCSS(ms->conflast, conf_sums[ms->_confn]);
 					/* Really add in new value */
 					ACSS(conf_sums[ms->_confn], ms->conflast);
+					__zt_sum_dirty(conf_dirty, ms->_confn);
 				} else bzero(ms->conflast, ZT_CHUNKSIZE * sizeof(short));
 				bcopy(ms->getlin, getlin, ZT_CHUNKSIZE * sizeof(short));
 				txb[0] = ZT_LIN2X(0, ms);
@@ -3987,13 +6304,13 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 				/* Add in conference */
 				ACSS(getlin, conf_sums[ms->_confn]);
 			}
-			for (x=0;x<ZT_CHUNKSIZE;x++)
-				txb[x] = ZT_LIN2X(getlin[x], ms);
+			zt_lin2x(ms, getlin, txb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_CONFANN:
 		case ZT_CONF_CONFANNMON:
 			/* First, add tx buffer to conf */
 			ACSS(conf_sums_next[ms->_confn], getlin);
+			__zt_sum_dirty(conf_dirty_next, ms->_confn);
 			/* Start with silence */
 			bzero(getlin, ZT_CHUNKSIZE * sizeof(short));
 			/* If a listener on the conf... */
@@ -4003,8 +6320,7 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 				/* Add in conf */
 				ACSS(getlin, conf_sums[ms->_confn]);
 			}
-			for (x=0;x<ZT_CHUNKSIZE;x++)
-				txb[x] = ZT_LIN2X(getlin[x], ms);
+			zt_lin2x(ms, getlin, txb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_DIGITALMON:
 			/* Real digital monitoring, but still echo cancel if desired */
@@ -4012,15 +6328,13 @@ static inline void __zt_process_getaudio_chunk(struct zt_chan *ss, unsigned char
 				break;
 			if (chans[ms->confna]->flags & ZT_FLAG_PSEUDO) {
 				if (ms->ec) {
-					for (x=0;x<ZT_CHUNKSIZE;x++)
-						txb[x] = ZT_LIN2X(chans[ms->confna]->getlin[x], ms);
+					zt_lin2x(ms, chans[ms->confna]->getlin, txb, ZT_CHUNKSIZE);
 				} else {
 					bcopy(chans[ms->confna]->getraw, txb, ZT_CHUNKSIZE);
 				}
 			} else {
 				if (ms->ec) {
-					for (x=0;x<ZT_CHUNKSIZE;x++)
-						txb[x] = ZT_LIN2X(chans[ms->confna]->putlin[x], ms);
+					zt_lin2x(ms, chans[ms->confna]->putlin, txb, ZT_CHUNKSIZE);
 				} else {
 					bcopy(chans[ms->confna]->putraw, txb, ZT_CHUNKSIZE);
 				}
@@ -4079,9 +6393,11 @@ static inline void __zt_getbuf_chunk(struct zt_chan *ss, unsigned char *txb)
 	   try is our write-out buffer.  Always check it first because
 	   its our 'fast path' for whatever that's worth. */
 	while(bytes) {
-		if ((ms->outwritebuf > -1) && !ms->txdisable) {
-			buf= ms->writebuf[ms->outwritebuf];
-			left = ms->writen[ms->outwritebuf] - ms->writeidx[ms->outwritebuf];
+		if (ZT_TXBUF_READY(ms) && !ms->txdisable) {
+			membar_consumer();
+			oldbuf = ZT_TXBUF_OUT(ms);
+			buf= ms->writebuf[oldbuf];
+			left = ms->writen[oldbuf] - ms->writeidx[oldbuf];
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & ZT_FLAG_HDLC) {
@@ -4090,40 +6406,34 @@ static inline void __zt_getbuf_chunk(struct zt_chan *ss, unsigned char *txb)
 				for(x=0;x<left;x++) {
 					if (ms->txhdlc.bits < 8)
 						/* Load a byte of data only if needed */
-						fasthdlc_tx_load_nocheck(&ms->txhdlc, buf[ms->writeidx[ms->outwritebuf]++]);
+						fasthdlc_tx_load_nocheck(&ms->txhdlc, buf[ms->writeidx[oldbuf]++]);
 					*(txb++) = fasthdlc_tx_run_nocheck(&ms->txhdlc);
 				}
 				bytes -= left;
 			} else {
-				bcopy(buf + ms->writeidx[ms->outwritebuf], txb, left);
-				ms->writeidx[ms->outwritebuf]+=left;
+				bcopy(buf + ms->writeidx[oldbuf], txb, left);
+				ms->writeidx[oldbuf]+=left;
 				txb += left;
 				bytes -= left;
 			}
 			/* Check buffer status */
-			if (ms->writeidx[ms->outwritebuf] >= ms->writen[ms->outwritebuf]) {
+			if (ms->writeidx[oldbuf] >= ms->writen[oldbuf]) {
 				/* We've reached the end of our buffer.  Go to the next. */
-				oldbuf = ms->outwritebuf;
 				/* Clear out write index and such */
 				ms->writeidx[oldbuf] = 0;
 				ms->writen[oldbuf] = 0;
-				ms->outwritebuf = (ms->outwritebuf + 1) % ms->numbufs;
-				if (ms->outwritebuf == ms->inwritebuf) {
-					/* Whoopsies, we're run out of buffers.  Mark ours
-					as -1 and wait for the filler to notify us that
-					there is something to write */
-					ms->outwritebuf = -1;
+				/* Hand the buffer back to the filler */
+				membar_exit();
+				ms->txtail++;
+				if (!ZT_TXBUF_READY(ms)) {
+					/* Whoopsies, we're run out of buffers.  Wait for
+					the filler to give us something to write */
 					if (ms->iomask & (ZT_IOMUX_WRITE | ZT_IOMUX_WRITEEMPTY))
 						cv_broadcast(&ms->eventbufq);
 					/* If we're only supposed to start when full, disable the transmitter */
 					if (ms->txbufpolicy == ZT_POLICY_WHEN_FULL)
 						ms->txdisable = 1;
 				}
-				if (ms->inwritebuf < 0) {
-					/* The filler doesn't have a place to put data.  Now
-					that we're done with this buffer, notify them. */
-					ms->inwritebuf = oldbuf;
-				}
 /* In the very orignal driver, it was quite well known to me (Jim) that there
 was a possibility that a channel sleeping on a write block needed to
 be potentially woken up EVERY time a buffer was emptied, not just on the first
@@ -4136,7 +6446,7 @@ otherwise keeps sleeping and looking. The part in this code got "optimized"
 out in the later versions, and is put back now. */
 				if (!(ms->flags & (ZT_FLAG_NETDEV | ZT_FLAG_PPP))) {
 					cv_broadcast(&ms->writebufq);
-					pollwakeup(&ms->sel, POLLOUT);
+					zt_pollwakeup(ms, POLLOUT);
 					if (ms->iomask & ZT_IOMUX_WRITE)
 						cv_broadcast(&ms->eventbufq);
 				}
@@ -4223,7 +6533,7 @@ static inline void __rbs_otimer_expire(struct zt_chan *chan)
 	int len = 0;
 	/* Called with chan->lock held */
 
-	chan->otimer = 0;
+	zt_timer_set(&chan->otimer, 0);
 	/* Move to the next timer state */	
 	switch(chan->txstate) {
 	case ZT_TXSTATE_RINGOFF:
@@ -4292,8 +6602,10 @@ static inline void __rbs_otimer_expire(struct zt_chan *chan)
 	case ZT_TXSTATE_DEBOUNCE:
 		zt_rbs_sethook(chan, ZT_TXSIG_OFFHOOK, ZT_TXSTATE_OFFHOOK, 0);
 		/* See if we've gone back on hook */
-		if (chan->rxhooksig == ZT_RXSIG_ONHOOK)
-			chan->itimerset = chan->itimer = chan->rxflashtime * 8;
+		if (chan->rxhooksig == ZT_RXSIG_ONHOOK) {
+			chan->itimerset = chan->rxflashtime * 8;
+			zt_timer_set(&chan->itimer, chan->itimerset);
+		}
 		cv_broadcast(&chan->txstateq);
 		break;
 		
@@ -4335,7 +6647,7 @@ static inline void __rbs_otimer_expire(struct zt_chan *chan)
 			break;
 		}
 		chan->txstate = ZT_TXSTATE_PULSEAFTER;
-		chan->otimer = chan->pulseaftertime * 8;
+		zt_timer_set(&chan->otimer, chan->pulseaftertime * 8);
 		cv_broadcast(&chan->txstateq);
 		break;
 
@@ -4360,6 +6672,13 @@ static void __zt_hooksig_pvt(struct zt_chan *chan, zt_rxsig_t rxsig)
 	
 	if ((chan->flags & ZT_FLAG_SIGFREEZE)) return;
 
+	if (chan->sig & __ZT_SIG_FXS) {
+		/* Time the RING trailer from the end of the ring */
+		if (rxsig == ZT_RXSIG_RING)
+			zt_timer_set(&chan->ringtrailer, 0);
+		else if (chan->rxhooksig == ZT_RXSIG_RING)
+			zt_timer_set(&chan->ringtrailer, ZT_RINGTRAILER);
+	}
 	chan->rxhooksig = rxsig;
 	switch(chan->sig) {
 	    case ZT_SIG_EM:  /* E and M */
@@ -4368,18 +6687,20 @@ static void __zt_hooksig_pvt(struct zt_chan *chan, zt_rxsig_t rxsig)
 		    case ZT_RXSIG_OFFHOOK: /* went off hook */
 			/* The interface is going off hook */
 			/* set wink timer */
-			chan->itimerset = chan->itimer = chan->rxwinktime * 8;
+			chan->itimerset = chan->rxwinktime * 8;
+			zt_timer_set(&chan->itimer, chan->itimerset);
 			break;
 		    case ZT_RXSIG_ONHOOK: /* went on hook */
 			/* This interface is now going on hook.
 			   Check for WINK, etc */
-			if (chan->itimer)
+			if (zt_timer_left(&chan->itimer))
 				zt_qevent_nolock(chan,ZT_EVENT_WINKFLASH); 
 			else {
 				zt_qevent_nolock(chan,ZT_EVENT_ONHOOK); 
 				chan->gotgs = 0;
 			}
-			chan->itimerset = chan->itimer = 0;
+			chan->itimerset = 0;
+			zt_timer_set(&chan->itimer, 0);
 			break;
 		    default:
 			break;
@@ -4391,8 +6712,8 @@ static void __zt_hooksig_pvt(struct zt_chan *chan, zt_rxsig_t rxsig)
 		/* fall through intentionally */
 	   case ZT_SIG_FXSGS:  /* FXS Groundstart */
 		if (rxsig == ZT_RXSIG_ONHOOK) {
-			chan->ringdebtimer = RING_DEBOUNCE_TIME;
-			chan->ringtrailer = 0;
+			zt_timer_set(&chan->ringdebtimer, RING_DEBOUNCE_TIME * ZT_CHUNKSIZE);
+			zt_timer_set(&chan->ringtrailer, 0);
 			if (chan->txstate != ZT_TXSTATE_DEBOUNCE) {
 				chan->gotgs = 0;
 				zt_qevent_nolock(chan,ZT_EVENT_ONHOOK);
@@ -4418,18 +6739,18 @@ static void __zt_hooksig_pvt(struct zt_chan *chan, zt_rxsig_t rxsig)
 			}
 			chan->kewlonhook = 0;
 #if CONFIG_ZAPATA_DEBUG
-			cmn_err(CE_CONT, "Off hook on channel %d, itimer = %d, gotgs = %d\n", chan->channo, chan->itimer, chan->gotgs);
+			cmn_err(CE_CONT, "Off hook on channel %d, itimer = %d, gotgs = %d\n", chan->channo, zt_timer_left(&chan->itimer), chan->gotgs);
 #endif
-			if (chan->itimer) /* if timer still running */
+			if (zt_timer_left(&chan->itimer)) /* if timer still running */
 			{
-			    int plen = chan->itimerset - chan->itimer;
+			    int plen = chan->itimerset - zt_timer_left(&chan->itimer);
 			    if (plen <= ZT_MAXPULSETIME)
 			    {
 					if (plen >= ZT_MINPULSETIME)
 					{
 						chan->pulsecount++;
-						chan->pulsetimer = ZT_PULSETIMEOUT;
-						chan->itimer = chan->itimerset;
+						zt_timer_set(&chan->pulsetimer, ZT_PULSETIMEOUT * ZT_CHUNKSIZE);
+						zt_timer_set(&chan->itimer, chan->itimerset);
 						if (chan->pulsecount == 1)
 							zt_qevent_nolock(chan,ZT_EVENT_PULSE_START); 
 					} 
@@ -4440,17 +6761,18 @@ static void __zt_hooksig_pvt(struct zt_chan *chan, zt_rxsig_t rxsig)
 				if (!chan->gotgs) {
 					zt_qevent_nolock(chan,ZT_EVENT_RINGOFFHOOK); 
 					chan->gotgs = 1;
-					chan->itimerset = chan->itimer = 0;
 				}
 			}
-			chan->itimerset = chan->itimer = 0;
+			chan->itimerset = 0;
+			zt_timer_set(&chan->itimer, 0);
 			break;
 		    case ZT_RXSIG_ONHOOK: /* went on hook */
 			  /* if not during offhook debounce time */
 			if ((chan->txstate != ZT_TXSTATE_DEBOUNCE) &&
 			    (chan->txstate != ZT_TXSTATE_KEWL) && 
 			    (chan->txstate != ZT_TXSTATE_AFTERKEWL)) {
-				chan->itimerset = chan->itimer = chan->rxflashtime * 8;
+				chan->itimerset = chan->rxflashtime * 8;
+				zt_timer_set(&chan->itimer, chan->itimerset);
 			}
 			if (chan->txstate == ZT_TXSTATE_KEWL)
 				chan->kewlonhook = 1;
@@ -4530,6 +6852,9 @@ void zt_rbsbits(struct zt_chan *chan, int cursig)
 void zt_ec_chunk(struct zt_chan *ss, unsigned char *rxchunk, const unsigned char *txchunk)
 {
 	short rxlin, txlin;
+	short rxlins[ZT_CHUNKSIZE], txlins[ZT_CHUNKSIZE];
+	struct zt_ec_engine *eng;
+	hrtime_t t;
 	int x;
 	unsigned long flags;
 	mutex_enter(&ss->lock);
@@ -4551,7 +6876,7 @@ void zt_ec_chunk(struct zt_chan *ss, unsigned char *rxchunk, const unsigned char
 					ss->echostate = ECHO_STATE_TRAINING;
 				}
 				if (ss->echostate == ECHO_STATE_TRAINING) {
-					if (echo_can_traintap(ss->ec, ss->echolastupdate++, rxlin)) {
+					if (ss->ecengine->traintap(ss->ec, ss->echolastupdate++, rxlin)) {
 						ss->echostate = ECHO_STATE_ACTIVE;
 					}
 				}
@@ -4560,10 +6885,19 @@ void zt_ec_chunk(struct zt_chan *ss, unsigned char *rxchunk, const unsigned char
 			}
 		} else {
 			for (x=0;x<ZT_CHUNKSIZE;x++) {
-				rxlin = ZT_XLAW(rxchunk[x], ss);
-				rxlin = echo_can_update(ss->ec, ZT_XLAW(txchunk[x], ss), rxlin);
-				rxchunk[x] = ZT_LIN2X((int)rxlin, ss);
+				rxlins[x] = ZT_XLAW(rxchunk[x], ss);
+				txlins[x] = ZT_XLAW(txchunk[x], ss);
 			}
+			eng = ss->ecengine;
+			if (!(++ss->ecchunks % ZT_EC_TIMESAMPLE)) {
+				t = gethrtime();
+				eng->chunk(ss->ec, txlins, rxlins);
+				atomic_add_64(&eng->ns, gethrtime() - t);
+				atomic_add_64(&eng->samples, ZT_CHUNKSIZE);
+			} else
+				eng->chunk(ss->ec, txlins, rxlins);
+			for (x=0;x<ZT_CHUNKSIZE;x++)
+				rxchunk[x] = ZT_LIN2X((int)rxlins[x], ss);
 		}
 	}
 	chan_unlock(ss);
@@ -4624,7 +6958,8 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 	/* Called with ss->lock held */
 	struct zt_chan *ms = ss->master;
 	/* Linear version of received data */
-	short putlin[ZT_CHUNKSIZE],k[ZT_CHUNKSIZE];
+	short putlin[ZT_CHUNKSIZE] __attribute__((aligned(8)));
+	short k[ZT_CHUNKSIZE] __attribute__((aligned(8)));
 	int x,r;
 
 	if (ms->dialing) ms->afterdialingtimer = 50;
@@ -4635,26 +6970,22 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 		for(x=1; x<ZT_CHUNKSIZE; x++)
 			rxb[x] = rxb[0];
 	} 
-	for (x=0;x<ZT_CHUNKSIZE;x++) {
-		rxb[x] = ms->rxgain[rxb[x]];
-		putlin[x] = ZT_XLAW(rxb[x], ms);
-	}
-
-#ifndef NO_ECHOCAN_DISABLE
-	if (ms->ec) {
+	if (ms->gaintab && (ms->gaintab->xlaw == ms->xlaw)) {
+		/* Gain and decode in one lookup */
 		for (x=0;x<ZT_CHUNKSIZE;x++) {
-			if (echo_can_disable_detector_update(&ms->rxecdis, putlin[x])) {
-				cmn_err(CE_CONT, "zaptel Disabled echo canceller because of tone (rx) on channel %d\n", ss->channo);
-				ms->echocancel = 0;
-				ms->echostate = ECHO_STATE_IDLE;
-				ms->echolastupdate = 0;
-				ms->echotimer = 0;
-				kmem_free(ms->ec, ms->ec->allocsize);
-				ms->ec = NULL;
-				break;
-			}
+			putlin[x] = ms->gaintab->rxlin[rxb[x]];
+			rxb[x] = ms->rxgain[rxb[x]];
+		}
+	} else {
+		for (x=0;x<ZT_CHUNKSIZE;x++) {
+			rxb[x] = ms->rxgain[rxb[x]];
+			putlin[x] = ZT_XLAW(rxb[x], ms);
 		}
 	}
+
+#ifndef NO_ECHOCAN_DISABLE
+	if (ms->ec)
+		__zt_ec_disable_check(ss, &ms->rxecdis, putlin, "rx");
 #endif	
 	/* if doing rx tone decoding */
 	if (ms->rxp1 && ms->rxp2 && ms->rxp3)
@@ -4662,8 +6993,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 		r = sf_detect(&ms->rd,putlin,ZT_CHUNKSIZE,ms->rxp1,
 			ms->rxp2,ms->rxp3);
 		/* Convert back */
-		for(x=0;x<ZT_CHUNKSIZE;x++)
-			rxb[x] = ZT_LIN2X(putlin[x], ms);
+		zt_lin2x(ms, putlin, rxb, ZT_CHUNKSIZE);
 		if (r) /* if something happened */
 		{
 			if (r != ms->rd.lastdetect)
@@ -4705,8 +7035,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				ACSS(putlin, chans[ms->confna]->putlin);
 			}
 			/* Convert back */
-			for(x=0;x<ZT_CHUNKSIZE;x++)
-				rxb[x] = ZT_LIN2X(putlin[x], ms);
+			zt_lin2x(ms, putlin, rxb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_MONITORTX:	/* Monitor a channel's tx mode */
 			  /* if not a pseudo-channel, ignore */
@@ -4718,8 +7047,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				ACSS(putlin, chans[ms->confna]->getlin);
 			}
 			/* Convert back */
-			for(x=0;x<ZT_CHUNKSIZE;x++)
-				rxb[x] = ZT_LIN2X(putlin[x], ms);
+			zt_lin2x(ms, putlin, rxb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_MONITORBOTH:	/* Monitor a channel's tx and rx mode */
 			  /* if not a pseudo-channel, ignore */
@@ -4731,8 +7059,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 			ACSS(putlin, chans[ms->confna]->getlin);
 			ACSS(putlin, chans[ms->confna]->putlin);
 			/* Convert back */
-			for(x=0;x<ZT_CHUNKSIZE;x++)
-				rxb[x] = ZT_LIN2X(putlin[x], ms);
+			zt_lin2x(ms, putlin, rxb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_REALANDPSEUDO:
 			  /* do normal conf mode processing */
@@ -4746,6 +7073,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				SCSS(ms->conflast, conf_sums_next[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums_next[ms->_confn], ms->conflast);
+				__zt_sum_dirty(conf_dirty_next, ms->_confn);
 			} else bzero(ms->conflast, ZT_CHUNKSIZE * sizeof(short));
 			  /* do the pseudo-channel part processing */
 			bzero(putlin, ZT_CHUNKSIZE * sizeof(short));
@@ -4756,8 +7084,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				ACSS(putlin, conf_sums[ms->_confn]);
 			}
 			/* Convert back */
-			for(x=0;x<ZT_CHUNKSIZE;x++)
-				rxb[x] = ZT_LIN2X(putlin[x], ms);
+			zt_lin2x(ms, putlin, rxb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_CONF:	/* Normal conference mode */
 			if (ms->flags & ZT_FLAG_PSEUDO) /* if a pseudo-channel */
@@ -4769,8 +7096,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 					ACSS(putlin, conf_sums[ms->_confn]);
 				}
 				/* Convert back */
-				for(x=0;x<ZT_CHUNKSIZE;x++)
-					rxb[x] = ZT_LIN2X(putlin[x], ms);
+				zt_lin2x(ms, putlin, rxb, ZT_CHUNKSIZE);
 				bcopy(putlin, ss->getlin, ZT_CHUNKSIZE * sizeof(short));
 				break;
 			   }
@@ -4786,6 +7112,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				SCSS(ms->conflast, conf_sums_next[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums_next[ms->_confn], ms->conflast);
+				__zt_sum_dirty(conf_dirty_next, ms->_confn);
 			} else 
 				bzero(ms->conflast, ZT_CHUNKSIZE * sizeof(short));
 			  /* rxc unmodified */
@@ -4797,6 +7124,7 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				bcopy(k, putlin, ZT_CHUNKSIZE * sizeof(short));
 				/* Subtract last value */
 				SCSS(conf_sums[ms->_confn], ms->conflast);
+				__zt_sum_dirty(conf_dirty, ms->_confn);
 				/* Add conf value */
 				ACSS(k, conf_sums[ms->_confn]);
 				/*  get amount actually added */
@@ -4804,10 +7132,10 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 				SCSS(ms->conflast, conf_sums[ms->_confn]);
 				/* Really add in new value */
 				ACSS(conf_sums[ms->_confn], ms->conflast);
+				__zt_sum_dirty(conf_dirty, ms->_confn);
 			} else 
 				bzero(ms->conflast, ZT_CHUNKSIZE * sizeof(short));
-			for (x=0;x<ZT_CHUNKSIZE;x++)
-				rxb[x] = ZT_LIN2X((int)conf_sums_prev[ms->_confn][x], ms);
+			zt_lin2x(ms, conf_sums_prev[ms->_confn], rxb, ZT_CHUNKSIZE);
 			break;
 		case ZT_CONF_DIGITALMON:
 			  /* if not a pseudo-channel, ignore */
@@ -4823,6 +7151,147 @@ static inline void __zt_process_putaudio_chunk(struct zt_chan *ss, unsigned char
 	}
 }
 
+/* Media pipelines.  The two routines above handle every combination of
+   conference mode, SF tones, pseudo channels, gain and echo canceller on
+   every chunk.  Most channels are plain voice channels, so whenever
+   their law, gains, echo canceller, conference mode or signalling change
+   zt_chan_pipeline() picks a routine built for just that setup, with the
+   rest compiled out.  Timed state (dialing, mutes) is still checked per
+   chunk. */
+#define ZT_PIPE_ALAW	(1 << 0)	/* A-law rather than mu-law */
+#define ZT_PIPE_GAIN	(1 << 1)	/* Shared gain tables, see struct zt_gaintab */
+#define ZT_PIPE_EC	(1 << 2)	/* Echo canceller present */
+
+static inline void __zt_pipe_getaudio(struct zt_chan *ss, unsigned char *txb, const int pipe)
+{
+	/* Called with ss->lock held */
+	struct zt_chan *ms = ss->master;
+	short getlin[ZT_CHUNKSIZE] __attribute__((aligned(8)));
+	int x;
+
+	for (x=0;x<ZT_CHUNKSIZE;x++)
+		getlin[x] = (pipe & ZT_PIPE_ALAW) ? ZT_ALAW(txb[x]) : ZT_MULAW(txb[x]);
+#ifndef NO_ECHOCAN_DISABLE
+	if ((pipe & ZT_PIPE_EC) && ms->ec)
+		__zt_ec_disable_check(ss, &ms->txecdis, getlin, "tx");
+#endif
+	if (ms->confmute || (ms->echostate & __ECHO_STATE_MUTE)) {
+		txb[0] = ZT_LIN2X(0, ms);
+		for (x=1;x<ZT_CHUNKSIZE;x++)
+			txb[x] = txb[0];
+		if (ms->echostate == ECHO_STATE_STARTTRAINING) {
+			/* Transmit impulse now */
+			txb[0] = ZT_LIN2X(16384, ms);
+			ms->echostate = ECHO_STATE_AWAITINGECHO;
+		}
+	}
+	bcopy(ms->getlin, ms->getlin_lastchunk, ZT_CHUNKSIZE * sizeof(short));
+	bcopy(getlin, ms->getlin, ZT_CHUNKSIZE * sizeof(short));
+	bcopy(txb, ms->getraw, ZT_CHUNKSIZE);
+	if (pipe & ZT_PIPE_GAIN) {
+		for (x=0;x<ZT_CHUNKSIZE;x++)
+			txb[x] = ms->txgain[txb[x]];
+	}
+}
+
+static inline void __zt_pipe_putaudio(struct zt_chan *ss, unsigned char *rxb, const int pipe)
+{
+	/* Called with ss->lock held */
+	struct zt_chan *ms = ss->master;
+	short putlin[ZT_CHUNKSIZE] __attribute__((aligned(8)));
+	int x;
+
+	if (ms->dialing) ms->afterdialingtimer = 50;
+	else if (ms->afterdialingtimer) ms->afterdialingtimer--;
+	if (ms->afterdialingtimer) {
+		rxb[0] = ZT_LIN2X(0, ms);
+		for(x=1; x<ZT_CHUNKSIZE; x++)
+			rxb[x] = rxb[0];
+	}
+	if (pipe & ZT_PIPE_GAIN) {
+		short *rxlin = ms->gaintab->rxlin;
+
+		for (x=0;x<ZT_CHUNKSIZE;x++) {
+			putlin[x] = rxlin[rxb[x]];
+			rxb[x] = ms->rxgain[rxb[x]];
+		}
+	} else {
+		for (x=0;x<ZT_CHUNKSIZE;x++)
+			putlin[x] = (pipe & ZT_PIPE_ALAW) ? ZT_ALAW(rxb[x]) : ZT_MULAW(rxb[x]);
+	}
+#ifndef NO_ECHOCAN_DISABLE
+	if ((pipe & ZT_PIPE_EC) && ms->ec)
+		__zt_ec_disable_check(ss, &ms->rxecdis, putlin, "rx");
+#endif
+	bcopy(putlin, ms->putlin, ZT_CHUNKSIZE * sizeof(short));
+	bcopy(rxb, ms->putraw, ZT_CHUNKSIZE);
+}
+
+#define ZT_PIPELINE(name, pipe) \
+static void __zt_getaudio_##name(struct zt_chan *ss, unsigned char *txb) \
+{ \
+	__zt_pipe_getaudio(ss, txb, pipe); \
+} \
+static void __zt_putaudio_##name(struct zt_chan *ss, unsigned char *rxb) \
+{ \
+	__zt_pipe_putaudio(ss, rxb, pipe); \
+}
+
+ZT_PIPELINE(ulaw, 0)
+ZT_PIPELINE(alaw, ZT_PIPE_ALAW)
+ZT_PIPELINE(ulaw_gain, ZT_PIPE_GAIN)
+ZT_PIPELINE(alaw_gain, ZT_PIPE_ALAW | ZT_PIPE_GAIN)
+ZT_PIPELINE(ulaw_ec, ZT_PIPE_EC)
+ZT_PIPELINE(alaw_ec, ZT_PIPE_ALAW | ZT_PIPE_EC)
+ZT_PIPELINE(ulaw_gain_ec, ZT_PIPE_GAIN | ZT_PIPE_EC)
+ZT_PIPELINE(alaw_gain_ec, ZT_PIPE_ALAW | ZT_PIPE_GAIN | ZT_PIPE_EC)
+
+/* Indexed by struct zt_chan's pipeline: 0 is the general case, the rest
+   are 1 + ZT_PIPE_* */
+static struct zt_pipeline zt_pipelines[ZT_PIPELINES] = {
+	{ "general", __zt_process_getaudio_chunk, __zt_process_putaudio_chunk },
+	{ "ulaw", __zt_getaudio_ulaw, __zt_putaudio_ulaw },
+	{ "alaw", __zt_getaudio_alaw, __zt_putaudio_alaw },
+	{ "ulaw/gain", __zt_getaudio_ulaw_gain, __zt_putaudio_ulaw_gain },
+	{ "alaw/gain", __zt_getaudio_alaw_gain, __zt_putaudio_alaw_gain },
+	{ "ulaw/ec", __zt_getaudio_ulaw_ec, __zt_putaudio_ulaw_ec },
+	{ "alaw/ec", __zt_getaudio_alaw_ec, __zt_putaudio_alaw_ec },
+	{ "ulaw/gain/ec", __zt_getaudio_ulaw_gain_ec, __zt_putaudio_ulaw_gain_ec },
+	{ "alaw/gain/ec", __zt_getaudio_alaw_gain_ec, __zt_putaudio_alaw_gain_ec },
+};
+
+/* Pick the media pipeline for a channel's current setup.  Called with
+   the channel lock held after its law, gains, echo canceller, conference
+   mode or signalling change. */
+static void zt_chan_pipeline(struct zt_chan *chan)
+{
+	int pipe = 0;
+
+	if ((chan->flags & ZT_FLAG_PSEUDO) || chan->confmode ||
+	    (chan->sig == ZT_SIG_SF) || chan->rxp1 || chan->rxp2 || chan->rxp3 ||
+	    chan->v1_1 || chan->v2_1 || chan->v3_1) {
+		chan->pipeline = 0;
+		return;
+	}
+	if (chan->xlaw == __zt_alaw)
+		pipe |= ZT_PIPE_ALAW;
+	else if (chan->xlaw != __zt_mulaw) {
+		chan->pipeline = 0;
+		return;
+	}
+	if (chan->gaintab) {
+		/* rxlin[] must match the law */
+		if (chan->gaintab->xlaw != chan->xlaw) {
+			chan->pipeline = 0;
+			return;
+		}
+		pipe |= ZT_PIPE_GAIN;
+	}
+	if (chan->ec)
+		pipe |= ZT_PIPE_EC;
+	chan->pipeline = 1 + pipe;
+}
+
 static inline void __zt_putbuf_chunk(struct zt_chan *ss, unsigned char *rxb)
 {
 	/* We transmit data from our master channel */
@@ -4842,10 +7311,11 @@ static inline void __zt_putbuf_chunk(struct zt_chan *ss, unsigned char *rxb)
 		abort = 0;
 		eof = 0;
 		/* Next, figure out if we've got a buffer to receive into */
-		if (ms->inreadbuf > -1) {
+		if (ZT_RXBUF_ROOM(ms)) {
 			/* Read into the current buffer */
-			buf = ms->readbuf[ms->inreadbuf];
-			left = ms->blocksize - ms->readidx[ms->inreadbuf];
+			oldbuf = ZT_RXBUF_IN(ms);
+			buf = ms->readbuf[oldbuf];
+			left = ms->blocksize - ms->readidx[oldbuf];
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & ZT_FLAG_HDLC) {
@@ -4859,7 +7329,7 @@ static inline void __zt_putbuf_chunk(struct zt_chan *ss, unsigned char *rxb)
 						continue;
 					else if (res & RETURN_COMPLETE_FLAG) {
 						/* Only count this if it's a non-empty frame */
-						if (ms->readidx[ms->inreadbuf]) {
+						if (ms->readidx[oldbuf]) {
 							if ((ms->flags & ZT_FLAG_FCS) && (ms->infcs != PPP_GOODFCS)) {
 								abort = ZT_EVENT_BADFCS;
 							} else
@@ -4870,7 +7340,7 @@ static inline void __zt_putbuf_chunk(struct zt_chan *ss, unsigned char *rxb)
 					} else if (res & RETURN_DISCARD_FLAG) {
 						/* This could be someone idling with 
 						  "idle" instead of "flag" */
-						if (!ms->readidx[ms->inreadbuf])
+						if (!ms->readidx[oldbuf])
 							continue;
 						abort = ZT_EVENT_ABORT;
 						break;
@@ -4878,54 +7348,55 @@ static inline void __zt_putbuf_chunk(struct zt_chan *ss, unsigned char *rxb)
 						unsigned char rxc;
 						rxc = res;
 						ms->infcs = PPP_FCS(ms->infcs, rxc);
-						buf[ms->readidx[ms->inreadbuf]++] = rxc;
+						buf[ms->readidx[oldbuf]++] = rxc;
 						/* Pay attention to the possibility of an overrun */
-						if (ms->readidx[ms->inreadbuf] >= ms->blocksize) {
+						if (ms->readidx[oldbuf] >= ms->blocksize) {
 							if (!ss->span->alarms) 
 								cmn_err(CE_CONT, "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
 							abort=ZT_EVENT_OVERRUN;
 							/* Force the HDLC state back to frame-search mode */
 							ms->rxhdlc.state = 0;
 							ms->rxhdlc.bits = 0;
-							ms->readidx[ms->inreadbuf]=0;
+							ms->readidx[oldbuf]=0;
 							break;
 						}
 					}
 				}
 			} else {
 				/* Not HDLC */
-				bcopy(rxb, buf + ms->readidx[ms->inreadbuf], left);
+				bcopy(rxb, buf + ms->readidx[oldbuf], left);
 				rxb += left;
-				ms->readidx[ms->inreadbuf] += left;
+				ms->readidx[oldbuf] += left;
 				bytes -= left;
 				/* End of frame is decided by block size of 'N' */
-				eof = (ms->readidx[ms->inreadbuf] >= ms->blocksize);
+				eof = (ms->readidx[oldbuf] >= ms->blocksize);
 			}
 			if (eof)  {
 				/* Finished with this buffer, try another. */
-				oldbuf = ms->inreadbuf;
 				ms->infcs = PPP_INITFCS;
-				ms->readn[ms->inreadbuf] = ms->readidx[ms->inreadbuf];
+				ms->readn[oldbuf] = ms->readidx[oldbuf];
 #if CONFIG_ZAPATA_DEBUG
-				cmn_err(CE_CONT, "EOF, len is %d\n", ms->readn[ms->inreadbuf]);
+				cmn_err(CE_CONT, "EOF, len is %d\n", ms->readn[oldbuf]);
 #endif
 /**** SL Did I delete too much? *****/
 				{
-					ms->inreadbuf = (ms->inreadbuf + 1) % ms->numbufs;
-					if (ms->inreadbuf == ms->outreadbuf) {
+					/* With POLICY_WHEN_FULL, a ring the reader has
+					   drained holds it off again until it fills */
+					if (!ZT_RXBUF_READY(ms) && (ms->rxbufpolicy == ZT_POLICY_WHEN_FULL))
+						ms->rxdisable = 1;
+					/* Publish the contents before the buffer */
+					membar_producer();
+					ms->rxhead++;
+					if (!ZT_RXBUF_ROOM(ms)) {
 						/* Whoops, we're full, and have no where else
 						to store into at the moment.  We'll drop it
 						until there's a buffer available */
 #if CONFIG_ZAPATA_DEBUG
 						cmn_err(CE_CONT, "Out of storage space\n");
 #endif
-						ms->inreadbuf = -1;
 						/* Enable the receiver in case they've got POLICY_WHEN_FULL */
 						ms->rxdisable = 0;
 					}
-					if (ms->outreadbuf < 0) { /* start out buffer if not already */
-						ms->outreadbuf = oldbuf;
-					}
 /* In the very orignal driver, it was quite well known to me (Jim) that there
 was a possibility that a channel sleeping on a receive block needed to
 be potentially woken up EVERY time a buffer was filled, not just on the first
@@ -4943,7 +7414,7 @@ out in the later versions, and is put back now. */
 						cmn_err(CE_CONT, "Notifying reader data in block %d\n", oldbuf);
 #endif
 						cv_broadcast(&ms->readbufq);
-						pollwakeup(&ms->sel, POLLIN);
+						zt_pollwakeup(ms, POLLIN);
 						if (ms->iomask & ZT_IOMUX_READ)
 							cv_broadcast(&ms->eventbufq);
 					}
@@ -4951,7 +7422,7 @@ out in the later versions, and is put back now. */
 			}
 			if (abort) {
 				/* Start over reading frame */
-				ms->readidx[ms->inreadbuf] = 0;
+				ms->readidx[oldbuf] = 0;
 				ms->infcs = PPP_INITFCS;
 
 				if ((ms->flags & ZT_FLAG_OPEN) && !ss->span->alarms) 
@@ -4963,38 +7434,54 @@ out in the later versions, and is put back now. */
 	}
 }
 
+/* Run the /dev/zap/timer wheel for one chunk.  The work is in the timers
+   that run out, and each descriptor is woken once however many of its
+   timers did. */
 static void process_timers(void)
 {
-	unsigned long flags;
-	struct zt_timer *cur;
-	mutex_enter(&zaptimerlock);
-	cur = zaptimers;
-	while(cur) {
-		if (cur->ms) {
-			cur->pos -= ZT_CHUNKSIZE;
-			if (cur->pos <= 0) {
-				cur->tripped++;
-				cur->pos = cur->ms;
-				pollwakeup(&cur->sel, POLLPRI|POLLERR);
-			}
+	struct zt_timer *t, *list;
+	struct zt_ltimer *lt;
+	struct zt_fdtimer *fd, *wake = NULL;
+
+	mutex_enter(&zt_fdwheel.lock);
+	list = __zt_wheel_advance(&zt_fdwheel);
+	while ((t = list)) {
+		list = t->next;
+		t->next = NULL;
+		lt = (struct zt_ltimer *)t;
+		fd = lt->fd;
+		if (lt->period) {
+			t->expires = zt_fdwheel.tick + lt->period;
+			__zt_timer_add(&zt_fdwheel, t);
+		}
+		if (!lt->tripped++ && (lt != &fd->one)) {
+			lt->nextexp = NULL;
+			*fd->exptail = lt;
+			fd->exptail = &lt->nextexp;
 		}
-		cur = cur->next;
+		if (!fd->waking) {
+			fd->waking = 1;
+			fd->nextwake = wake;
+			wake = fd;
+		}
+	}
+	while ((fd = wake)) {
+		wake = fd->nextwake;
+		fd->waking = 0;
+		pollwakeup(&fd->sel, POLLPRI|POLLERR);
 	}
-	mutex_exit(&zaptimerlock);
+	mutex_exit(&zt_fdwheel.lock);
 }
 
 static int zt_timer_poll(dev_t dev, short events, int anyyet, short *reventsp, struct pollhead **phpp)
 {
-	struct zt_timer *timer;
-	unsigned long flags;
+	struct zt_fdtimer *timer;
 	short ret = 0;
 
  	timer = chan_timer_map[getminor(dev) - ZT_DEV_TIMER_BASE];
 	if (timer) {
-		// mutex_enter(&zaptimerlock);
-		if (timer->tripped || timer->ping) 
+		if (timer->one.tripped || timer->expired || timer->ping) 
 			ret |= POLLPRI|POLLERR;
-		// mutex_exit(&zaptimerlock);
 		
 		if (ret == 0) {
 			if (!anyyet) {
@@ -5018,27 +7505,21 @@ static int zt_chan_poll(dev_t dev, short events, int anyyet, short *reventsp, st
 
 	if (debug > 1) cmn_err(CE_CONT, "zt_chan_poll on unit = %d\n", unit);
 
-	if (unit >= ZT_DEV_CHAN_BASE && unit<ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT)
+	if (unit >= ZT_DEV_CHAN_BASE && unit<ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT) {
+		if (unit - ZT_DEV_CHAN_BASE >= nchanmap)
+			return ENXIO;
 		unit = chan_map[unit - ZT_DEV_CHAN_BASE];
+		if (unit < 0)
+			return ENXIO;
+	}
+	if (unit >= nchans)
+		return ENXIO;
 
  	chan = chans[unit];
 
 	  /* do the poll wait */
 	if (chan) {
-		ret = 0; /* start with nothing to return */
-		// mutex_enter(&chan->lock);
-		   /* if at least 1 write buffer avail */
-		if ((events & (POLLOUT|POLLWRNORM)) && chan->inwritebuf > -1) {
-			ret |= POLLOUT | POLLWRNORM;
-		}
-		if ((events & (POLLIN|POLLRDNORM)) && (chan->outreadbuf > -1) && !chan->rxdisable) {
-			ret |= POLLIN | POLLRDNORM;
-		}
-		if ((events & (POLLPRI|POLLERR)) && chan->eventoutidx != chan->eventinidx)
-		   {
-			/* Indicate an exception */
-			ret |= POLLPRI|POLLERR;
-		   }
+		ret = zt_chan_ready(chan) & events;
 		if (debug > 1) cmn_err(CE_CONT, "zt_chan_poll: unit=%d, events=%x ret=%x, chan=%lx\n", unit, events, ret, &chan);
 		// chan_unlock(chan);
 		if (ret == 0) {
@@ -5062,15 +7543,22 @@ static int zt_poll(dev_t dev, short events, int anyyet, short *reventsp, struct
 	if (unit == 0)
 		return EINVAL;
 
-	if (unit == 253 || unit == 254 || unit == 255) 
+	if (unit == ZT_DEV_TIMER || unit == ZT_DEV_CHANNEL || unit == ZT_DEV_PSEUDO) 
 		return EINVAL;
 
 	if (unit>=ZT_DEV_TIMER_BASE && unit<ZT_DEV_TIMER_BASE+ZT_DEV_TIMER_COUNT)
 		return zt_timer_poll(dev, events, anyyet, reventsp, phpp);
 
-	if (unit < 253 || (unit >= ZT_DEV_CHAN_BASE && unit<ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT))
+	if (unit>=ZT_DEV_MUX_BASE && unit<ZT_DEV_MUX_BASE+ZT_DEV_MUX_COUNT)
+		return zt_mux_poll(dev, events, anyyet, reventsp, phpp);
+
+	if (unit < nchans || (unit >= ZT_DEV_CHAN_BASE && unit<ZT_DEV_CHAN_BASE+ZT_DEV_CHAN_COUNT))
 		return zt_chan_poll(dev, events, anyyet, reventsp, phpp);
 
+	/* A channel that was never registered */
+	if (unit < ZT_MAX_CHANNELS)
+		return ENXIO;
+
 	return EINVAL;
 }
 
@@ -5080,21 +7568,23 @@ static void __zt_transmit_chunk(struct zt_chan *chan, unsigned char *buf)
 	/* Called with chan->lock locked */
 	if (!buf)
 		buf = silly;
+	if (chan->ring)
+		__zt_ring_tx(chan);
 	__zt_getbuf_chunk(chan, buf);
 
 	if ((chan->flags & ZT_FLAG_AUDIO) || (chan->confmode)) {
-		__zt_process_getaudio_chunk(chan, buf);
+		zt_pipelines[chan->master->pipeline].getaudio(chan, buf);
 	}
 }
 
-static inline void __zt_real_transmit(struct zt_chan *chan)
+static inline void __zt_real_transmit(struct zt_chan *chan, unsigned char *txb)
 {
 	/* Called with chan->lock held */
 	if (chan->confmode) {
 		/* Pull queued data off the conference */
-		__buf_pull(&chan->confout, chan->writechunk, chan, "zt_real_transmit");
+		__buf_pull(&chan->confout, txb, chan, "zt_real_transmit");
 	} else {
-		__zt_transmit_chunk(chan, chan->writechunk);
+		__zt_transmit_chunk(chan, txb);
 	}
 }
 
@@ -5157,43 +7647,56 @@ static void __zt_receive_chunk(struct zt_chan *chan, unsigned char *buf)
 		buf = waste;
 	}
 	if ((chan->flags & ZT_FLAG_AUDIO) || (chan->confmode)) {
-		__zt_process_putaudio_chunk(chan, buf);
+		zt_pipelines[chan->master->pipeline].putaudio(chan, buf);
 	}
 	__zt_putbuf_chunk(chan, buf);
+	if (chan->ring)
+		__zt_ring_rx(chan);
 }
 
-static inline void __zt_real_receive(struct zt_chan *chan)
+static inline void __zt_real_receive(struct zt_chan *chan, unsigned char *rxb)
 {
 	/* Called with chan->lock held */
 	if (chan->confmode) {
 		/* Load into queue if we have space */
-		__buf_push(&chan->confin, chan->readchunk, "zt_real_receive");
+		__buf_push(&chan->confin, rxb, "zt_real_receive");
 	} else {
-		__zt_receive_chunk(chan, chan->readchunk);
+		__zt_receive_chunk(chan, rxb);
 	}
 }
 
-int zt_transmit(struct zt_span *span)
+/* Transmit the ZT_CHUNKSIZE samples at off in each channel's writechunk */
+static void __zt_span_transmit(struct zt_span *span, int off)
 {
 	int x,y,z;
 	unsigned long flags;
+	uint32_t *idlemap;
 
-	if (span == NULL) {
-		cmn_err(CE_CONT, "zt_transmit: span is null");
-		return (0);
-	}
-
+	zt_wheel_run(&span->txwheel);
+	idlemap = span->idlemap;
 	for (x=0;x<span->channels;x++) {
-		mutex_enter(&span->chans[x].lock);
-		if (&span->chans[x] == span->chans[x].master) {
-			if (span->chans[x].otimer) {
-				span->chans[x].otimer -= ZT_CHUNKSIZE;
-				if (span->chans[x].otimer <= 0) {
+		if (idlemap && ZT_CHAN_IDLE(idlemap, x)) {
+			/* Nothing to do but the idle pattern and RBS */
+			if (span->chans[x].timerfired & ZT_TIMER_OTIMER) {
+				mutex_enter(&span->chans[x].lock);
+				if (span->chans[x].timerfired & ZT_TIMER_OTIMER) {
+					atomic_and_32(&span->chans[x].timerfired, ~ZT_TIMER_OTIMER);
 					__rbs_otimer_expire(&span->chans[x]);
 				}
+				chan_unlock(&span->chans[x]);
+			}
+			for (y=0;y<ZT_CHUNKSIZE;y++)
+				span->chans[x].writechunk[off + y] = span->chans[x].idlebyte;
+			continue;
+		}
+		mutex_enter(&span->chans[x].lock);
+		if (&span->chans[x] == span->chans[x].master) {
+			if (span->chans[x].timerfired & ZT_TIMER_OTIMER) {
+				atomic_and_32(&span->chans[x].timerfired, ~ZT_TIMER_OTIMER);
+				__rbs_otimer_expire(&span->chans[x]);
 			}
 			if (span->chans[x].flags & ZT_FLAG_AUDIO) {
-				__zt_real_transmit(&span->chans[x]);
+				__zt_real_transmit(&span->chans[x], span->chans[x].writechunk + off);
 			} else {
 				if (span->chans[x].nextslave) {
 					u_char data[ZT_CHUNKSIZE];
@@ -5208,13 +7711,13 @@ int zt_transmit(struct zt_span *span)
 								__zt_transmit_chunk(&span->chans[x], data);
 								pos = 0;
 							}
-							span->chans[z].writechunk[y] = data[pos++]; 
+							span->chans[z].writechunk[off + y] = data[pos++]; 
 							z = span->chans[z].nextslave;
 						} while(z);
 					}
 				} else {
 					/* Process independents elsewise */
-					__zt_real_transmit(&span->chans[x]);
+					__zt_real_transmit(&span->chans[x], span->chans[x].writechunk + off);
 				}
 			}
 			if (span->chans[x].sig == ZT_SIG_DACS_RBS) {
@@ -5240,24 +7743,436 @@ int zt_transmit(struct zt_span *span)
 			cv_broadcast(&span->maintq);
 		}
 	}
-
-	return 0;
 }
 
-int zt_receive(struct zt_span *span)
+int zt_transmit(struct zt_span *span)
 {
-	int x,y,z;
-	unsigned long flags, flagso;
+	int off = 0;
 
 	if (span == NULL) {
-		cmn_err(CE_CONT, "zt_receive: span is null");
+		cmn_err(CE_CONT, "zt_transmit: span is null");
 		return (0);
 	}
 
+	/* Each ZT_CHUNKSIZE piece is a tick of its own */
+	do {
+		__zt_span_transmit(span, off);
+		off += ZT_CHUNKSIZE;
+	} while (off < span->chunksize);
+
+	return 0;
+}
+
+/* Receive the conference side of real channels into conf_sums_next */
+static void __zt_mix_rx(int *list, int n)
+{
+	struct zt_chan *chan;
+	u_char *data;
+	int x;
+
+	for (x=0;x<n;x++) {
+		chan = chans[list[x]];
+		if (!zt_active_conf(chan))
+			continue;
+		mutex_enter(&chan->lock);
+		data = __buf_peek(&chan->confin);
+		__zt_receive_chunk(chan, data);
+		if (data)
+			__buf_pull(&chan->confin, NULL, chan, "confreceive");
+		chan_unlock(chan);
+	}
+}
+
+/* Pseudo channel receives (getbuf's) */
+static void __zt_mix_pseudotx(int *list, int n)
+{
+	struct zt_chan *chan;
+	int x;
+
+	for (x=0;x<n;x++) {
+		chan = chans[list[x]];
+		if (!zt_active_pseudo(chan))
+			continue;
+		mutex_enter(&chan->lock);
+		__zt_transmit_chunk(chan, NULL);
+		chan_unlock(chan);
+	}
+}
+
+/* Pseudo channel transmits (putbuf's), then the conference side of real
+   channels out of conf_sums */
+static void __zt_mix_tx(int *plist, int np, int *clist, int nc)
+{
+	struct zt_chan *chan;
+	unsigned char tmp[ZT_CHUNKSIZE];
+	u_char *data;
+	int x;
+
+	for (x=0;x<np;x++) {
+		chan = chans[plist[x]];
+		if (!zt_active_pseudo(chan))
+			continue;
+		mutex_enter(&chan->lock);
+		__zt_getempty(chan, tmp);
+		__zt_receive_chunk(chan, tmp);
+		chan_unlock(chan);
+	}
+	for (x=0;x<nc;x++) {
+		chan = chans[clist[x]];
+		if (!zt_active_conf(chan))
+			continue;
+		mutex_enter(&chan->lock);
+		data = __buf_pushpeek(&chan->confout);
+		__zt_transmit_chunk(chan, data);
+		if (data)
+			__buf_push(&chan->confout, NULL, "conftransmit");
+		chan_unlock(chan);
+	}
+}
+
+static void __zt_conf_links(int *links, int nlinks)
+{
+	int x, z;
+
+	  /* process all the conf links */
+	for(x = 0; x < nlinks; x++) {
+		z = links[2 * x + 1];
+		ACSS(conf_sums[z], conf_sums[links[2 * x]]);
+		__zt_sum_dirty(conf_dirty, z);
+	}
+}
+
+/*
+ * Multi-CPU conference mixing.  With zt_mix_threads set above one (from
+ * /etc/system), every tick with at least zt_mix_threshold active channels
+ * splits the active lists into partitions keyed on conference, so that a
+ * conference and all of its participants stay together.  A monitor goes
+ * with the channel it listens to, since it reads that channel's audio.
+ *
+ * The tick only partitions and hands the mix to zt_mix_tick() on the
+ * taskq.  Mixing in the tick's own context would mean waiting there for
+ * helper threads that the tick's interrupt may have preempted, so
+ * everything that waits is done in thread context.  zt_mix_tick() runs
+ * the phases one after the other, each by claiming partitions: taskq
+ * threads and zt_mix_tick() itself all claim and run what they can, and
+ * zt_mix_tick() sleeps until every partition is done.  Conference links
+ * read one conference and write another, so they are run between the
+ * phases, where all partitions are quiescent.
+ *
+ * The conference output of a tick therefore lands a little after the tick
+ * rather than within it.  If a mix is still running when the next tick
+ * comes, that tick is left to the next mix, which runs it as well (see
+ * mixsched.h), so the sums still rotate once per tick.
+ */
+#define ZT_MIX_MAXPARTS		16
+
+#define ZT_MIX_RX		0
+#define ZT_MIX_PSEUDOTX		1
+#define ZT_MIX_TX		2
+
+int zt_mix_threads = 0;
+int zt_mix_threshold = 64;
+
+static struct zt_mixpart {
+	volatile uint32_t claim;	/* Last phase generation claimed */
+	int nconf;
+	int npseudo;
+	int *conf;
+	int *pseudo;
+} zt_mixparts[ZT_MIX_MAXPARTS];
+
+static int zt_mix_nparts = 0;
+static int zt_mix_size = 0;		/* Slots in each conf[] and pseudo[] */
+static ddi_taskq_t *zt_mixq = NULL;
+static kmutex_t zt_mix_lock;
+static kcondvar_t zt_mix_cv;
+static volatile uint32_t zt_mix_gen = 0;
+static uint32_t zt_mix_left = 0;	/* Protected by zt_mix_lock */
+static volatile int zt_mix_phase = 0;
+/* The links of the tick being mixed, since the snapshot may be gone */
+static int zt_mix_links[2 * ZT_MAX_CONF];
+static int zt_mix_nlinks = 0;
+
+/* Partition key: the conference, or for a monitor the channel it hears */
+static int __zt_mix_key(struct zt_chan *chan)
+{
+	struct zt_chan *target;
+	int x;
+
+	for (x=0;(x < 4) && zt_conf_monitors(chan->confmode);x++) {
+		if ((chan->confna < 1) || (chan->confna >= maxchans) ||
+		    !(target = chans[chan->confna]))
+			break;
+		chan = target;
+	}
+	return chan->_confn ? chan->_confn : chan->channo;
+}
+
+static void __zt_mix_partition(struct zt_confsnap *snap)
+{
+	struct zt_mixpart *mp;
+	struct zt_chan *chan;
+	int x;
+
+	for (x=0;x<zt_mix_nparts;x++)
+		zt_mixparts[x].nconf = zt_mixparts[x].npseudo = 0;
+	for (x=0;x<snap->nconf;x++) {
+		if (!(chan = chans[snap->conf[x]]))
+			continue;
+		mp = &zt_mixparts[__zt_mix_key(chan) % zt_mix_nparts];
+		mp->conf[mp->nconf++] = snap->conf[x];
+	}
+	for (x=0;x<snap->npseudo;x++) {
+		if (!(chan = chans[snap->pseudo[x]]))
+			continue;
+		mp = &zt_mixparts[__zt_mix_key(chan) % zt_mix_nparts];
+		mp->pseudo[mp->npseudo++] = snap->pseudo[x];
+	}
+	bcopy(snap->links, zt_mix_links, 2 * snap->nlinks * sizeof(int));
+	zt_mix_nlinks = snap->nlinks;
+}
+
+static void zt_mix_work(void *arg)
+{
+	struct zt_mixpart *mp;
+	uint32_t gen;
+	int x, phase;
+
+	gen = zt_mix_gen;
+	membar_consumer();
+	phase = zt_mix_phase;
+	for (x=0;x<zt_mix_nparts;x++) {
+		mp = &zt_mixparts[x];
+		/* A late job from an older phase can never win the claim */
+		if (atomic_cas_32(&mp->claim, gen - 1, gen) != gen - 1)
+			continue;
+		switch(phase) {
+		case ZT_MIX_RX:
+			__zt_mix_rx(mp->conf, mp->nconf);
+			break;
+		case ZT_MIX_PSEUDOTX:
+			__zt_mix_pseudotx(mp->pseudo, mp->npseudo);
+			break;
+		case ZT_MIX_TX:
+			__zt_mix_tx(mp->pseudo, mp->npseudo, mp->conf, mp->nconf);
+			break;
+		}
+		mutex_enter(&zt_mix_lock);
+		if (!--zt_mix_left)
+			cv_signal(&zt_mix_cv);
+		mutex_exit(&zt_mix_lock);
+	}
+}
+
+/* Run one phase on all partitions and sleep until it is done */
+static void zt_mix_run(int phase)
+{
+	int x;
+
+	mutex_enter(&zt_mix_lock);
+	zt_mix_phase = phase;
+	zt_mix_left = zt_mix_nparts;
+	membar_producer();
+	zt_mix_gen++;
+	mutex_exit(&zt_mix_lock);
+	/* A failed dispatch only costs parallelism */
+	for (x=1;x<zt_mix_nparts;x++)
+		if (ddi_taskq_dispatch(zt_mixq, zt_mix_work, NULL, DDI_NOSLEEP) != DDI_SUCCESS)
+			break;
+	zt_mix_work(NULL);
+	mutex_enter(&zt_mix_lock);
+	while (zt_mix_left)
+		cv_wait(&zt_mix_cv, &zt_mix_lock);
+	mutex_exit(&zt_mix_lock);
+}
+
+/* One tick's conference mix from the partitions, on the taskq */
+static void zt_mix_phases(void)
+{
+	zt_mix_run(ZT_MIX_RX);
+	rotate_sums();
+	zt_mix_run(ZT_MIX_PSEUDOTX);
+	__zt_conf_links(zt_mix_links, zt_mix_nlinks);
+	zt_mix_run(ZT_MIX_TX);
+}
+
+/* Spread the tick's conferences over the partitions.  Returns 0 if the
+   tick has to mix them itself.  zt_ticklock held. */
+static int zt_mix_split(struct zt_confsnap *snap)
+{
+	if ((zt_mix_nparts < 2) || (snap->nconf + snap->npseudo < zt_mix_threshold))
+		return 0;
+	if ((snap->nconf > zt_mix_size) || (snap->npseudo > zt_mix_size))
+		return 0;
+	__zt_mix_partition(snap);
+	return 1;
+}
+
+/* One tick's conference mix, in the tick */
+static void __zt_mix_local(struct zt_confsnap *snap)
+{
+	if (!snap) {
+		/* Nothing configured yet */
+		rotate_sums();
+		return;
+	}
+	__zt_mix_rx(snap->conf, snap->nconf);
+	/* This is the master channel, so make things switch over */
+	rotate_sums();
+	/* do all the pseudo and/or conferenced channel receives (getbuf's) */
+	__zt_mix_pseudotx(snap->pseudo, snap->npseudo);
+	__zt_conf_links(snap->links, snap->nlinks);
+	/* do all the pseudo/conferenced channel transmits (putbuf's) */
+	__zt_mix_tx(snap->pseudo, snap->npseudo, snap->conf, snap->nconf);
+}
+
+static void zt_mix_tick(void *arg);
+
+static int zt_mix_dispatch(void)
+{
+	return ddi_taskq_dispatch(zt_mixq, zt_mix_tick, NULL, DDI_NOSLEEP) != DDI_SUCCESS;
+}
+
+#include "mixsched.h"
+
+/* Make room in the partitions for n channels of each kind, before a
+   snapshot that big is published.  Called with bigzaplock held. */
+static void __zt_mix_grow(int n)
+{
+	int *conf[ZT_MIX_MAXPARTS], *pseudo[ZT_MIX_MAXPARTS], *tmp;
+	int x, size, osize;
+
+	if (!zt_mix_nparts || (n <= zt_mix_size))
+		return;
+	for (size=zt_mix_size ? zt_mix_size : 64;size<n;size<<=1);
+	for (x=0;x<zt_mix_nparts;x++) {
+		conf[x] = kmem_zalloc(size * sizeof(int), KM_SLEEP);
+		pseudo[x] = kmem_zalloc(size * sizeof(int), KM_SLEEP);
+	}
+	/* The tick only partitions under zt_ticklock, and the mix only
+	   reads the partitions while zt_mix_busy is set */
+	for (;;) {
+		mutex_enter(&zt_ticklock);
+		if (!zt_mix_busy)
+			break;
+		mutex_exit(&zt_ticklock);
+		delay(1);
+	}
+	osize = zt_mix_size;
+	for (x=0;x<zt_mix_nparts;x++) {
+		tmp = zt_mixparts[x].conf;
+		zt_mixparts[x].conf = conf[x];
+		conf[x] = tmp;
+		tmp = zt_mixparts[x].pseudo;
+		zt_mixparts[x].pseudo = pseudo[x];
+		pseudo[x] = tmp;
+	}
+	zt_mix_size = size;
+	mutex_exit(&zt_ticklock);
+	for (x=0;x<zt_mix_nparts;x++) {
+		if (conf[x])
+			kmem_free(conf[x], osize * sizeof(int));
+		if (pseudo[x])
+			kmem_free(pseudo[x], osize * sizeof(int));
+	}
+}
+
+static void zt_mix_cleanup(void)
+{
+	int x;
+
+	if (zt_mixq) {
+		/* Waits for a mix still running */
+		ddi_taskq_destroy(zt_mixq);
+		zt_mixq = NULL;
+		mutex_destroy(&zt_mix_lock);
+		cv_destroy(&zt_mix_cv);
+	}
+	for (x=0;x<zt_mix_nparts;x++) {
+		if (zt_mixparts[x].conf)
+			kmem_free(zt_mixparts[x].conf, zt_mix_size * sizeof(int));
+		if (zt_mixparts[x].pseudo)
+			kmem_free(zt_mixparts[x].pseudo, zt_mix_size * sizeof(int));
+		zt_mixparts[x].conf = zt_mixparts[x].pseudo = NULL;
+	}
+	zt_mix_nparts = 0;
+	zt_mix_size = 0;
+}
+
+static void zt_mix_init(dev_info_t *dip)
+{
+	int n = zt_mix_threads;
+
+	if (n > ZT_MIX_MAXPARTS)
+		n = ZT_MIX_MAXPARTS;
+	if (n > ncpus)
+		n = ncpus;
+	if (n < 2)
+		return;
+	/* zt_mix_tick() and its n - 1 helpers */
+	zt_mixq = ddi_taskq_create(dip, "zt_mix", n, TASKQ_DEFAULTPRI, 0);
+	if (!zt_mixq) {
+		cmn_err(CE_CONT, "zaptel: unable to start conference mixing threads\n");
+		return;
+	}
+	mutex_init(&zt_mix_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&zt_mix_cv, NULL, CV_DRIVER, NULL);
+	zt_mix_nparts = n;
+	cmn_err(CE_CONT, "zaptel: mixing conferences on %d CPUs\n", n);
+}
+
+static void __zt_rx_timers(struct zt_chan *chan)
+{
+	/* Called with chan->lock held, for the receive timers that ran out */
+	uint32_t fired = chan->timerfired & ~ZT_TIMER_OTIMER;
+
+	atomic_and_32(&chan->timerfired, ~fired);
+	if (fired & ZT_TIMER_ITIMER)
+		rbs_itimer_expire(chan);
+	/* See if RING trailer is expired */
+	if ((fired & ZT_TIMER_RINGTRAILER) && (chan->sig & __ZT_SIG_FXS) &&
+	    !zt_timer_left(&chan->ringdebtimer))
+		zt_qevent_nolock(chan, ZT_EVENT_RINGOFFHOOK);
+	if ((fired & ZT_TIMER_PULSE) && chan->pulsecount) {
+		if (chan->pulsecount > 12) {
+			cmn_err(CE_CONT, "Got pulse digit %d on %s???\n",
+				chan->pulsecount, chan->name);
+		} else if (chan->pulsecount > 11) {
+			zt_qevent_nolock(chan, ZT_EVENT_PULSEDIGIT | '#');
+		} else if (chan->pulsecount > 10) {
+			zt_qevent_nolock(chan, ZT_EVENT_PULSEDIGIT | '*');
+		} else if (chan->pulsecount > 9) {
+			zt_qevent_nolock(chan, ZT_EVENT_PULSEDIGIT | '0');
+		} else {
+			zt_qevent_nolock(chan, ZT_EVENT_PULSEDIGIT | ('0' +
+				chan->pulsecount));
+		}
+		chan->pulsecount = 0;
+	}
+}
+
+/* Receive the ZT_CHUNKSIZE samples at off in each channel's readchunk */
+static void __zt_span_receive(struct zt_span *span, int off)
+{
+	int x,y,z;
+	unsigned long flags, flagso;
+	uint32_t *idlemap;
+
 #ifdef CONFIG_ZAPTEL_WATCHDOG
 	span->watchcounter--;
 #endif	
+	zt_wheel_run(&span->rxwheel);
+	idlemap = span->idlemap;
 	for (x=0;x<span->channels;x++) {
+		if (idlemap && ZT_CHAN_IDLE(idlemap, x)) {
+			/* Nobody wants the audio, just run the timers */
+			if (span->chans[x].timerfired & ~ZT_TIMER_OTIMER) {
+				mutex_enter(&span->chans[x].lock);
+				__zt_rx_timers(&span->chans[x]);
+				chan_unlock(&span->chans[x]);
+			}
+			continue;
+		}
 		if (span->chans[x].master == &span->chans[x]) {
 			mutex_enter(&span->chans[x].lock);
 			if (span->chans[x].nextslave) {
@@ -5268,7 +8183,7 @@ int zt_receive(struct zt_span *span)
 					/* Put all its slaves, too */
 					z = x;
 					do {
-						data[pos++] = span->chans[z].readchunk[y];
+						data[pos++] = span->chans[z].readchunk[off + y];
 						if (pos == ZT_CHUNKSIZE) {
 							__zt_receive_chunk(&span->chans[x], data);
 							pos = 0;
@@ -5278,120 +8193,50 @@ int zt_receive(struct zt_span *span)
 				}
 			} else {
 				/* Process a normal channel */
-				__zt_real_receive(&span->chans[x]);
-			}
-			if (span->chans[x].itimer) {
-				span->chans[x].itimer -= ZT_CHUNKSIZE;
-				if (span->chans[x].itimer <= 0) {
-					rbs_itimer_expire(&span->chans[x]);
-				}
-			}
-			if (span->chans[x].ringdebtimer)
-				span->chans[x].ringdebtimer--;
-			if (span->chans[x].sig & __ZT_SIG_FXS) {
-				if (span->chans[x].rxhooksig == ZT_RXSIG_RING)
-					span->chans[x].ringtrailer = ZT_RINGTRAILER;
-				else if (span->chans[x].ringtrailer) {
-					span->chans[x].ringtrailer-= ZT_CHUNKSIZE;
-					/* See if RING trailer is expired */
-					if (!span->chans[x].ringtrailer && !span->chans[x].ringdebtimer) 
-						zt_qevent_nolock(&span->chans[x],ZT_EVENT_RINGOFFHOOK);
-				}
-			}
-			if (span->chans[x].pulsetimer)
-			{
-				span->chans[x].pulsetimer--;
-				if (span->chans[x].pulsetimer <= 0)
-				{
-					if (span->chans[x].pulsecount)
-					{
-						if (span->chans[x].pulsecount > 12) {
-						
-							cmn_err(CE_CONT, "Got pulse digit %d on %s???\n",
-						    span->chans[x].pulsecount,
-							span->chans[x].name);
-						} else if (span->chans[x].pulsecount > 11) {
-							zt_qevent_nolock(&span->chans[x], ZT_EVENT_PULSEDIGIT | '#');
-						} else if (span->chans[x].pulsecount > 10) {
-							zt_qevent_nolock(&span->chans[x], ZT_EVENT_PULSEDIGIT | '*');
-						} else if (span->chans[x].pulsecount > 9) {
-							zt_qevent_nolock(&span->chans[x], ZT_EVENT_PULSEDIGIT | '0');
-						} else {
-							zt_qevent_nolock(&span->chans[x], ZT_EVENT_PULSEDIGIT | ('0' + 
-								span->chans[x].pulsecount));
-						}
-						span->chans[x].pulsecount = 0;
-					}
-				}
+				__zt_real_receive(&span->chans[x], span->chans[x].readchunk + off);
 			}
+			if (span->chans[x].timerfired & ~ZT_TIMER_OTIMER)
+				__zt_rx_timers(&span->chans[x]);
 			chan_unlock(&span->chans[x]);
 		}
 	}
 
 	if (span == master) {
-		/* Hold the big zap lock for the duration of major
-		   activities which touch all sorts of channels */
-		mutex_enter(&bigzaplock);			
+		struct zt_confsnap *snap;
+
+		/* Conference setup comes from the published snapshot, so
+		   reconfiguration never holds up the tick */
+		mutex_enter(&zt_ticklock);
+		zt_tick_seq++;
+		membar_enter();
+		snap = zt_snap;
 		/* Process any timers */
 		process_timers();
 		/* If we have dynamic stuff, call the ioctl with 0,0 parameters to
 		   make it run */
 		if (zt_dynamic_ioctl)
 			zt_dynamic_ioctl(0,0,0);
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && chans[x]->confmode && !(chans[x]->flags & ZT_FLAG_PSEUDO)) {
-				u_char *data;
-				mutex_enter(&chans[x]->lock);
-				data = __buf_peek(&chans[x]->confin);
-				__zt_receive_chunk(chans[x], data);
-				if (data)
-					__buf_pull(&chans[x]->confin, NULL,chans[x], "confreceive");
-				chan_unlock(chans[x]);
-			}
-		}
-		/* This is the master channel, so make things switch over */
-		rotate_sums();
-		/* do all the pseudo and/or conferenced channel receives (getbuf's) */
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && (chans[x]->flags & ZT_FLAG_PSEUDO)) {
-				mutex_enter(&chans[x]->lock);
-				__zt_transmit_chunk(chans[x], NULL);
-				chan_unlock(chans[x]);
-			}
-		}
-		if (maxlinks) {
-			  /* process all the conf links */
-			for(x = 1; x <= maxlinks; x++) {
-				  /* if we have a destination conf */
-				if (((z = confalias[conf_links[x].dst]) > 0) &&
-				    ((y = confalias[conf_links[x].src]) > 0)) {
-					ACSS(conf_sums[z], conf_sums[y]);
-				}
-			}
-		}
-		/* do all the pseudo/conferenced channel transmits (putbuf's) */
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && (chans[x]->flags & ZT_FLAG_PSEUDO)) {
-				unsigned char tmp[ZT_CHUNKSIZE];
-				mutex_enter(&chans[x]->lock);
-				__zt_getempty(chans[x], tmp);
-				__zt_receive_chunk(chans[x], tmp);
-				chan_unlock(chans[x]);
-			}
-		}
-		for (x=1;x<maxchans;x++) {
-			if (chans[x] && chans[x]->confmode && !(chans[x]->flags & ZT_FLAG_PSEUDO)) {
-				u_char *data;
-				mutex_enter(&chans[x]->lock);
-				data = __buf_pushpeek(&chans[x]->confout);
-				__zt_transmit_chunk(chans[x], data);
-				if (data)
-					__buf_push(&chans[x]->confout, NULL, "conftransmit");
-				chan_unlock(chans[x]);
-			}
-		}
-		mutex_exit(&bigzaplock);			
+		__zt_mix_conf(snap);
+		membar_exit();
+		zt_tick_seq++;
+		mutex_exit(&zt_ticklock);
 	}
+}
+
+int zt_receive(struct zt_span *span)
+{
+	int off = 0;
+
+	if (span == NULL) {
+		cmn_err(CE_CONT, "zt_receive: span is null");
+		return (0);
+	}
+
+	/* Each ZT_CHUNKSIZE piece is a tick of its own */
+	do {
+		__zt_span_receive(span, off);
+		off += ZT_CHUNKSIZE;
+	} while (off < span->chunksize);
 
 	return 0;
 }
@@ -5405,13 +8250,13 @@ static struct cb_ops    zt_cb_ops = {
     zt_read,                    /* read() */
     zt_write,                   /* write() */
     zt_ioctl,                   /* generic ioctl */
-    nodev,                      /* no devmap routine    */
+    zt_devmap,                  /* devmap for the shared rings */
     nodev,                      /* no mmap routine      */
-    nodev,                      /* no segmap routine    */
+    ddi_devmap_segmap,          /* segmap */
     zt_poll,                    /* no chpoll routine    */
     ddi_prop_op,
     NULL,                       /* a STREAMS driver     */
-    D_NEW | D_MP,               /* safe for multi-thread/multi-processor */
+    D_NEW | D_MP | D_DEVMAP,    /* safe for multi-thread/multi-processor */
     0,                          /* cb_ops version? */
     nodev,                      /* cb_aread() */
     nodev,                      /* cb_awrite() */
@@ -5451,12 +8296,6 @@ int _init(void)
   int ret, idx;
   size_t softstateSize = sizeof(zt_soft_state_t);
 
-  for (idx=0; idx<ZT_MAX_CHANNELS; idx++)
-	chans[idx] = 0;
-  for (idx=0; idx<ZT_MAX_SPANS; idx++)
-	spans[idx] = 0;
-  for (idx=0; idx<ZT_DEV_CHAN_COUNT; idx++)
-	chan_map[idx] = 0;
   for (idx=0; idx<ZT_DEV_TIMER_COUNT; idx++)
 	chan_timer_map[idx] = 0;
 
@@ -5564,7 +8403,6 @@ static int zt_init(dev_info_t *dip) {
 	int instance, status;
 	char *getdev_name;
 	int res = DDI_SUCCESS;
-	int x;
 
 	instance = ddi_get_instance(dip);
 	if (debug) cmn_err(CE_CONT, "zaptel%d: attach\n", instance); 
@@ -5592,11 +8430,17 @@ static int zt_init(dev_info_t *dip) {
 	}
 
   	state->dip = dip;
-
-	if (ddi_create_minor_node(dip, "timer", S_IFCHR, 253, DDI_NT_ZAP, 0) == DDI_FAILURE ||
-	    ddi_create_minor_node(dip, "channel", S_IFCHR, 254, DDI_NT_ZAP, 0) == DDI_FAILURE ||
-	    ddi_create_minor_node(dip, "pseudo", S_IFCHR, 255, DDI_NT_ZAP, 0) == DDI_FAILURE ||
-	    ddi_create_minor_node(dip, "ctl", S_IFCHR, 0, DDI_NT_ZAP, 0) == DDI_FAILURE)
+	zt_dip = dip;
+	mutex_init(&zt_ringlock, NULL, MUTEX_DRIVER, NULL);
+	mutex_init(&zt_muxlock, NULL, MUTEX_DRIVER, NULL);
+	mutex_init(&zt_gainlock, NULL, MUTEX_DRIVER, NULL);
+	zt_wheel_init(&zt_fdwheel);
+
+	if (ddi_create_minor_node(dip, "timer", S_IFCHR, ZT_DEV_TIMER, DDI_NT_ZAP, 0) == DDI_FAILURE ||
+	    ddi_create_minor_node(dip, "channel", S_IFCHR, ZT_DEV_CHANNEL, DDI_NT_ZAP, 0) == DDI_FAILURE ||
+	    ddi_create_minor_node(dip, "pseudo", S_IFCHR, ZT_DEV_PSEUDO, DDI_NT_ZAP, 0) == DDI_FAILURE ||
+	    ddi_create_minor_node(dip, "ctl", S_IFCHR, ZT_DEV_CTL, DDI_NT_ZAP, 0) == DDI_FAILURE ||
+	    ddi_create_minor_node(dip, "mux", S_IFCHR, ZT_DEV_MUX, DDI_NT_ZAP, 0) == DDI_FAILURE)
 	{
 		ddi_soft_state_free(ztsoftstatep, instance);
 		ddi_remove_minor_node(dip, NULL);
@@ -5606,6 +8450,8 @@ static int zt_init(dev_info_t *dip) {
 	cmn_err(CE_CONT, "Zapata Telephony Interface Registered\n");
 	zt_conv_init();
 	if (debug) cmn_err(CE_CONT, "zt_conv_init\n");
+	zt_arith_init();
+	zt_ecpool_init();
 	tone_zone_init();
 	if (debug) cmn_err(CE_CONT, "tone_zone_init\n");
 	fasthdlc_precalc();
@@ -5616,13 +8462,11 @@ static int zt_init(dev_info_t *dip) {
 	if (debug) cmn_err(CE_CONT, "rw_init chan_lock\n");
 	rw_init(&zone_lock, NULL, RW_DRIVER, NULL);
 	if (debug) cmn_err(CE_CONT, "rw_init zone_lock\n");
+	zt_mix_init(dip);
 #ifdef CONFIG_ZAPTEL_WATCHDOG
 	watchdog_init();
 #endif	
 
-	for (x=0; x<ZT_DEV_CHAN_COUNT; x++)
-		chan_map[x] = -1;
-
 	if (debug) cmn_err(CE_CONT, "leaving zt_init\n");
 	return res;
 }
@@ -5648,6 +8492,16 @@ static void zt_cleanup(void) {
 	int x;
 
 	cmn_err(CE_CONT, "Zapata Telephony Interface Unloaded\n");
+	zt_mix_cleanup();
+	mutex_enter(&bigzaplock);
+	if (zt_snap) {
+		kmem_free(zt_snap, zt_snap->size);
+		zt_snap = NULL;
+	}
+	__zt_snap_reap(1);
+	mutex_exit(&bigzaplock);
+	zt_tab_cleanup();
+	zt_ecpool_cleanup();
 	for (x=0;x<ZT_TONE_ZONE_MAX;x++)
 		if (tone_zones[x])
 			if (tone_zones[x]->allocsize)
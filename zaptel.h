@@ -104,6 +104,9 @@
 #define ZT_MIN_CHUNKSIZE	 ZT_CHUNKSIZE
 #define ZT_DEFAULT_CHUNKSIZE	 ZT_CHUNKSIZE
 #define ZT_MAX_CHUNKSIZE 	 ZT_CHUNKSIZE
+/* A span may move several chunks at a time, see struct zt_span's
+   chunksize; zaptel still processes them ZT_CHUNKSIZE at a time */
+#define ZT_MAX_SPAN_CHUNKSIZE	 80
 #define ZT_CB_SIZE		 2
 
 #define ZT_MAX_BLOCKSIZE 	 8192
@@ -119,21 +122,6 @@
 
 #define	RING_DEBOUNCE_TIME	2000	/* 2000 ms ring debounce time */
 
-#ifdef _KERNEL
-/* Echo cancellation */
-#if defined(ECHO_CAN_STEVE)
-#include "sec.h"
-#elif defined(ECHO_CAN_STEVE2)
-#include "sec-2.h"
-#elif defined(ECHO_CAN_MARK)
-#include "mec.h"
-#elif defined(ECHO_CAN_MARK2)
-#include "mec2.h"
-#else
-#include "mec3.h"
-#endif
-#endif
-
 typedef struct zt_params
 {
 int channo;		/* Channel number */
@@ -244,6 +232,210 @@ int readbufs;		/* How many read buffers are full (read-only) */
 int writebufs;		/* How many write buffers are full (read-only) */
 } ZT_BUFFERINFO;
 
+/*
+ * Shared memory audio rings.  ZT_RING_SETUP allocates one rx and one tx
+ * ring of fixed size slots for the channel; mmap() the returned size at
+ * offset 0 on the same file descriptor.  The kernel moves whole read and
+ * write buffers (the same frames read()/write() would return) through the
+ * rings each tick, so read()/write() should not be used at the same time.
+ * Indices are free running; slot n lives at offset + (n % slots) * slotsize
+ * and starts with a struct zt_ring_slot.  poll() reports POLLIN while the
+ * rx ring is not empty and POLLOUT while the tx ring has room.  The
+ * application only writes rx_tail, tx_head and its tx slots; the kernel
+ * keeps its own copy of everything else and ignores changes to it.
+ */
+typedef struct zt_ring_hdr
+{
+volatile unsigned int rx_head;	/* Next rx slot the kernel fills */
+volatile unsigned int rx_tail;	/* Next rx slot the application empties */
+volatile unsigned int tx_head;	/* Next tx slot the application fills */
+volatile unsigned int tx_tail;	/* Next tx slot the kernel empties */
+unsigned int slots;		/* Slots in each ring */
+unsigned int slotsize;		/* Bytes per slot, including zt_ring_slot */
+unsigned int rx_offset;		/* Offset of the rx ring from the header */
+unsigned int tx_offset;		/* Offset of the tx ring from the header */
+volatile unsigned int rx_stalls;	/* Ticks a frame waited for rx ring space */
+} ZT_RING_HDR;
+
+typedef struct zt_ring_slot
+{
+unsigned int len;		/* Bytes of audio following */
+unsigned int reserved;
+} ZT_RING_SLOT;
+
+typedef struct zt_ring_params
+{
+int slots;		/* Slots per ring, 0 to tear the rings down */
+int size;		/* Bytes to mmap (read-only) */
+} ZT_RING_PARAMS;
+
+/*
+ * Move read and write buffers of many channels in one call (ZT_BUFVEC on
+ * /dev/zap/ctl).  Each descriptor is handled like a non-blocking read()
+ * or write() on its (open) channel; its result is the number of bytes
+ * moved, or a negative errno (-EAGAIN when nothing was ready).
+ */
+#define ZT_BUFVEC_READ		0
+#define ZT_BUFVEC_WRITE		1
+
+#define ZT_MAX_BUFVEC		1024
+
+/*
+ * /dev/zap/mux: register interest in many channels with ZT_MUX_SET, then
+ * read() an array of struct zt_mux_event for the channels that are ready.
+ * Reporting is level triggered: a channel stays reported until it is no
+ * longer ready.  With ZT_MUX_GETEVENT the pending event is dequeued and
+ * returned in the record, as ZT_GETEVENT would.
+ */
+#define ZT_MUX_IN		(1 << 0)	/* Read buffer available */
+#define ZT_MUX_OUT		(1 << 1)	/* Write buffer available */
+#define ZT_MUX_PRI		(1 << 2)	/* Event pending */
+#define ZT_MUX_GETEVENT		(1 << 3)	/* Dequeue the event into the record */
+
+typedef struct zt_mux_entry
+{
+int chan;		/* Channel number */
+int events;		/* ZT_MUX_* interest mask, 0 to stop watching */
+} ZT_MUX_ENTRY;
+
+typedef struct zt_mux_event
+{
+int chan;		/* Channel number */
+int revents;		/* ZT_MUX_IN/OUT/PRI that are ready */
+int event;		/* Dequeued event, or ZT_EVENT_NONE */
+} ZT_MUX_EVENT;
+
+/*
+ * Drain up to count queued events of a channel in one call (ZT_GETEVENTS).
+ * Events come back oldest first, stamped with gethrtime() at the time they
+ * were queued.  dropped is the number of events lost to a full queue since
+ * the previous ZT_GETEVENTS, and is reset by it.
+ */
+#define ZT_MAX_GETEVENTS	64
+
+typedef struct zt_event_stamp
+{
+int event;			/* ZT_EVENT_* */
+int reserved;
+unsigned long long when;	/* When it was queued, in ns */
+} ZT_EVENT_STAMP;
+
+typedef struct zt_eventvec
+{
+int count;			/* In: most events wanted, out: events returned */
+unsigned int dropped;		/* Events lost since the last call (read-only) */
+struct zt_event_stamp ev[ZT_MAX_GETEVENTS];
+} ZT_EVENTVEC;
+
+/*
+ * Logical timers on a /dev/zap/timer descriptor.  ZT_TIMERSETUP gives it
+ * count timers (0 to drop them), each armed with ZT_TIMERSET.  poll()
+ * reports POLLPRI while any have run out, and ZT_TIMERGET collects them,
+ * oldest first.  The ZT_TIMERCONFIG timer works as before alongside.
+ */
+#define ZT_MAX_TIMERS		4096	/* Logical timers per descriptor */
+#define ZT_MAX_TIMERGET		64
+
+typedef struct zt_timerset
+{
+int id;			/* Timer, 0 to count - 1 */
+int samples;		/* Run out after this many samples, 0 to stop */
+int period;		/* Then again every period samples, 0 for once */
+} ZT_TIMERSET;
+
+typedef struct zt_timerexp
+{
+int id;			/* Timer that ran out */
+int tripped;		/* Times it ran out since it was last collected */
+} ZT_TIMEREXP;
+
+typedef struct zt_timervec
+{
+int count;		/* In: most timers wanted, out: timers returned */
+struct zt_timerexp exp[ZT_MAX_TIMERGET];
+} ZT_TIMERVEC;
+
+/*
+ * Echo canceller engines.  Every one is built in, and each channel runs
+ * the one its ZT_ECHOCANCEL asked for.  ZT_EC_DEFAULT picks by trunk
+ * type: channels with FXS or FXO signalling count as analog, the rest
+ * as digital.  Both start out as the engine the driver was built with.
+ */
+#define ZT_EC_DEFAULT		0
+#define ZT_EC_MARK2		1	/* Time domain, up to 1024 taps */
+#define ZT_EC_NLMS		2	/* Cheap short tail NLMS, up to 256 taps */
+#define ZT_EC_PBFD		3	/* Frequency domain, up to 1024 taps */
+
+/* ZT_ECHOCANCEL argument for a tail of taps on engine e */
+#define ZT_ECHOCANCEL_ENGINE(e, taps)	(((e) << 16) | (taps))
+
+/*
+ * What each engine costs (ZT_GETECENGINES).  The time is measured on a
+ * sample of the chunks each channel cancels; ns / samples is what it
+ * takes per sample, and 8000 times that the ns of CPU a channel needs
+ * each second.
+ */
+#define ZT_MAX_ECENGINES	8
+
+typedef struct zt_ecengine_info
+{
+int id;			/* ZT_EC_* */
+char name[16];
+int maxtaps;		/* Longest tail it takes */
+int chans;		/* Channels running it */
+int bytes;		/* State they hold */
+unsigned long long samples;	/* Samples timed */
+unsigned long long ns;		/* Time spent cancelling them */
+} ZT_ECENGINE_INFO;
+
+typedef struct zt_ecengines
+{
+int count;		/* Entries filled in */
+int builtin;		/* Engine the driver was built with */
+int analog;		/* ZT_EC_DEFAULT on analog channels */
+int digital;		/* ... and on digital ones */
+struct zt_ecengine_info eng[ZT_MAX_ECENGINES];
+} ZT_ECENGINES;
+
+/*
+ * Echo canceller state pool (ZT_GETECPOOL), one entry per engine and
+ * tail length
+ */
+#define ZT_MAX_ECPOOL		16
+
+typedef struct zt_ecpool_class
+{
+int engine;		/* ZT_EC_* */
+int taps;		/* Tail length */
+int size;		/* Bytes per canceller */
+int free;		/* Ready in the pool */
+int inuse;		/* On channels */
+int hiwat;		/* Most ever in use at once */
+int fails;		/* Enables refused for lack of memory */
+} ZT_ECPOOL_CLASS;
+
+typedef struct zt_ecpool_stats
+{
+int count;		/* Entries filled in */
+struct zt_ecpool_class cls[ZT_MAX_ECPOOL];
+} ZT_ECPOOL_STATS;
+
+typedef struct zt_bufvec_desc
+{
+int chan;		/* Channel number */
+int op;			/* ZT_BUFVEC_READ or ZT_BUFVEC_WRITE */
+void *buf;		/* Data to write, or room to read into */
+int len;		/* Size of buf in bytes */
+} ZT_BUFVEC_DESC;
+
+typedef struct zt_bufvec
+{
+int count;			/* Number of descriptors */
+struct zt_bufvec_desc *desc;	/* Descriptor array */
+int *result;			/* Result array, one per descriptor */
+int moved;			/* Descriptors that moved data (read-only) */
+} ZT_BUFVEC;
+
 typedef struct zt_dialparams
 {
 int mfv1_tonelen;	/* MF tone length (KP = this * 5/3) */
@@ -257,6 +449,7 @@ typedef struct zt_dynamic_span {
 	char addr[40];		/* Destination address */
 	int numchans;		/* Number of channels */
 	int timing;		/* Timing source preference */
+	int chunksize;		/* Samples per message, 0 for ZT_CHUNKSIZE */
 	int spanno;		/* Span number (filled in by zaptel) */
 } ZT_DYNAMIC_SPAN;
 
@@ -455,6 +648,9 @@ void	*data;
  * The number is zero to disable echo cancellation and non-zero
  * to enable echo cancellation.  If the number is between 32
  * and 256, it will also set the number of taps in the echo canceller
+ * (512 and 1024 work too, on MARK2 and PBFD).  The engine to run may
+ * be given above the tap count with ZT_ECHOCANCEL_ENGINE(); without one
+ * the channel gets ZT_EC_DEFAULT.
  */
 #define ZT_ECHOCANCEL		_IOW (ZT_CODE, 33, int)
 
@@ -577,6 +773,43 @@ void	*data;
 #define ZT_INDIRECT _IOWR (ZT_CODE, 56, struct zt_indirect_data)
 
 
+/*
+ * Set up or tear down the shared memory audio rings of a channel
+ */
+#define ZT_RING_SETUP		_IOWR (ZT_CODE, 86, struct zt_ring_params)
+
+/*
+ * Read and write buffers of many channels at once
+ */
+#define ZT_BUFVEC		_IOWR (ZT_CODE, 87, struct zt_bufvec)
+
+/*
+ * Watch (or stop watching) a channel from a /dev/zap/mux descriptor
+ */
+#define ZT_MUX_SET		_IOW (ZT_CODE, 88, struct zt_mux_entry)
+
+/*
+ * Get several events, with timestamps, from a channel's queue
+ */
+#define ZT_GETEVENTS		_IOWR (ZT_CODE, 89, struct zt_eventvec)
+
+/*
+ * Set up, arm and collect the logical timers of a /dev/zap/timer descriptor
+ */
+#define ZT_TIMERSETUP		_IOW (ZT_CODE, 90, int)
+#define ZT_TIMERSET		_IOW (ZT_CODE, 91, struct zt_timerset)
+#define ZT_TIMERGET		_IOWR (ZT_CODE, 92, struct zt_timervec)
+
+/*
+ * Get the echo canceller pool's counters
+ */
+#define ZT_GETECPOOL		_IOR (ZT_CODE, 93, struct zt_ecpool_stats)
+
+/*
+ * Get the echo canceller engines and what they cost
+ */
+#define ZT_GETECENGINES		_IOR (ZT_CODE, 94, struct zt_ecengines)
+
 /*
  *  60-80 are reserved for private drivers
  *  80-85 are reserved for dynamic span stuff
@@ -853,16 +1086,17 @@ struct zt_tone_def {		/* Structure for zone programming */
 
 #define ZT_MAX_PRETRAINING   1000	/* 1000ms max pretraining time */
 
-#define ZT_MAX_SPANS		128		/* Max, 128 spans */
-#define ZT_MAX_CHANNELS		1024	/* Max, 1024 channels */
+#define ZT_MAX_SPANS		1024	/* Max, 1024 spans */
+#define ZT_MAX_CHANNELS		8192	/* Max, 8192 channels */
 #define ZT_MAX_CONF			1024	/* Max, 1024 conferences */
 
 #ifdef _KERNEL
 
-#define	ZT_MAX_EVENTSIZE	64	/* 64 events max in buffer */
+#define	ZT_MAX_EVENTSIZE	256	/* events queued per channel, a power of two */
 
 struct zt_span;
 struct zt_chan;
+struct zt_ring;
 
 struct zt_tone_state {
 	int v1_1;
@@ -894,98 +1128,207 @@ typedef struct
 	int	lastdetect;
 } sf_detect_state_t;
 
+/* Cache line size assumed for the struct zt_chan layout */
+#define ZT_CACHE_LINE		64
+
+/* Channel signalling timers.  Instead of counting every channel's timers
+   down on every chunk, each span keeps the running ones on a two level
+   timing wheel that advances one slot per chunk.  An expired timer sets
+   its bit in the channel's timerfired mask, and the tick runs the
+   handler the next time it has the channel locked. */
+#define ZT_TW1_BITS		8
+#define ZT_TW2_BITS		6
+#define ZT_TW1_SIZE		(1 << ZT_TW1_BITS)	/* one chunk per slot */
+#define ZT_TW2_SIZE		(1 << ZT_TW2_BITS)	/* ZT_TW1_SIZE chunks per slot */
+#define ZT_TW1_MASK		(ZT_TW1_SIZE - 1)
+#define ZT_TW2_MASK		(ZT_TW2_SIZE - 1)
+
+#define ZT_TIMER_ITIMER		(1 << 0)	/* rx wink/flash timer (rx wheel) */
+#define ZT_TIMER_OTIMER		(1 << 1)	/* tx state timer (tx wheel) */
+#define ZT_TIMER_RINGTRAILER	(1 << 2)	/* RING trailer (rx wheel) */
+#define ZT_TIMER_PULSE		(1 << 3)	/* pulse digit timeout (rx wheel) */
+
+struct zt_timer {
+	struct zt_timer *next;		/* Next timer in the same slot */
+	struct zt_timer **pprev;	/* Link pointing at us, NULL if not running */
+	struct zt_chan *chan;		/* Channel the timer belongs to */
+	unsigned int expires;		/* Wheel tick at which it runs out */
+	int fire;			/* ZT_TIMER_* bit to set, 0 for none */
+};
+
+/* One slot of a channel's event ring.  seq is the free running position
+   the slot is ready for: pos while a producer may claim it, pos + 1 once
+   the event is published, pos + ZT_MAX_EVENTSIZE after it is read. */
+struct zt_evslot {
+	volatile uint32_t seq;
+	int event;
+	hrtime_t when;			/* gethrtime() when it was queued */
+};
+
+struct zt_timerwheel {
+	kmutex_t lock;
+	unsigned int tick;		/* Chunks since the span registered */
+	struct zt_timer *tv1[ZT_TW1_SIZE];
+	struct zt_timer *tv2[ZT_TW2_SIZE];
+};
+
 struct zt_chan {
+	/* The first part is what the tick touches for every channel: it is
+	   kept together at the front, followed by the per-chunk sample
+	   arrays.  Bulky and configuration-only state follows.  Channels
+	   come from kmem_alloc() and from drivers' own arrays, neither of
+	   which is cache line aligned, so this only orders the fields; it
+	   doesn't pin them to lines.  zaptel.c checks the layout at compile
+	   time, and chanlayout dumps the lines a voice channel's tick
+	   touches. */
 	kmutex_t lock;
-	char name[40];		/* Name */
 	/* Specified by zaptel */
 	int channo;			/* Zaptel Channel number */
 	int chanpos;
 	int flags;
-	long rxp1;
-	long rxp2;
-	long rxp3;
-	int txtone;
-	int tx_v2;
-	int tx_v3;
-	int v1_1;
-	int v2_1;
-	int v3_1;
-	int toneflags;
-	sf_detect_state_t rd;
 
 	struct zt_chan *master;	/* Our Master channel (could be us) */
 	/* Next slave (if appropriate) */
 	int nextslave;
 
 	u_char *writechunk;						/* Actual place to write to */
-	u_char swritechunk[ZT_MAX_CHUNKSIZE];	/* Buffer to be written */
 	u_char *readchunk;						/* Actual place to read from */
-	u_char sreadchunk[ZT_MAX_CHUNKSIZE];	/* Preallocated static area */
 
-	/* Do we have to wake any polls up? */
-	int pollwake;
-	
 	/* Pointer to tx and rx gain tables */
 	u_char *rxgain;
 	u_char *txgain;
-	
-	/* Whether or not we have allocated gains or are using the default */
-	int gainalloc;
+	u_char idlebyte;	/* What to transmit while the span skips us */
+	int pipeline;		/* Media pipeline, see zt_chan_pipeline() */
 
 	/* Specified by driver, readable by zaptel */
+	struct zt_span *span;		/* Span we're a member of */
+	int sig;			/* Signalling */
+
+	/* Used only by zaptel -- NO DRIVER SERVICEABLE PARTS BELOW */
+	/* Conferencing stuff */
+	int		confna;	/* conference number (alias) */
+	int		_confn;	/* Actual conference number */
+	int		confmode;  /* conference mode */
+	int		confmute; /* conference mute mode */
+
+	/* Is echo cancellation enabled or disabled */
+	int		echocancel;
+	void		*ec;
+	struct zt_ec_engine	*ecengine;	/* Runs ec */
+	unsigned int	ecchunks;	/* Chunks it has cancelled */
+	int 	echostate;		/* State of echo canceller */
+	int		echolastupdate;	/* Last echo can update pos */
+	int		echotimer;		/* Timer for echo update */
+
+	int deflaw;		/* 1 = mulaw, 2=alaw, 0=undefined */
+	short *xlaw;
+#ifdef CONFIG_CALC_XLAW
+	unsigned char (*lineartoxlaw)(short a);
+#else
+	unsigned char *lin2x;
+#endif
+
+	/* The span's ends of the buffer rings (see rxtail below) */
+	volatile uint_t	rxhead;		/* read buffers filled */
+	volatile uint_t	txtail;		/* write buffers sent */
+	int		numbufs;			/* How many buffers in channel */
+	int		blocksize;	/* Block size */
+	int		txdisable;				/* Disable transmitter */
+	int 	rxdisable;				/* Disable receiver */
+	struct zt_ring	*ring;				/* Shared memory rings, if mapped */
+
+	volatile uint32_t	evhead;	/* next event slot to claim (free running) */
+	uint32_t	evtail;		/* next event slot to read, under lock */
+	int		iomask;  /* I/O Mux signal mask */
+
+	struct zt_tone *curtone;		/* Current tone we're playing (if any) */
+	int		tonep;					/* Current position in tone */
+	int 	dialing;
+	int	pdialcount;			/* pulse dial count */
+	int	afterdialingtimer;
+	int	toneflags;
+
+	/* Signalling state, run every tick */
+	volatile uint32_t	timerfired;	/* ZT_TIMER_* bits of expired timers */
+	int	pulsecount;		/* PULSE digit receiver stuff */
+	int rxsig;
+	int txsig;
+	int rxhooksig;
+	int txhooksig;
+
+	/* Per-chunk samples */
+	short	getlin[ZT_MAX_CHUNKSIZE] __attribute__((aligned(8)));			/* Last transmitted samples */
+	short	putlin[ZT_MAX_CHUNKSIZE] __attribute__((aligned(8)));			/* Last received samples */
+	short	getlin_lastchunk[ZT_MAX_CHUNKSIZE];	/* Last transmitted samples from last chunk */
+	short	conflast[ZT_MAX_CHUNKSIZE] __attribute__((aligned(8)));			/* Last conference sample -- base part of channel */
+	short	conflast1[ZT_MAX_CHUNKSIZE] __attribute__((aligned(8)));		/* Last conference sample  -- pseudo part of channel */
+	short	conflast2[ZT_MAX_CHUNKSIZE] __attribute__((aligned(8)));		/* Previous last conference sample -- pseudo part of channel */
+	u_char swritechunk[ZT_MAX_CHUNKSIZE];	/* Buffer to be written */
+	u_char sreadchunk[ZT_MAX_CHUNKSIZE];	/* Preallocated static area */
+	unsigned char getraw[ZT_MAX_CHUNKSIZE];		/* Last received raw data */
+	unsigned char putraw[ZT_MAX_CHUNKSIZE];		/* Last received raw data */
+
+	/* The reader's and writer's ends of the buffer rings, more than a
+	   cache line past the span's ends so user I/O doesn't bounce the
+	   lines the tick uses.  Each ring
+	   is single producer, single consumer: every counter only ever
+	   moves forward and is only written by its owner -- the span fills
+	   read buffers (rxhead) and drains write buffers (txtail), the
+	   reader and writer own these two.  readlock and writelock make
+	   sure there is only one reader and one writer at a time, however
+	   many threads share the channel. */
+	volatile uint_t	rxtail;		/* read buffers consumed */
+	volatile uint_t	txhead;		/* write buffers queued */
+	kmutex_t readlock;		/* Held while consuming a read buffer */
+	kmutex_t writelock;		/* Held while filling a write buffer */
+
+	/* Everything below is cold, or only used by some channels */
+	char name[40];		/* Name */
 	void *pvt;			/* Private channel data */
 	/* struct file *file; */	/* File structure */
 	int filemode;
-	
-	
-	struct zt_span *span;		/* Span we're a member of */
-	int sig;			/* Signalling */
 	int sigcap;			/* Capability for signalling */
-	
+	/* Shared gain tables behind rxgain/txgain, NULL when using the default */
+	struct zt_gaintab *gaintab;
+	/* Do we have to wake any polls up? */
+	int pollwake;
+
+	/* SF tone detection */
+	long rxp1;
+	long rxp2;
+	long rxp3;
+	int txtone;
+	int tx_v2;
+	int tx_v3;
+	int v1_1;
+	int v2_1;
+	int v3_1;
+	sf_detect_state_t rd;
 
-	/* Used only by zaptel -- NO DRIVER SERVICEABLE PARTS BELOW */
 	/* Buffer declarations */
 	u_char		*readbuf[ZT_MAX_NUM_BUFS];	/* read buffer */
-	int		inreadbuf;
-	int		outreadbuf;
-	kcondvar_t readbufq; /* read wait queue */
-
 	u_char		*writebuf[ZT_MAX_NUM_BUFS]; /* write buffers */
-	int		inwritebuf;
-	int		outwritebuf;
-	kcondvar_t writebufq; /* write wait queue */
-	
-	int		blocksize;	/* Block size */
-
-	int		eventinidx;  /* out index in event buf (circular) */
-	int		eventoutidx;  /* in index in event buf (circular) */
-	unsigned int	eventbuf[ZT_MAX_EVENTSIZE];  /* event circ. buffer */
-	kcondvar_t eventbufq; /* event wait queue */
-	
-	kcondvar_t txstateq;	/* waiting on the tx state to change */
-	
 	int		readn[ZT_MAX_NUM_BUFS];  /* # of bytes ready in read buf */
 	int		readidx[ZT_MAX_NUM_BUFS];  /* current read pointer */
 	int		writen[ZT_MAX_NUM_BUFS];  /* # of bytes ready in write buf */
 	int		writeidx[ZT_MAX_NUM_BUFS];  /* current write pointer */
-	
-	int		numbufs;			/* How many buffers in channel */
 	int		txbufpolicy;			/* Buffer policy */
 	int		rxbufpolicy;			/* Buffer policy */
-	int		txdisable;				/* Disable transmitter */
-	int 	rxdisable;				/* Disable receiver */
-	
-	
+	kcondvar_t readbufq; /* read wait queue */
+	kcondvar_t writebufq; /* write wait queue */
+
+	struct zt_evslot evring[ZT_MAX_EVENTSIZE];	/* event ring, see __qevent() */
+	volatile uint32_t evdropped;	/* events lost to a full ring */
+	kcondvar_t eventbufq; /* event wait queue */
+	kcondvar_t txstateq;	/* waiting on the tx state to change */
+	struct pollhead sel;		/* thingy for select stuff */
+	uint64_t muxwatch;		/* Bit n: /dev/zap/mux instance n watches us */
+
 	/* Tone zone stuff */
 	struct zt_zone *current_zone;		/* Zone for selecting tones */
 	int 	tonezone;				/* Tone zone for this channel */
-	struct zt_tone *curtone;		/* Current tone we're playing (if any) */
-	int		tonep;					/* Current position in tone */
 	struct zt_tone_state ts;		/* Tone state */
 
-	/* Pulse dial stuff */
-	int	pdialcount;			/* pulse dial count */
-
 	/* Ring cadence */
 	int ringcadence[ZT_MAX_CADENCE];
 	int firstcadencepos;				/* Where to restart ring cadence */
@@ -993,50 +1336,21 @@ struct zt_chan {
 	/* Digit string dialing stuff */
 	int		digitmode;			/* What kind of tones are we sending? */
 	char	txdialbuf[ZT_MAX_DTMF_BUF];
-	int 	dialing;
-	int	afterdialingtimer;
 	int		cadencepos;				/* Where in the cadence we are */
 
-	/* I/O Mask */	
-	int		iomask;  /* I/O Mux signal mask */
-	struct pollhead sel;		/* thingy for select stuff */
-	
 	/* HDLC state machines */
 	struct fasthdlc_state txhdlc;
 	struct fasthdlc_state rxhdlc;
 	int infcs;
 
-	/* Conferencing stuff */
-	int		confna;	/* conference number (alias) */
-	int		_confn;	/* Actual conference number */
-	int		confmode;  /* conference mode */
-	int		confmute; /* conference mute mode */
-
 	/* Incoming and outgoing conference chunk queues for
 	   communicating between zaptel master time and
 	   other boards */
 	struct confq confin;
 	struct confq confout;
 
-	short	getlin[ZT_MAX_CHUNKSIZE];			/* Last transmitted samples */
-	unsigned char getraw[ZT_MAX_CHUNKSIZE];		/* Last received raw data */
-	short	getlin_lastchunk[ZT_MAX_CHUNKSIZE];	/* Last transmitted samples from last chunk */
-	short	putlin[ZT_MAX_CHUNKSIZE];			/* Last received samples */
-	unsigned char putraw[ZT_MAX_CHUNKSIZE];		/* Last received raw data */
-	short	conflast[ZT_MAX_CHUNKSIZE];			/* Last conference sample -- base part of channel */
-	short	conflast1[ZT_MAX_CHUNKSIZE];		/* Last conference sample  -- pseudo part of channel */
-	short	conflast2[ZT_MAX_CHUNKSIZE];		/* Previous last conference sample -- pseudo part of channel */
-	
-
-	/* Is echo cancellation enabled or disabled */
-	int		echocancel;
-	echo_can_state_t	*ec;
 	echo_can_disable_detector_state_t txecdis;
 	echo_can_disable_detector_state_t rxecdis;
-	
-	int 	echostate;		/* State of echo canceller */
-	int		echolastupdate;	/* Last echo can update pos */
-	int		echotimer;		/* Timer for echo update */
 
 	/* RBS timings  */
 	int		prewinktime;  /* pre-wink time (ms) */
@@ -1051,44 +1365,24 @@ struct zt_chan {
 	int		pulsemaketime;  /* pulse line closed time (ms) */
 	int		pulseaftertime; /* pulse time between digits (ms) */
 
-	/* RING debounce timer */
-	int	ringdebtimer;
-	
-	/* RING trailing detector to make sure a RING is really over */
-	int ringtrailer;
-
-	/* PULSE digit receiver stuff */
-	int	pulsecount;
-	int	pulsetimer;
+	/* RBS timers, see struct zt_timer */
+	struct zt_timer	itimer;
+	struct zt_timer	otimer;
+	struct zt_timer	ringdebtimer;	/* RING debounce timer */
+	struct zt_timer	ringtrailer;	/* RING trailing detector to make sure a RING is really over */
+	struct zt_timer	pulsetimer;	/* PULSE digit receiver timeout */
 
-	/* RBS timers */
-	int 	itimerset;		/* what the itimer was set to last */
-	int 	itimer;
-	int 	otimer;
-	
 	/* RBS state */
+	int 	itimerset;		/* what the itimer was set to last */
 	int gotgs;
 	int txstate;
-	int rxsig;
-	int txsig;
 	int rxsigstate;
 
 	/* non-RBS rx state */
-	int rxhooksig;
-	int txhooksig;
 	int kewlonhook;
 
 	/* Idle signalling if CAS signalling */
 	int idlebits;
-
-	int deflaw;		/* 1 = mulaw, 2=alaw, 0=undefined */
-	short *xlaw;
-#ifdef CONFIG_CALC_XLAW
-	unsigned char (*lineartoxlaw)(short a);
-#else
-	unsigned char *lin2x;
-#endif
-
 };
 
 /* defines for transmit signalling */
@@ -1161,6 +1455,13 @@ struct zt_span {
 
 	struct zt_chan *chans;		/* Member channel structures */
 
+	/* Samples per channel moved by each zt_receive()/zt_transmit(), a
+	   multiple of ZT_CHUNKSIZE up to ZT_MAX_SPAN_CHUNKSIZE (0 means
+	   ZT_CHUNKSIZE).  Above ZT_CHUNKSIZE every channel's readchunk and
+	   writechunk must point at a buffer that large, the span never
+	   provides timing, and its channels can't be conferenced. */
+	int chunksize;
+
 	/*   ==== Span Callback Operations ====   */
 	/* Req: Set the requested chunk size.  This is the unit in which you must
 	   report results for conferencing, etc */
@@ -1216,6 +1517,14 @@ struct zt_span {
 	int offset;			/* Offset within a given card */
 	int lastalarms;		/* Previous alarms */
 
+	/* Channel timers, advanced by zt_receive() and zt_transmit() */
+	struct zt_timerwheel rxwheel;
+	struct zt_timerwheel txwheel;
+
+	/* Channels zt_receive() and zt_transmit() can skip, one bit per
+	   channel position */
+	uint32_t *idlemap;
+
 	/* If the watchdog detects no received data, it will call the
 	   watchdog routine */
 	int (*watchdog)(struct zt_span *span, int cause);
@@ -1307,7 +1616,8 @@ extern struct zt_tone *zt_dtmf_tone(char digit, int mf);
    should be called by the low-level driver as close to the interface
    as possible.  ECHO CANCELLATION IS NO LONGER AUTOMATICALLY DONE
    AT THE ZAPTEL LEVEL.  zt_ec_chunk will not echo cancel if it should
-   not be doing so.  rxchunk is modified in-place */
+   not be doing so.  rxchunk is modified in-place.  Spans with a larger
+   chunksize call it once per ZT_CHUNKSIZE piece. */
 
 extern void zt_ec_chunk(struct zt_chan *chan, unsigned char *rxchunk, const unsigned char *txchunk);
 
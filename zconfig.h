@@ -38,13 +38,25 @@
 /* #define CONFIG_ZAPTEL_MMX */
 
 /*
- * Pick your echo canceller: MARK2, MARK3, STEVE, or STEVE2 :)
+ * Define to let the conference mixer use SSE2 paddsw/psubsw on x86 when
+ * the CPU has it.  Like CONFIG_ZAPTEL_MMX this clobbers %xmm registers
+ * without saving the FPU context, so only enable it on kernels where
+ * that is known to be safe.  Otherwise the 64-bit integer lane code in
+ * arith.h is used.
+ */
+/* #define CONFIG_ZAPTEL_SSE2 */
+
+/*
+ * Pick your default echo canceller: MARK2, NLMS, or PBFD :)  All three
+ * are built in and ZT_ECHOCANCEL can ask for any of them per channel;
+ * this is the one a channel gets when it doesn't.  MARK2 and PBFD also
+ * take 512 and 1024 taps, for long tails.  MARK2 finds where in the
+ * tail the echo is and only runs those taps; PBFD works in the frequency
+ * domain; NLMS is the cheapest, for short tails up to 256 taps.
  */ 
-/* #define ECHO_CAN_STEVE */
-/* #define ECHO_CAN_STEVE2 */
-/* #define ECHO_CAN_MARK */
 /* #define ECHO_CAN_MARK2 */
-/* #define ECHO_CAN_MARK3 */
+/* #define ECHO_CAN_NLMS */
+/* #define ECHO_CAN_PBFD */
 
 /*
  * Uncomment for aggressive residual echo supression under 
@@ -195,9 +195,10 @@ int dspanconfig(char *keyword, char *args)
 	int res;
 	int chans;
 	int timing;
-	argc = res = parseargs(args, realargs, 4, ',');
-	if (res != 4) {
-		error("Incorrect number of arguments to 'dynamic' (should be <driver>,<address>,<num channels>, <timing>)\n");
+	int chunksize = 0;
+	argc = res = parseargs(args, realargs, 5, ',');
+	if ((res < 4) || (res > 5)) {
+		error("Incorrect number of arguments to 'dynamic' (should be <driver>,<address>,<num channels>, <timing>[, <samples>])\n");
 	}
 	res = sscanf(realargs[2], "%d", &chans);
 	if ((res == 1) && (chans < 1))
@@ -213,11 +214,23 @@ int dspanconfig(char *keyword, char *args)
 		error("Invalid timing '%s', should be a number > 0.\n", realargs[3]);
 	}
 
+	if (argc > 4) {
+		res = sscanf(realargs[4], "%d", &chunksize);
+		if ((res == 1) && ((chunksize < ZT_CHUNKSIZE) || (chunksize > ZT_MAX_SPAN_CHUNKSIZE) ||
+		    (chunksize % ZT_CHUNKSIZE)))
+			res = -1;
+		if (res != 1) {
+			error("Invalid samples '%s', should be a multiple of %d up to %d.\n", realargs[4],
+				ZT_CHUNKSIZE, ZT_MAX_SPAN_CHUNKSIZE);
+		}
+	}
+
 
 	strncpy(zds[numdynamic].driver, realargs[0], sizeof(zds[numdynamic].driver));
 	strncpy(zds[numdynamic].addr, realargs[1], sizeof(zds[numdynamic].addr));
 	zds[numdynamic].numchans = chans;
 	zds[numdynamic].timing = timing;
+	zds[numdynamic].chunksize = chunksize;
 	
 	numdynamic++;
 	return 0;
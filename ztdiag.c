@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "zaptel.h"
 
@@ -11,8 +12,14 @@ int main(int argc, char *argv[])
 {
 	int fd;
 	int chan;
-	if ((argc < 2) || (sscanf(argv[1], "%d", &chan) != 1)) {
+	int x;
+	struct zt_ecpool_stats ecs;
+	struct zt_ecengines ece;
+	char *name;
+	int y;
+	if ((argc < 2) || ((strcmp(argv[1], "-e")) && (sscanf(argv[1], "%d", &chan) != 1))) {
 		fprintf(stderr, "Usage: ztdiag <channel>\n");
+		fprintf(stderr, "       ztdiag -e    (echo canceller engines and pool)\n");
 		exit(1);
 	}
 	fd = open("/dev/zap/ctl");
@@ -20,6 +27,39 @@ int main(int argc, char *argv[])
 		perror("open(/dev/zap/ctl");
 		exit(1);
 	}
+	if (!strcmp(argv[1], "-e")) {
+		if (ioctl(fd, ZT_GETECENGINES, &ece)) {
+			perror("ioctl(ZT_GETECENGINES)");
+			exit(1);
+		}
+		if (ioctl(fd, ZT_GETECPOOL, &ecs)) {
+			perror("ioctl(ZT_GETECPOOL)");
+			exit(1);
+		}
+		printf("engine  max taps  channels    bytes  ns/sample  CPU/channel\n");
+		for (x=0;x<ece.count;x++) {
+			printf("%-6s %9d %9d %8d", ece.eng[x].name, ece.eng[x].maxtaps,
+				ece.eng[x].chans, ece.eng[x].bytes);
+			if (ece.eng[x].samples)
+				printf(" %10.1f %11.3f%%\n",
+					(double)ece.eng[x].ns / ece.eng[x].samples,
+					(double)ece.eng[x].ns / ece.eng[x].samples * 8000 / 1e7);
+			else
+				printf(" %10s %12s\n", "-", "-");
+		}
+		printf("\nBuilt in %d, analog channels get %d, digital %d\n\n",
+			ece.builtin, ece.analog, ece.digital);
+		printf("engine  taps    bytes   free  in use  high water  failed\n");
+		for (x=0;x<ecs.count;x++) {
+			name = "?";
+			for (y=0;y<ece.count;y++)
+				if (ece.eng[y].id == ecs.cls[x].engine)
+					name = ece.eng[y].name;
+			printf("%-6s %5d %8d %6d %7d %11d %7d\n", name, ecs.cls[x].taps, ecs.cls[x].size,
+				ecs.cls[x].free, ecs.cls[x].inuse, ecs.cls[x].hiwat, ecs.cls[x].fails);
+		}
+		exit(0);
+	}
 	if (ioctl(fd, ZT_CHANDIAG, &chan)) {
 		perror("ioctl(ZT_CHANDIAG)");
 		exit(1);
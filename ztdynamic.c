@@ -33,6 +33,7 @@
 #include <sys/pci.h>
 #include <sys/kmem.h>
 #include <sys/ksynch.h>
+#include <sys/atomic.h>
 #include <netinet/in.h>
 #include <stddef.h>
 
@@ -79,7 +80,8 @@ static void *ztdynamic_statep;
  *  types.  Message format is as follows:
  *
  *         Byte #:          Meaning
- *         0                Number of samples per channel
+ *         0                Number of samples per channel, the span's
+ *                          chunk size (8 to 80 in steps of 8)
  *         1                Current flags on span
  *		   Bit    0: Yellow Alarm
  *	                        Bit    1: Sig bits present
@@ -124,6 +126,10 @@ static struct zt_dynamic {
 	int master;
 	unsigned char *msgbuf;
 	size_t msgbuf_size;
+	int chunksize;			/* Samples per channel per message */
+	int due;			/* Samples of timing not yet run */
+	unsigned char *chunkbuf;	/* Channel chunks above ZT_CHUNKSIZE */
+	size_t chunkbuf_size;
 } *dspans;
 	
 static struct zt_dynamic_driver *drivers =  NULL;
@@ -131,6 +137,35 @@ static int debug = 1;
 static int hasmaster = 0;
 static spinlock_t dlock;
 
+/*
+ * Parallel span processing.  With ztd_threads set above one (from
+ * /etc/system), each tick hands the live spans' own work (echo
+ * cancellation, receive, transmit and the signalling timers they run)
+ * to ztdynamic_tick() on a taskq.  The tick comes from interrupt
+ * context or from zt_receive(), so it never waits there for helper
+ * threads it may have preempted.  ztdynamic_tick() claims spans one at
+ * a time along with the helpers it starts, and sleeps until the rest
+ * are done.  While a tick's spans are still running, later ticks only
+ * add up their samples, and the next run catches up on them.  The
+ * conference phase is still serialized by zaptel itself when the
+ * master span's receive gets there.
+ */
+#define ZTD_MAX_THREADS		16
+
+int ztd_threads = 0;
+
+static ddi_taskq_t *ztd_taskq = NULL;
+static int ztd_nthreads = 0;
+static struct zt_dynamic *ztd_runq[ZT_MAX_SPANS];
+static volatile uint32_t ztd_claim[ZT_MAX_SPANS];	/* Last generation claimed */
+static int ztd_runn = 0;
+static volatile uint32_t ztd_gen = 0;
+static kmutex_t ztd_lock;
+static kcondvar_t ztd_cv;
+static uint32_t ztd_left = 0;		/* Protected by ztd_lock */
+static volatile int ztd_busy = 0;	/* Spans running on the taskq */
+static volatile uint32_t ztd_pending = 0;	/* Samples of ticks while busy */
+
 static void 
 checkmaster(void)
 {
@@ -176,7 +211,7 @@ ztd_sendmessage(struct zt_dynamic *z)
 	int offset;
 
 	/* Byte 0: Number of samples per channel */
-	*buf = ZT_CHUNKSIZE;
+	*buf = z->chunksize;
 	buf++; msglen++;
 
 	/* Byte 1: Flags */
@@ -218,33 +253,138 @@ ztd_sendmessage(struct zt_dynamic *z)
 	}
 	
 	for (x=0;x<z->span.channels;x++) {
-		memcpy(buf, z->chans[x].writechunk, ZT_CHUNKSIZE);
-		buf += ZT_CHUNKSIZE;
-		msglen += ZT_CHUNKSIZE;
+		memcpy(buf, z->chans[x].writechunk, z->chunksize);
+		buf += z->chunksize;
+		msglen += z->chunksize;
 	}
 	
 	z->driver->transmit(z->pvt, z->msgbuf, msglen);
 }
 
+static void 
+ztdynamic_run_span(struct zt_dynamic *z)
+{
+	int y, off;
+
+	/* Spans run at their own message rate off the timing source */
+	while (z->due >= z->chunksize) {
+		z->due -= z->chunksize;
+		for (y=0;y<z->span.channels;y++) {
+			/* Echo cancel double buffered data */
+			for (off=0;off<z->chunksize;off+=ZT_CHUNKSIZE)
+				zt_ec_chunk(&z->span.chans[y], z->span.chans[y].readchunk + off,
+					z->span.chans[y].writechunk + off);
+		}
+		zt_receive(&z->span);
+		zt_transmit(&z->span);
+		/* Handle all transmissions now */
+		ztd_sendmessage(z);
+	}
+}
+
+static void 
+ztdynamic_work(void *arg)
+{
+	uint32_t gen;
+	int x;
+
+	gen = ztd_gen;
+	membar_consumer();
+	for (x=0;x<ztd_runn;x++) {
+		/* A job left over from an older tick can never win the claim */
+		if (atomic_cas_32(&ztd_claim[x], gen - 1, gen) != gen - 1)
+			continue;
+		ztdynamic_run_span(ztd_runq[x]);
+		mutex_enter(&ztd_lock);
+		if (!--ztd_left)
+			cv_signal(&ztd_cv);
+		mutex_exit(&ztd_lock);
+	}
+}
+
+/* One tick's spans, on the taskq */
+static void 
+ztdynamic_tick(void *arg)
+{
+	int x;
+
+	/* A failed dispatch only costs parallelism */
+	for (x=1;(x < ztd_nthreads) && (x < ztd_runn);x++)
+		if (ddi_taskq_dispatch(ztd_taskq, ztdynamic_work, NULL, DDI_NOSLEEP) != DDI_SUCCESS)
+			break;
+	ztdynamic_work(NULL);
+	mutex_enter(&ztd_lock);
+	while (ztd_left)
+		cv_wait(&ztd_cv, &ztd_lock);
+	mutex_exit(&ztd_lock);
+	membar_exit();
+	ztd_busy = 0;
+}
+
+/* Wait for the spans of a tick still running on the taskq, so that a
+   span unlinked before the call is no longer in use */
+static void 
+ztd_sync(void)
+{
+	membar_enter();
+	while (ztd_busy)
+		delay(1);
+}
+
+/* Run the spans for samples worth of timing */
 static inline void 
-ztdynamic_run(void)
+ztdynamic_run(int samples)
 {
 	unsigned long flags;
 	struct zt_dynamic *z;
-	int y;
+
+	if (ztd_busy) {
+		/* Not even dlock: the spans still running may be what
+		   called us, through zt_receive() */
+		atomic_add_32(&ztd_pending, samples);
+		return;
+	}
 	spin_lock_irqsave(&dlock, flags);
+	if (ztd_busy) {
+		/* Somebody else got in first */
+		spin_unlock_irqrestore(&dlock, flags);
+		atomic_add_32(&ztd_pending, samples);
+		return;
+	}
+	samples += atomic_swap_32(&ztd_pending, 0);
+	if (ztd_nthreads > 1) {
+		ztd_runn = 0;
+		for (z = dspans; z && (ztd_runn < ZT_MAX_SPANS); z = z->next) {
+			if (z->dead)
+				continue;
+			z->due += samples;
+			if (z->due >= z->chunksize) {
+				ztd_claim[ztd_runn] = ztd_gen;
+				ztd_runq[ztd_runn++] = z;
+			}
+		}
+		if (!ztd_runn) {
+			spin_unlock_irqrestore(&dlock, flags);
+			return;
+		}
+		ztd_left = ztd_runn;
+		ztd_busy = 1;
+		membar_producer();
+		ztd_gen++;
+		if (ddi_taskq_dispatch(ztd_taskq, ztdynamic_tick, NULL, DDI_NOSLEEP) == DDI_SUCCESS) {
+			spin_unlock_irqrestore(&dlock, flags);
+			return;
+		}
+		/* Run them here instead; their samples are already due */
+		ztd_busy = 0;
+		samples = 0;
+	}
 	z = dspans;
 	while(z) {
+		/* Ignore dead spans */
 		if (!z->dead) {
-			/* Ignore dead spans */
-			for (y=0;y<z->span.channels;y++) {
-				/* Echo cancel double buffered data */
-				zt_ec_chunk(&z->span.chans[y], z->span.chans[y].readchunk, z->span.chans[y].writechunk);
-			}
-			zt_receive(&z->span);
-			zt_transmit(&z->span);
-			/* Handle all transmissions now */
-			ztd_sendmessage(z);
+			z->due += samples;
+			ztdynamic_run_span(z);
 		}
 		z = z->next;
 	}
@@ -276,11 +416,11 @@ zt_dynamic_receive(struct zt_span *span, unsigned char *msg, int msglen)
 	}
 	
 	/* First, check the chunksize */
-	if (*msg != ZT_CHUNKSIZE) {
+	if (*msg != ztd->chunksize) {
 		spin_unlock_irqrestore(&dlock, flags);
 		newerr = ERR_NSAMP | msg[0];
 		if (newerr != 	ztd->err) {
-			printk("Span %s: Expected %d samples, but receiving %d\n", span->name, ZT_CHUNKSIZE, msg[0]);
+			printk("Span %s: Expected %d samples, but receiving %d\n", span->name, ztd->chunksize, msg[0]);
 		}
 		ztd->err = newerr;
 		return;
@@ -318,7 +458,7 @@ zt_dynamic_receive(struct zt_span *span, unsigned char *msg, int msglen)
 	/* Start with header */
 	xlen = 6;
 	/* Add samples of audio */
-	xlen += nchans * ZT_CHUNKSIZE;
+	xlen += nchans * ztd->chunksize;
 	/* If RBS info is there, add that */
 	if (sflags & ZTD_FLAG_SIGBITS_PRESENT) {
 		/* Account for sigbits -- one short per 4 channels*/
@@ -360,11 +500,11 @@ zt_dynamic_receive(struct zt_span *span, unsigned char *msg, int msglen)
 	/* Record data for channels */
 	for (x=0;x<nchans;x++) {
         if (span->chans[x].readchunk != NULL) {
-    		memcpy(span->chans[x].readchunk, msg, ZT_CHUNKSIZE);
+    		memcpy(span->chans[x].readchunk, msg, ztd->chunksize);
         } else {
             cmn_err(CE_CONT, "Tried to access invalid channel %d readchunk.\n", x);
         }
-		msg += ZT_CHUNKSIZE;
+		msg += ztd->chunksize;
 	}
 
 	master = ztd->master;
@@ -386,7 +526,7 @@ zt_dynamic_receive(struct zt_span *span, unsigned char *msg, int msglen)
 
 	/* If this is our master span, then run everything */
 	if (master)
-		ztdynamic_run();
+		ztdynamic_run(ztd->chunksize);
 	
 }
 
@@ -405,6 +545,9 @@ dynamic_destroy(struct zt_dynamic *z)
 	if (z->msgbuf)
 		kmem_free(z->msgbuf, z->msgbuf_size);
 
+	if (z->chunkbuf)
+		kmem_free(z->chunkbuf, z->chunkbuf_size);
+
 	/* Free channels */
 	if (z->chans);
 		kmem_free(z->chans, z->chans_size);
@@ -471,10 +614,11 @@ destroy_dynamic(ZT_DYNAMIC_SPAN *zds)
 		prev = cur;
 		cur = cur->next;
 	}
-	/* Destroy it */
-	dynamic_destroy(z);
-
 	spin_unlock_irqrestore(&dlock, flags);
+
+	/* Destroy it, once the taskq is done with it */
+	ztd_sync();
+	dynamic_destroy(z);
 	return (0);
 }
 
@@ -511,8 +655,10 @@ ztd_close(struct zt_chan *chan)
 	z = chan->span->pvt;
 	if (z) 
 		z->usecount--;
-	if (z->dead && !z->usecount)
+	if (z->dead && !z->usecount) {
+		ztd_sync();
 		dynamic_destroy(z);
+	}
 	return (0);
 }
 
@@ -533,6 +679,13 @@ create_dynamic(ZT_DYNAMIC_SPAN *zds)
 		printk("Can't create dynamic span with greater than %d channels.  See ztdynamic.c and increase ZT_DYNAMIC_MAX_CHANS\n", zds->numchans);
 		return (-EINVAL);
 	}
+	if (!zds->chunksize)
+		zds->chunksize = ZT_CHUNKSIZE;
+	if ((zds->chunksize < ZT_CHUNKSIZE) || (zds->chunksize > ZT_MAX_SPAN_CHUNKSIZE) ||
+	    (zds->chunksize % ZT_CHUNKSIZE)) {
+		printk("Samples per message must be a multiple of %d up to %d (%d)\n", ZT_CHUNKSIZE, ZT_MAX_SPAN_CHUNKSIZE, zds->chunksize);
+		return (-EINVAL);
+	}
 
 	spin_lock_irqsave(&dlock, flags);
 	z = find_dynamic(zds);
@@ -561,7 +714,7 @@ create_dynamic(ZT_DYNAMIC_SPAN *zds)
 	}
 
 	/* Allocate message buffer with sample space and header space */
-	bufsize = zds->numchans * ZT_CHUNKSIZE + zds->numchans / 4 + 48;
+	bufsize = zds->numchans * zds->chunksize + zds->numchans / 4 + 48;
 
 	z->msgbuf_size = bufsize;
 	z->msgbuf = kmem_zalloc(bufsize, KM_NOSLEEP);
@@ -571,10 +724,22 @@ create_dynamic(ZT_DYNAMIC_SPAN *zds)
 		return (-ENOMEM);
 	}
 
+	/* zaptel's own channel chunks only hold ZT_CHUNKSIZE */
+	if (zds->chunksize > ZT_CHUNKSIZE) {
+		z->chunkbuf_size = zds->numchans * zds->chunksize * 2;
+		z->chunkbuf = kmem_zalloc(z->chunkbuf_size, KM_NOSLEEP);
+		if (!z->chunkbuf) {
+			dynamic_destroy(z);
+			return (-ENOMEM);
+		}
+	}
+
 	/* Setup parameters properly assuming we're going to be okay. */
 	strncpy(z->dname, zds->driver, sizeof(z->driver) - 1);
 	strncpy(z->addr, zds->addr, sizeof(z->addr) - 1);
 	z->timing = zds->timing;
+	z->chunksize = zds->chunksize;
+	z->span.chunksize = zds->chunksize;
 	sprintf(z->span.name, "ZTD/%s/%s", zds->driver, zds->addr);
 	sprintf(z->span.desc, "Dynamic '%s' span at '%s'", zds->driver, zds->addr);
 	z->span.channels = zds->numchans;
@@ -593,6 +758,10 @@ create_dynamic(ZT_DYNAMIC_SPAN *zds)
 				     ZT_SIG_FXOKS | ZT_SIG_FXOGS | ZT_SIG_SF | ZT_SIG_DACS_RBS;
 		z->chans[x].chanpos = x + 1;
 		z->chans[x].pvt = z;
+		if (z->chunkbuf) {
+			z->chans[x].readchunk = z->chunkbuf + x * zds->chunksize * 2;
+			z->chans[x].writechunk = z->chans[x].readchunk + zds->chunksize;
+		}
 	}
 	
 	spin_lock_irqsave(&dlock, flags);
@@ -650,7 +819,7 @@ ztdynamic_ioctl(int cmd, intptr_t data, int mode)
 		   spans are pulling timing, then now is the time to process
 		   them */
 		if (!hasmaster)
-			ztdynamic_run();
+			ztdynamic_run(ZT_CHUNKSIZE);
 		return (0);
 	case ZT_DYNAMIC_CREATE:
 		ddi_copyin((void *)data, &zds, sizeof(zds), mode);
@@ -698,7 +867,7 @@ void
 zt_dynamic_unregister(struct zt_dynamic_driver *dri)
 {
 	struct zt_dynamic_driver *cur, *prev=NULL;
-	struct zt_dynamic *z, *zp, *zn;
+	struct zt_dynamic *z, *zp, *zn, *gone = NULL;
 	unsigned long flags;
 
 	spin_lock_irqsave(&dlock, flags);
@@ -724,9 +893,10 @@ zt_dynamic_unregister(struct zt_dynamic_driver *dri)
 				zp->next = z->next;
 			else
 				dspans = z->next;
-			if (!z->usecount)
-				dynamic_destroy(z);
-			else
+			if (!z->usecount) {
+				z->next = gone;
+				gone = z;
+			} else
 				z->dead = 1;
 		} else {
 			zp = z;
@@ -734,6 +904,13 @@ zt_dynamic_unregister(struct zt_dynamic_driver *dri)
 		z = zn;
 	}
 	spin_unlock_irqrestore(&dlock, flags);
+	/* Destroy them once the taskq is done with them */
+	if (gone)
+		ztd_sync();
+	for (z = gone; z; z = zn) {
+		zn = z->next;
+		dynamic_destroy(z);
+	}
 }
 
 static void 
@@ -925,6 +1102,8 @@ ztdynamic_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
 	/* Get our mutex configured */
 	if (debug) cmn_err(CE_CONT, "Initializing mutex.\n");
 	spin_lock_init(&dlock);
+	mutex_init(&ztd_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&ztd_cv, NULL, CV_DRIVER, NULL);
 	
     /* Setup a high-resolution timer using an undocumented API - May bust! */
     hdlr.cyh_func = check_for_red_alarm;
@@ -938,6 +1117,23 @@ ztdynamic_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
     ztd->cyclic = cyclic_add(&hdlr, &when);
     mutex_exit(&cpu_lock);
 
+	ztd_nthreads = ztd_threads;
+	if (ztd_nthreads > ZTD_MAX_THREADS)
+		ztd_nthreads = ZTD_MAX_THREADS;
+	if (ztd_nthreads > ncpus)
+		ztd_nthreads = ncpus;
+	if (ztd_nthreads > 1) {
+		/* ztdynamic_tick() and its helpers */
+		ztd_taskq = ddi_taskq_create(dip, "ztd_run", ztd_nthreads, TASKQ_DEFAULTPRI, 0);
+		if (ztd_taskq)
+			cmn_err(CE_CONT, "TDMoX: processing spans on %d CPUs\n", ztd_nthreads);
+		else {
+			cmn_err(CE_CONT, "TDMoX: unable to start span processing threads\n");
+			ztd_nthreads = 0;
+		}
+	} else
+		ztd_nthreads = 0;
+
 	zt_set_dynamic_ioctl(ztdynamic_ioctl);
 	
     cmn_err(CE_CONT, "Zaptel Dynamic Span support LOADED\n");
@@ -949,6 +1145,7 @@ ztdynamic_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
 {
     int instance;
     struct ztdynamic_state *ztd;
+    unsigned long flags;
 
     instance = ddi_get_instance(dip);
 
@@ -964,8 +1161,19 @@ ztdynamic_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
     mutex_enter(&cpu_lock);
     cyclic_remove(ztd->cyclic);
     mutex_exit(&cpu_lock);
+
+	/* Stop the span processing threads */
+	spin_lock_irqsave(&dlock, flags);
+	ztd_nthreads = 0;
+	spin_unlock_irqrestore(&dlock, flags);
+	if (ztd_taskq) {
+		ddi_taskq_destroy(ztd_taskq);
+		ztd_taskq = NULL;
+	}
 	
 	/* Remove Mutex */
+	cv_destroy(&ztd_cv);
+	mutex_destroy(&ztd_lock);
 	mutex_destroy(&dlock);
 
     return (DDI_SUCCESS);